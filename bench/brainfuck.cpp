@@ -0,0 +1,84 @@
+/*
+    The Brainfuck interpreter from examples/, running a program with three
+    nested loops: a switch-dispatch heavy workload.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static
+void *
+xmalloc(size_t n)
+{
+    void *p = malloc(n);
+    if (n && !p) {
+        puts("Out of memory.");
+        exit(1);
+    }
+    return p;
+}
+
+static
+const char *
+jump(const char *p, bool forward)
+{
+    int balance = 0;
+    do {
+        switch (*p) {
+        case '[': ++balance; break;
+        case ']': --balance; break;
+        }
+        if (forward) {
+            ++p;
+        } else {
+            --p;
+        }
+    } while (balance != 0);
+    return p;
+}
+
+int main() {
+    // 30 * 30 * 30 inner iterations, then prints 'A' and a newline
+    const char *prog =
+        "++++++++++++++++++++++++++++++"
+        "[>++++++++++++++++++++++++++++++"
+        "[>++++++++++++++++++++++++++++++"
+        "[>+>+<<-]<-]<-]"
+        ">>>>[-]+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++.[-]++++++++++.";
+
+    const size_t NMEM = 30000;
+    char *p = (char *) xmalloc(NMEM);
+    for (size_t i = 0; i < NMEM; ++i) {
+        p[i] = 0;
+    }
+
+    for (; *prog; ++prog) {
+        switch (*prog) {
+            case '>':
+                ++p;
+                break;
+            case '<':
+                --p;
+                break;
+            case '+':
+                ++*p;
+                break;
+            case '-':
+                --*p;
+                break;
+            case '.':
+                printf("%c", *p);
+                break;
+            case '[':
+                if (!*p) {
+                    prog = jump(prog, true);
+                    --prog;
+                }
+                break;
+            case ']':
+                prog = jump(prog, false);
+                break;
+        }
+    }
+}
@@ -0,0 +1,40 @@
+/*
+    Bubble sort, scaled up: templates, iterators and 32-bit loads/stores.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <functional>
+#include <iterator>
+
+
+template <class RandomAccessIterator,
+          class Comparator = std::less<typename std::iterator_traits<RandomAccessIterator>::value_type>>
+void bubble_sort(RandomAccessIterator first,
+                 RandomAccessIterator last, Comparator cmp = Comparator()) {
+    for (auto i = first; i != last; ++i)
+        for (auto j = i + 1; j != last; ++j)
+            if (cmp(*j, *i))
+                std::swap(*i, *j);
+}
+
+
+int main() {
+    size_t n = 3000;
+    unsigned *array = (unsigned *) malloc(n * sizeof(unsigned));
+    unsigned long seed = 12345;
+    for (size_t i = 0; i < n; ++i) {
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        array[i] = (unsigned) (seed >> 40);
+    }
+
+    bubble_sort(array, array + n);
+
+    unsigned long check = 0;
+    for (size_t i = 0; i < n; ++i)
+        check = check * 31 + array[i];
+    printf("%u %u %lu\n", array[0], array[n - 1], check);
+
+    free(array);
+}
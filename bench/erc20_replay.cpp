@@ -0,0 +1,209 @@
+/*
+    ERC20-style transaction replay: the token contract from
+    examples/contract.cpp processing a deterministic stream of transfers.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <new>
+#include <utility>
+
+#define smart_contract
+
+template<class T> static
+T *
+alloc_for(size_t n)
+{
+    void *p = malloc(sizeof(T) * n);
+    if (n && !p) {
+        puts("Out of memory.");
+        exit(1);
+    }
+    return static_cast<T *>(p);
+}
+
+template<class T> static
+T *
+zalloc_for(size_t n)
+{
+    void *p = calloc(n, sizeof(T));
+    if (n && !p) {
+        puts("Out of memory.");
+        exit(1);
+    }
+    return static_cast<T *>(p);
+}
+
+template<class T, class ...Args>
+T *
+create(Args&& ...args)
+{
+    T *ptr = alloc_for<T>(1);
+    new (ptr) T(std::forward<Args>(args)...);
+    return ptr;
+}
+
+class Hashtable
+{
+    uint64_t ndata_;
+    uintptr_t keys_;
+    uintptr_t values_;
+
+    uint64_t *
+    get_keys_ptr_() const
+    {
+        return reinterpret_cast<uint64_t *>(keys_);
+    }
+
+    uint64_t *
+    get_values_ptr_() const
+    {
+        return reinterpret_cast<uint64_t *>(values_);
+    }
+public:
+
+    Hashtable(size_t nreserve = 1024)
+        : ndata_(nreserve)
+        , keys_(reinterpret_cast<uintptr_t>(zalloc_for<uint64_t>(ndata_)))
+        , values_(reinterpret_cast<uintptr_t>(zalloc_for<uint64_t>(ndata_)))
+    {}
+
+    void
+    insert(uint64_t k, uint64_t v)
+    {
+        uint64_t *keys = get_keys_ptr_();
+        uint64_t *values = get_values_ptr_();
+        uint64_t i = k % ndata_;
+        while (keys[i] != k) {
+            if (!keys[i]) {
+                keys[i] = k;
+                break;
+            }
+            i = (i + 1) % ndata_;
+        }
+        values[i] = v;
+    }
+
+    uint64_t
+    get(uint64_t k) const
+    {
+        uint64_t *keys = get_keys_ptr_();
+        uint64_t *values = get_values_ptr_();
+        uint64_t i = k % ndata_;
+        while (keys[i]) {
+            if (keys[i] == k) {
+                return values[i];
+            }
+            i = (i + 1) % ndata_;
+        }
+        return 0;
+    }
+
+    ~Hashtable()
+    {
+        free(get_keys_ptr_());
+        free(get_values_ptr_());
+    }
+};
+
+typedef uint64_t Address;
+
+class ERC20
+{
+    uint64_t totalSupply() { return 0; }
+    uint64_t balanceOf(Address who) { return 0; }
+    bool transfer(Address from, Address to, uint64_t value) { return false; }
+};
+
+class MyToken : public ERC20
+{
+    uintptr_t balances_;
+    uint64_t totalSupply_;
+
+    Hashtable *
+    get_balances_() const
+    {
+        return reinterpret_cast<Hashtable *>(balances_);
+    }
+
+public:
+    MyToken(Address creator, uint64_t initial_balance)
+        : balances_(reinterpret_cast<uintptr_t>(create<Hashtable>()))
+        , totalSupply_(initial_balance)
+    {
+        get_balances_()->insert(creator, initial_balance);
+    }
+
+    uint64_t totalSupply() const
+    {
+        return totalSupply_;
+    }
+
+    uint64_t balanceOf(Address who) const
+    {
+        return get_balances_()->get(who);
+    }
+
+    bool transfer(Address from, Address to, uint64_t value)
+    {
+        Hashtable *b = get_balances_();
+        if (!to) {
+            return false;
+        }
+
+        const uint64_t prev_from_amount = b->get(from);
+        if (prev_from_amount < value) {
+            return false;
+        }
+
+        const uint64_t prev_to_amount = b->get(to);
+        if (UINT64_MAX - prev_to_amount < value) {
+            return false;
+        }
+
+        b->insert(from, prev_from_amount - value);
+        b->insert(to, prev_to_amount + value);
+        return true;
+    }
+
+    ~MyToken()
+    {
+        get_balances_()->~Hashtable();
+    }
+};
+
+int
+main()
+{
+    const uint64_t naccounts = 1000;
+    const uint64_t ntransactions = 200000;
+    MyToken *mt = create<MyToken>(1, 1000000000);
+
+    uint64_t seed = 2018;
+    uint64_t ok = 0;
+    for (uint64_t t = 0; t < ntransactions; ++t) {
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        Address from = t % 5 ? 1 + (seed >> 33) % naccounts : 1;
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        Address to = 1 + (seed >> 33) % naccounts;
+        if (to == from) {
+            to = from % naccounts + 1;
+        }
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        uint64_t amount = (seed >> 33) % 100000;
+        if (mt->transfer(from, to, amount)) {
+            ++ok;
+        }
+    }
+
+    uint64_t total = 0;
+    uint64_t check = 0;
+    for (Address a = 1; a <= naccounts; ++a) {
+        total += mt->balanceOf(a);
+        check = check * 31 + mt->balanceOf(a);
+    }
+    printf("%lu %lu %lu\n", static_cast<unsigned long>(ok),
+           static_cast<unsigned long>(total), static_cast<unsigned long>(check));
+    mt->~MyToken();
+}
@@ -0,0 +1,26 @@
+/*
+    Call-heavy kernel: naive Fibonacci plus Ackermann's function.
+*/
+
+
+#include <stdio.h>
+
+unsigned long fib(unsigned long n)
+{
+    return n < 2 ? 1 : fib(n - 1) + fib(n - 2);
+}
+
+unsigned long ack(unsigned long m, unsigned long n)
+{
+    if (m == 0)
+        return n + 1;
+    if (n == 0)
+        return ack(m - 1, 1);
+    return ack(m - 1, ack(m, n - 1));
+}
+
+int main()
+{
+    printf("%lu\n", fib(27));
+    printf("%lu\n", ack(2, 400));
+}
@@ -0,0 +1,40 @@
+/*
+    Float-heavy kernel: numerical integration and a damped oscillator in
+    double precision. The results are printed as raw IEEE-754 bits.
+*/
+
+
+#include <stdio.h>
+
+typedef unsigned long UL;
+
+union Bits {
+    double d;
+    UL u;
+};
+
+static UL bits(double d) {
+    union Bits b;
+    b.d = d;
+    return b.u;
+}
+
+int main() {
+    double h = 0.000001;
+    double x = 0.0;
+    double integral = 0.0;
+    for (UL i = 0; i < 1000000; ++i) {
+        double fx = 4.0 / (1.0 + x * x);
+        integral += fx * h;
+        x += h;
+    }
+    printf("%lx\n", bits(integral));
+
+    double pos = 1.0, vel = 0.0, dt = 0.001;
+    for (UL i = 0; i < 500000; ++i) {
+        double acc = -pos * 9.81 - vel * 0.05;
+        vel += acc * dt;
+        pos += vel * dt;
+    }
+    printf("%lx %lx\n", bits(pos), bits(vel));
+}
@@ -0,0 +1,64 @@
+/*
+    Memory-heavy kernel: matrix multiplication over heap arrays and a
+    pointer chase through a randomly permuted cycle.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+typedef unsigned long UL;
+
+static UL *alloc_words(UL n) {
+    UL *p = malloc(n * sizeof(UL));
+    if (!p) {
+        puts("Out of memory.");
+        exit(1);
+    }
+    return p;
+}
+
+int main() {
+    UL n = 80;
+    UL *a = alloc_words(n * n);
+    UL *b = alloc_words(n * n);
+    UL *c = alloc_words(n * n);
+    for (UL i = 0; i < n * n; ++i) {
+        a[i] = i % 7 + 1;
+        b[i] = i % 13 + 2;
+        c[i] = 0;
+    }
+    for (UL i = 0; i < n; ++i)
+        for (UL k = 0; k < n; ++k) {
+            UL aik = a[i * n + k];
+            for (UL j = 0; j < n; ++j)
+                c[i * n + j] += aik * b[k * n + j];
+        }
+    UL trace = 0;
+    for (UL i = 0; i < n; ++i)
+        trace += c[i * n + i];
+    printf("%lu\n", trace);
+
+    UL m = 1 << 18;
+    UL *next = alloc_words(m);
+    for (UL i = 0; i < m; ++i)
+        next[i] = i;
+    UL seed = 42;
+    for (UL i = m - 1; i > 0; --i) {
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        UL j = (seed >> 33) % i;
+        UL t = next[i];
+        next[i] = next[j];
+        next[j] = t;
+    }
+    UL pos = 0, sum = 0;
+    for (UL step = 0; step < 4 * m; ++step) {
+        pos = next[pos];
+        sum += pos;
+    }
+    printf("%lu\n", sum);
+
+    free(a);
+    free(b);
+    free(c);
+    free(next);
+}
@@ -0,0 +1,36 @@
+/*
+    Eratosthenes sieve, scaled up: loops, conditions and byte stores.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+typedef unsigned long UL;
+
+int main() {
+    UL n = 4000000;
+
+    char *p = malloc(n + 1);
+    if (!p) {
+        puts("Out of memory.");
+        return 1;
+    }
+    p[0] = p[1] = 0;
+    for (UL i = 2; i <= n; ++i) {
+        p[i] = 1;
+    }
+    UL count = 0, last = 0;
+    for (UL i = 2; i <= n; ++i) {
+        if (p[i]) {
+            if (i * i <= n) {
+                for (UL j = i * i; j <= n; j += i) {
+                    p[j] = 0;
+                }
+            }
+            ++count;
+            last = i;
+        }
+    }
+    printf("%lu %lu\n", count, last);
+    free(p);
+}
@@ -0,0 +1,76 @@
+/*
+    String-heavy kernel: generates words, measures, hashes, compares and
+    sorts them with hand-written string routines.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+typedef unsigned long UL;
+
+static UL str_len(const char *s) {
+    const char *p = s;
+    while (*p)
+        ++p;
+    return p - s;
+}
+
+static long str_cmp(const char *a, const char *b) {
+    for (; *a == *b; ++a, ++b) {
+        if (!*a)
+            return 0;
+    }
+    return *(const unsigned char *) a < *(const unsigned char *) b ? -1 : 1;
+}
+
+static UL str_hash(const char *s) {
+    UL h = 5381;
+    for (; *s; ++s)
+        h = h * 33 + *(const unsigned char *) s;
+    return h;
+}
+
+int main() {
+    UL nwords = 1500;
+    UL stride = 24;
+    char *pool = malloc(nwords * stride);
+    char **words = malloc(nwords * sizeof(char *));
+    if (!pool || !words) {
+        puts("Out of memory.");
+        return 1;
+    }
+
+    UL seed = 7;
+    for (UL i = 0; i < nwords; ++i) {
+        char *w = pool + i * stride;
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        UL len = 4 + (seed >> 33) % 16;
+        for (UL j = 0; j < len; ++j) {
+            seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+            w[j] = 'a' + (seed >> 33) % 26;
+        }
+        w[len] = 0;
+        words[i] = w;
+    }
+
+    UL total = 0, hash = 0;
+    for (UL round = 0; round < 20; ++round)
+        for (UL i = 0; i < nwords; ++i) {
+            total += str_len(words[i]);
+            hash ^= str_hash(words[i]) + round;
+        }
+
+    for (UL i = 1; i < nwords; ++i) {
+        char *w = words[i];
+        UL j = i;
+        while (j > 0 && str_cmp(words[j - 1], w) > 0) {
+            words[j] = words[j - 1];
+            --j;
+        }
+        words[j] = w;
+    }
+
+    printf("%lu %lu %s %s\n", total, hash, words[0], words[nwords - 1]);
+    free(words);
+    free(pool);
+}
@@ -28,6 +28,18 @@ alloc_for(size_t n)
     return static_cast<T *>(p);
 }
 
+template<class T> static
+T *
+zalloc_for(size_t n)
+{
+    void *p = calloc(n, sizeof(T));
+    if (n && !p) {
+        puts("Out of memory.");
+        exit(1);
+    }
+    return static_cast<T *>(p);
+}
+
 template<class T, class ...Args>
 T *
 create(Args&& ...args)
@@ -39,15 +51,6 @@ create(Args&& ...args)
 
 class Hashtable
 {
-    static uintptr_t zalloc8_(size_t n)
-    {
-        uint64_t *p = alloc_for<uint64_t>(n);
-        for (size_t i = 0; i < n; ++i) {
-            p[i] = 0;
-        }
-        return reinterpret_cast<uintptr_t>(p);
-    }
-
     uint64_t ndata_;
     uintptr_t keys_;
     uintptr_t values_;
@@ -67,8 +70,8 @@ public:
 
     Hashtable(size_t nreserve = 1024)
         : ndata_(nreserve)
-        , keys_(zalloc8_(ndata_))
-        , values_(zalloc8_(ndata_))
+        , keys_(reinterpret_cast<uintptr_t>(zalloc_for<uint64_t>(ndata_)))
+        , values_(reinterpret_cast<uintptr_t>(zalloc_for<uint64_t>(ndata_)))
     {}
 
     void
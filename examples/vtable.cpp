@@ -0,0 +1,73 @@
+/*
+    This example shows virtual calls and constant tables of function pointers work next to
+    more than a page of other constants.
+*/
+
+
+#include <stdio.h>
+
+
+// 8 KiB of constants, so that the tables below do not share the first page
+static const unsigned Squares[2048] = {
+#define S1(k) (k) * (k),
+#define S4(k) S1(k) S1(k + 1) S1(k + 2) S1(k + 3)
+#define S16(k) S4(k) S4(k + 4) S4(k + 8) S4(k + 12)
+#define S64(k) S16(k) S16(k + 16) S16(k + 32) S16(k + 48)
+#define S256(k) S64(k) S64(k + 64) S64(k + 128) S64(k + 192)
+    S256(0) S256(256) S256(512) S256(768) S256(1024) S256(1280) S256(1536) S256(1792)
+};
+
+
+struct Shape
+{
+    virtual unsigned area() const = 0;
+    virtual const char *name() const = 0;
+};
+
+
+struct Square : public Shape
+{
+    unsigned side;
+    Square(unsigned side) : side(side) {}
+    virtual unsigned area() const override { return Squares[side]; }
+    virtual const char *name() const override { return "square"; }
+};
+
+
+struct Rectangle : public Shape
+{
+    unsigned width, height;
+    Rectangle(unsigned width, unsigned height) : width(width), height(height) {}
+    virtual unsigned area() const override { return width * height; }
+    virtual const char *name() const override { return "rectangle"; }
+};
+
+
+static unsigned twice(unsigned x) { return 2 * x; }
+static unsigned square(unsigned x) { return Squares[x]; }
+
+static unsigned (*const Operations[])(unsigned) = { twice, square };
+
+
+// not inlined, so that the calls below go through the vtables
+__attribute__((noinline)) static const Shape *
+pick(unsigned k, const Shape *a, const Shape *b)
+{
+    return k % 2 ? b : a;
+}
+
+
+int
+main()
+{
+    // volatile, so that the loops are not folded away with the tables
+    volatile unsigned count = 4;
+    Square s(1000);
+    Rectangle r(12, 34);
+    for (unsigned k = 0; k < count; ++k) {
+        const Shape *shape = pick(k, &s, &r);
+        printf("%s: %u\n", shape->name(), shape->area());
+    }
+    for (unsigned k = 0; k < count; ++k)
+        printf("operation %u: %u\n", k, Operations[k % 2](2047 - k));
+}
@@ -1,20 +1,40 @@
 #include "RbvmBackend.h"
+#include "llvm/Analysis/InlineCost.h"
 #include "llvm/Analysis/ValueTracking.h"
 #include "llvm/IR/InstIterator.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/ErrorHandling.h"
 #include "llvm/Support/MathExtras.h"
 #include "llvm/Support/TargetRegistry.h"
 #include "llvm/Support/Host.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/LineIterator.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
 #include "llvm/CodeGen/TargetLowering.h"
 #include "llvm/CodeGen/TargetLowering.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/Scalar.h"
+#include "llvm/Transforms/Scalar/GVN.h"
 #include "llvm/Transforms/Utils.h"
+#if ! LESSER_LLVM
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#endif
 #include "llvm/IR/GlobalVariable.h"
 #include "compat.h"
 
 #include <assert.h>
 #include <stdio.h>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
 using namespace llvm;
 
 extern "C" void LLVMInitializeRbvmBackendTarget() {
@@ -34,6 +54,66 @@ static bool isEmptyType(Type *Ty) {
     return Ty->isVoidTy();
 }
 
+// A call marked tail (or musttail) whose result is returned right away
+// reuses the caller's frame; the ret that follows it is never reached.
+static bool isTailCallInReturnPosition(const Instruction *I) {
+    const CallInst *CI = dyn_cast_or_null<CallInst>(I);
+    if (!CI || !CI->isTailCall() || CI->getNumArgOperands() > 8)
+        return false;
+    if (const Function *F = CI->getCalledFunction())
+        if (F->isIntrinsic())
+            return false;
+
+    const ReturnInst *RI = dyn_cast_or_null<ReturnInst>(CI->getNextNode());
+    if (!RI)
+        return false;
+    return !RI->getReturnValue() || RI->getReturnValue() == CI;
+}
+
+// Vectors live in groups of consecutive registers with their lanes packed
+// as in memory, at most 32 bytes; <N x i1> takes a byte per lane.
+static unsigned vectorLaneType(Type *EltTy) {
+    if (EltTy->isFloatTy())
+        return VT_F32;
+    if (EltTy->isDoubleTy())
+        return VT_F64;
+    if (EltTy->isPointerTy())
+        return VT_I64;
+    if (EltTy->isIntegerTy()) {
+        switch (EltTy->getIntegerBitWidth()) {
+        case 1:
+        case 8:  return VT_I8;
+        case 16: return VT_I16;
+        case 32: return VT_I32;
+        case 64: return VT_I64;
+        }
+    }
+    report_fatal_error("unsupported vector element type");
+}
+
+static unsigned vectorLaneBytes(Type *EltTy) {
+    static const unsigned Bytes[] = {1, 2, 4, 8, 4, 8};
+    return Bytes[vectorLaneType(EltTy)];
+}
+
+static bool isBoolVector(Type *Ty) {
+    VectorType *VTy = dyn_cast<VectorType>(Ty);
+    return VTy && VTy->getElementType()->isIntegerTy(1);
+}
+
+static unsigned vectorBytes(VectorType *VTy) {
+    const unsigned Bytes = VTy->getNumElements() * vectorLaneBytes(VTy->getElementType());
+    if (Bytes > 32)
+        report_fatal_error("vectors wider than 256 bits are not supported");
+    return Bytes;
+}
+
+static unsigned regsFor(Type *Ty) {
+    if (VectorType *VTy = dyn_cast<VectorType>(Ty))
+        return (vectorBytes(VTy) + 7) / 8;
+    return 1;
+}
+
 static std::string Mangle(const std::string &S) {
     std::string result;
 
@@ -50,25 +130,56 @@ static std::string Mangle(const std::string &S) {
     return result;
 }
 
+// Integers narrower than 64 bits are kept zero-extended in registers.  Every
+// visitor leaves its result in that form, so this is only needed where the
+// high bits may be garbage: truncations and values coming from natives.
 void RbvmWriter::writeCastTo(Type *Ty) {
-    if (Ty->isIntegerTy()) {
-        IntegerType *ITy = static_cast<IntegerType*>(Ty);
-        uint64_t mask = ITy->getBitMask();
-        if (mask != UINT64_MAX) {
-            auto new_reg = ++NextReg;
-            produceAmbigRR(Commands::CMD_MOV, new_reg, ResultReg);
-            produceAmbigRC(Commands::CMD_AND, new_reg, mask);
+    if (IntegerType *ITy = dyn_cast<IntegerType>(Ty)) {
+        if (ITy->getBitWidth() < 64) {
+            auto new_reg = resultRegister();
+            produceZExt(ITy->getBitWidth(), new_reg, ResultReg);
             ResultReg = new_reg;
         }
     }
 }
 
+static unsigned integerBits(Type *Ty) {
+    return Ty->isIntegerTy() ? Ty->getIntegerBitWidth() : 64;
+}
+
+unsigned RbvmWriter::allocRegs(Type *Ty) {
+    const unsigned R = NextReg + 1;
+    NextReg += regsFor(Ty);
+    return R;
+}
+
+// The register for the result of the instruction being emitted: the one
+// allocated to it, or a temporary.  Writing the allocated register clobbers
+// operands that die at this instruction, so only call this once the result
+// can no longer be overwritten by reading operands.
+unsigned RbvmWriter::resultRegister() {
+    const unsigned R = DestReg;
+    DestReg = 0;
+    return R ? R : ++NextReg;
+}
+
+void RbvmWriter::produceMove(Type *Ty, unsigned Dst, unsigned Src) {
+    for (unsigned k = 0, n = regsFor(Ty); k < n; ++k)
+        produceAmbigRR(Commands::CMD_MOV, Dst + k, Src + k);
+}
+
 AllocaInst *RbvmWriter::isDirectAlloca(Value *V) const {
     AllocaInst *AI = dyn_cast<AllocaInst>(V);
-    if (!AI || AI->isArrayAllocation() || 
+    if (!AI || AI->isArrayAllocation() || MemoryAllocas.count(AI) ||
         (AI->getParent() != &AI->getParent()->getParent()->getEntryBlock()))
         return nullptr;
 
+    // only scalars fit into a register; arrays and structs live on the guest stack
+    Type *Ty = AI->getAllocatedType();
+    if (!(Ty->isIntegerTy() || Ty->isPointerTy() || Ty->isFloatingPointTy()) ||
+        TD->getTypeAllocSize(Ty) > 8)
+        return nullptr;
+
     return AI;
 }
 
@@ -78,46 +189,261 @@ bool RbvmWriter::doInitialization(Module &M) {
     TD = new DataLayout(&M);
     IL = new IntrinsicLowering(*TD);
     IL->AddPrototypes(M);
+    BlockTagKind = M.getContext().getMDKindID("rbvm.block");
     return false;
 }
 
-void RbvmWriter::writeAddress(Value *Operand) {
-    writeOperand(Operand);
-    Constant* CPV = dyn_cast<Constant>(Operand);
+// Globals.  Every global variable defined in the module gets a place in the
+// data segment, which the VM maps at DATA_SEGMENT_BASE before running
+// anything else, so the address of a global is a constant and accessing it
+// takes a single ld or st.  Constants come first so that the VM can make them
+// read-only.  Functions and globals defined elsewhere (natives) still have
+// names that gg looks up.
+
+// Follows aliases, casts and constant-index GEPs down to a global value,
+// adding the byte offsets up in Offset.
+static const GlobalValue *stripConstantOffset(const Value *V, const DataLayout &DL, int64_t &Offset) {
+    Offset = 0;
+    while (true) {
+        if (const GlobalAlias *GA = dyn_cast<GlobalAlias>(V)) {
+            V = GA->getAliasee();
+            continue;
+        }
+        if (const GlobalValue *GV = dyn_cast<GlobalValue>(V))
+            return GV;
+        const ConstantExpr *CE = dyn_cast<ConstantExpr>(V);
+        if (!CE)
+            return nullptr;
+        switch (CE->getOpcode()) {
+        case Instruction::BitCast:
+        case Instruction::AddrSpaceCast:
+        case Instruction::IntToPtr:
+            V = CE->getOperand(0);
+            break;
+        case Instruction::PtrToInt:
+            if (DL.getTypeSizeInBits(CE->getType()) < 64)
+                return nullptr;
+            V = CE->getOperand(0);
+            break;
+        case Instruction::GetElementPtr: {
+            APInt GEPOffset(64, 0);
+            if (!cast<GEPOperator>(CE)->accumulateConstantOffset(DL, GEPOffset))
+                return nullptr;
+            Offset += GEPOffset.getSExtValue();
+            V = CE->getOperand(0);
+            break;
+        }
+        default:
+            return nullptr;
+        }
+    }
+}
 
-    if (CPV && CPV->getType()->getTypeID() != Type::ArrayTyID) {
-        auto new_reg = ++NextReg;
-        produceCSS_DYN(new_reg, ResultReg);
-        ResultReg = new_reg;
+// Whether C holds an address that is only known at run time: a function's or
+// that of a global defined elsewhere.  The top-level code stores those after
+// `data`, so C cannot be placed in the read-only pages.
+static bool needsFixups(const Constant *C) {
+    if (isa<ConstantData>(C))
+        return false;
+    if (const GlobalVariable *GV = dyn_cast<GlobalVariable>(C))
+        return GV->isDeclaration() || GV->getName().startswith("llvm.");
+    if (isa<GlobalValue>(C))
+        return true;
+    for (const Use &Op : C->operands())
+        if (needsFixups(cast<Constant>(Op)))
+            return true;
+    return false;
+}
+
+void RbvmWriter::layoutDataSegment(Module &M) {
+    if (DataLaidOut)
+        return;
+    DataLaidOut = true;
+
+    for (bool Constants : {true, false}) {
+        for (GlobalVariable &GV : M.globals()) {
+            // llvm.used, llvm.global_ctors and the like are not program data
+            if (GV.isDeclaration() || GV.getName().startswith("llvm."))
+                continue;
+            // vtables and tables of function pointers go with the writable
+            // globals
+            if ((GV.isConstant() && !needsFixups(GV.getInitializer())) != Constants)
+                continue;
+            DataOffsets[&GV] = allocateData(GV.getValueType(), GV.getAlignment());
+        }
+        // the aggregates that need fixups are left for the second round
+        for (Function &F : M)
+            layoutConstants(F, Constants);
+        if (Constants)
+            DataReadOnly = DataSize;
     }
 }
 
-void RbvmWriter::modifyGlobal(const std::string &Name, int WhatToStore) {
-    auto new_reg = ++NextReg;
-    produceCSS_DYN(new_reg, WhatToStore);
-    produceSG(Name, new_reg);
+// Gives the array and struct constants F uses, in constant expressions too,
+// their place.  Functions are generated after all of them are laid out, so
+// that the generation only reads ConstantOffsets.  With ReadOnly, the ones
+// that need fixups are skipped.
+void RbvmWriter::layoutConstants(Function &F, bool ReadOnly) {
+    std::vector<Constant*> Work;
+    std::set<Constant*> Seen;
+    for (Instruction &I : instructions(F))
+        for (Value *Op : I.operands())
+            if (Constant *C = dyn_cast<Constant>(Op))
+                Work.push_back(C);
+    while (!Work.empty()) {
+        Constant *C = Work.back();
+        Work.pop_back();
+        if (isa<GlobalValue>(C) || !Seen.insert(C).second)
+            continue;
+        if (C->getType()->isArrayTy() || C->getType()->isStructTy()) {
+            if (!ReadOnly || !needsFixups(C))
+                getConstantAddress(C);
+        }
+        else if (isa<ConstantExpr>(C))
+            for (Value *Op : C->operands())
+                Work.push_back(cast<Constant>(Op));
+    }
+}
+
+uint64_t RbvmWriter::allocateData(Type *Ty, uint64_t Align) {
+    Align = std::max<uint64_t>(Align, TD->getABITypeAlignment(Ty));
+    DataSize = (DataSize + Align - 1) / Align * Align;
+    const uint64_t Offset = DataSize;
+    DataSize += isEmptyType(Ty) ? 0 : TD->getTypeAllocSize(Ty);
+    return Offset;
+}
+
+// Constants are uniqued, so equal aggregates share one copy.  The ones not
+// seen by layoutDataSegment() go after the writable globals.
+uint64_t RbvmWriter::getConstantAddress(Constant *C) {
+    auto It = ConstantOffsets.find(C);
+    if (It == ConstantOffsets.end() && WorkerTD)
+        report_fatal_error("constant not laid out before generating functions");
+    if (It == ConstantOffsets.end()) {
+        It = ConstantOffsets.insert(std::make_pair(C, allocateData(C->getType()))).first;
+        ConstantPool.push_back(C);
+    }
+    return DATA_SEGMENT_BASE + It->second;
+}
+
+unsigned RbvmWriter::memoryBits(Type *Ty) const {
+    // getPrimitiveSizeInBits() is 0 for pointers, and i1 takes a byte
+    if (Ty->isPointerTy())
+        return 64;
+    return TD->getTypeStoreSizeInBits(Ty);
+}
+
+bool RbvmWriter::getDataAddress(const Value *V, uint64_t &Addr) {
+    int64_t Offset;
+    const GlobalVariable *GV = dyn_cast_or_null<GlobalVariable>(stripConstantOffset(V, *TD, Offset));
+    auto It = DataOffsets.find(GV);
+    if (!GV || It == DataOffsets.end())
+        return false;
+    Addr = DATA_SEGMENT_BASE + It->second + Offset;
+    return true;
 }
 
-void RbvmWriter::declareGlobalVariable(GlobalVariable *I) {
-    if (I->isDeclaration() || isEmptyType(I->getType()->getPointerElementType()))
+void RbvmWriter::writeInitializer(Constant *C, uint64_t Offset) {
+    if (C->isNullValue() || isa<UndefValue>(C))
         return;
 
-    std::string name = Mangle(I->getName());
-    if (!I->getInitializer()->isNullValue()) {
-        writeAddress(I->getInitializer());
-        produceSG(name, ResultReg);
-    } 
-    else {
-        auto new_reg = ++NextReg;
-        produceAmbigRC(Commands::CMD_MOV, new_reg, 0);
-        produceSG(name, new_reg);
-        ResultReg = new_reg;
+    Type *Ty = C->getType();
+    if (isa<ConstantInt>(C) || isa<ConstantFP>(C)) {
+        const APInt V = isa<ConstantInt>(C) ? cast<ConstantInt>(C)->getValue()
+                                            : cast<ConstantFP>(C)->getValueAPF().bitcastToAPInt();
+        const uint64_t Bytes = std::min<uint64_t>(TD->getTypeStoreSize(Ty), V.getNumWords() * 8);
+        memcpy(&DataBytes[Offset], V.getRawData(), Bytes);
+        return;
+    }
+    if (ConstantDataSequential *CDS = dyn_cast<ConstantDataSequential>(C)) {
+        StringRef Raw = CDS->getRawDataValues();
+        memcpy(&DataBytes[Offset], Raw.data(), Raw.size());
+        return;
+    }
+    if (StructType *STy = dyn_cast<StructType>(Ty)) {
+        const StructLayout *SL = TD->getStructLayout(STy);
+        for (unsigned k = 0, n = STy->getNumElements(); k < n; ++k)
+            writeInitializer(C->getAggregateElement(k), Offset + SL->getElementOffset(k));
+        return;
+    }
+    if (ArrayType *ATy = dyn_cast<ArrayType>(Ty)) {
+        const uint64_t Stride = TD->getTypeAllocSize(ATy->getElementType());
+        for (uint64_t k = 0, n = ATy->getNumElements(); k < n; ++k)
+            writeInitializer(C->getAggregateElement(k), Offset + k * Stride);
+        return;
+    }
+    if (VectorType *VTy = dyn_cast<VectorType>(Ty)) {
+        const uint64_t Stride = TD->getTypeStoreSize(VTy->getElementType());
+        for (unsigned k = 0, n = VTy->getNumElements(); k < n; ++k)
+            writeInitializer(C->getAggregateElement(k), Offset + k * Stride);
+        return;
+    }
+
+    // a pointer, or an integer made of one
+    uint64_t Addr;
+    if (getDataAddress(C, Addr)) {
+        memcpy(&DataBytes[Offset], &Addr, std::min<uint64_t>(8, TD->getTypeStoreSize(Ty)));
+        return;
     }
+    int64_t Addend;
+    if (const GlobalValue *GV = stripConstantOffset(C, *TD, Addend)) {
+        if (TD->getTypeStoreSize(Ty) != 8)
+            report_fatal_error("unsupported initializer of a global variable");
+        DataFixups.push_back(std::make_tuple(Offset, GV, Addend));
+        return;
+    }
+    errs() << "RbvmWriter Error: Unhandled initializer: " << *C << "\n";
+    report_fatal_error("unsupported initializer of a global variable");
+}
+
+void RbvmWriter::produceDataSegment(Module &M) {
+    DataBytes.assign(DataSize, 0);
+    for (GlobalVariable &GV : M.globals())
+        if (DataOffsets.count(&GV) && !isEmptyType(GV.getValueType()))
+            writeInitializer(GV.getInitializer(), DataOffsets[&GV]);
+    for (Constant *C : ConstantPool)
+        if (!isEmptyType(C->getType()))
+            writeInitializer(C, ConstantOffsets[C]);
+
+    // the zero tail is not stored
+    uint64_t Init = DataBytes.size();
+    while (Init && !DataBytes[Init - 1])
+        --Init;
+
+    produce1(Commands::CMD_DATA);
+    produce8(DataSize);
+    produce8(DataReadOnly);
+    produce8(Init);
+    Mem.append(DataBytes, 0, Init);
+    DataBytes.clear();
 }
 
 bool RbvmWriter::doFinalization(Module &M) {
-    for (Module::global_iterator I = M.global_begin(), E = M.global_end(); I != E; ++I)
-        declareGlobalVariable(&*I);
+    layoutDataSegment(M);
+    generateFunctions();
+
+    // the functions have been written; the data segment and the addresses
+    // stored in it only need to be there before main runs
+    produceDataSegment(M);
+    for (const auto &F : DataFixups) {
+        produceGG(Mangle(std::get<1>(F)->getName()), 1);
+        if (std::get<2>(F))
+            produceAmbigRC(Commands::CMD_IADD, 1, std::get<2>(F));
+        produceST_CR(64, DATA_SEGMENT_BASE + std::get<0>(F), 1);
+    }
+
+    for (const auto &P : ProfBlocks) {
+        produce1(Commands::CMD_PROF);
+        produceString(P.first.first);
+        produceString(P.first.second);
+        produce4(P.second.first);
+        produce4(P.second.second.size());
+        for (const auto &B : P.second.second) {
+            produce4(std::get<0>(B));
+            produce4(std::get<1>(B));
+            produce1(std::get<2>(B));
+        }
+    }
 
     produceGG("main", 1);
     produce1(Commands::CMD_CALL0);
@@ -140,13 +466,114 @@ bool RbvmWriter::runOnFunction(Function &F) {
     if (F.hasAvailableExternallyLinkage())
         return false;
 
+    layoutDataSegment(*F.getParent());
     LI = &getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
     lowerIntrinsics(F);
-    printFunction(F);
+    layoutConstants(F);
+    PendingFunctions.emplace_back();
+    PendingFunction &P = PendingFunctions.back();
+    P.F = &F;
+    P.Layout = blockLayout(F);
+    readCache(P);
     LI = nullptr;
     return true;
 }
 
+// Functions are generated independently of each other: calls name their
+// callee with gg, jumps are relative and addresses in the data segment are
+// fixed by now, so every function's code can be written into a buffer of its
+// own, several at a time.  The buffers are written out in the order of
+// runOnFunction, which makes the output the same for any number of threads,
+// and only the ones not written yet are held in memory.
+//
+// The workers only read the IR and the module-wide state.  Whatever changes
+// the IR or the LLVMContext (lowering intrinsics, looking up metadata kinds,
+// creating constants) or needs an analysis is done before, in runOnFunction.
+
+static cl::opt<unsigned> CodegenThreads("codegen-threads",
+                                        cl::desc("Threads generating functions (0: one per core)"),
+                                        cl::init(0));
+static cl::opt<std::string> CacheDir("cache-dir",
+                                     cl::desc("Reuse the code of functions that did not change from this directory"),
+                                     cl::value_desc("directory"));
+
+void RbvmWriter::generateFunctions() {
+    std::vector<PendingFunction *> Work;
+    for (PendingFunction &P : PendingFunctions)
+        if (!P.Done)
+            Work.push_back(&P);
+
+    auto generate = [](RbvmWriter &W, PendingFunction &P) {
+        const auto Start = std::chrono::steady_clock::now();
+        W.printFunction(*P.F, P.Layout);
+        P.Micros = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - Start).count();
+        P.Code.swap(W.Mem);
+        P.Prof.swap(W.ProfBlocks);
+        W.Mem.clear();
+        W.ProfBlocks.clear();
+    };
+
+    // each function goes to the output as soon as it and the ones before it
+    // are done, and is dropped then
+    unsigned Hits = 0;
+    uint64_t Saved = 0;
+    auto emit = [&](PendingFunction &P) {
+        if (P.Cached) {
+            ++Hits;
+            Saved += P.Micros;
+        } else
+            writeCache(P);
+        out << P.Code;
+        ProfBlocks.insert(P.Prof.begin(), P.Prof.end());
+        std::string().swap(P.Code);
+        std::vector<BasicBlock *>().swap(P.Layout);
+        P.Prof.clear();
+    };
+
+    const size_t N = Work.size();
+    unsigned Threads = CodegenThreads ? CodegenThreads : std::thread::hardware_concurrency();
+    Threads = std::max(1u, std::min<unsigned>(Threads, N));
+    if (Threads == 1) {
+        RbvmWriter W(*this);
+        for (PendingFunction &P : PendingFunctions) {
+            if (!P.Done)
+                generate(W, P);
+            emit(P);
+        }
+    } else {
+        std::atomic<size_t> Next(0);
+        std::mutex Lock;
+        std::condition_variable Finished;
+        auto Worker = [&]() {
+            RbvmWriter W(*this);
+            for (size_t k; (k = Next++) < N; ) {
+                generate(W, *Work[k]);
+                std::lock_guard<std::mutex> Guard(Lock);
+                Work[k]->Done = true;
+                Finished.notify_all();
+            }
+        };
+        std::vector<std::thread> Pool;
+        for (unsigned t = 0; t < Threads; ++t)
+            Pool.emplace_back(Worker);
+        for (PendingFunction &P : PendingFunctions) {
+            {
+                std::unique_lock<std::mutex> Guard(Lock);
+                Finished.wait(Guard, [&] { return P.Done; });
+            }
+            emit(P);
+        }
+        for (std::thread &T : Pool)
+            T.join();
+    }
+
+    if (!CacheDir.empty())
+        errs() << "llvm-rbvm: " << Hits << " of " << PendingFunctions.size()
+               << " functions from the cache, " << Saved / 1000 << " ms of code generation saved\n";
+    PendingFunctions.clear();
+}
+
 void RbvmWriter::lowerIntrinsics(Function &F) {
     for (auto &BB : F) {
         for (auto I = BB.begin(), E = BB.end(); I != E;) {
@@ -164,6 +591,11 @@ void RbvmWriter::lowerIntrinsics(Function &F) {
                     case Intrinsic::sigsetjmp:
                     case Intrinsic::siglongjmp:
                     case Intrinsic::trap:
+                    case Intrinsic::stacksave:
+                    case Intrinsic::stackrestore:
+                    case Intrinsic::memcpy:
+                    case Intrinsic::memmove:
+                    case Intrinsic::memset:
                     case Intrinsic::stackprotector:
                     case Intrinsic::dbg_value:
                     case Intrinsic::dbg_declare:
@@ -195,70 +627,418 @@ void RbvmWriter::lowerIntrinsics(Function &F) {
     }
 }
 
+// An icmp whose only use is the conditional branch ending its block is not
+// computed into a register; the branch compares and jumps in one instruction.
+static ICmpInst *getFusedCompare(const BranchInst *BI) {
+    if (!BI->isConditional())
+        return nullptr;
+    ICmpInst *Cmp = dyn_cast<ICmpInst>(BI->getCondition());
+    if (!Cmp || !Cmp->hasOneUse() || Cmp->getParent() != BI->getParent() ||
+        Cmp->getOperand(0)->getType()->isVectorTy())
+        return nullptr;
+    return Cmp;
+}
+
+static bool isFusedCompare(const Instruction *I) {
+    const ICmpInst *Cmp = dyn_cast<ICmpInst>(I);
+    if (!Cmp || !Cmp->hasOneUse())
+        return false;
+    const BranchInst *BI = dyn_cast<BranchInst>(*Cmp->user_begin());
+    return BI && getFusedCompare(BI) == Cmp;
+}
+
+// Register allocation.
+//
+// Instructions are numbered in block order; instruction n reads its operands
+// at point 2n and writes its result at 2n+1.  PHIs are written at the start of
+// their block and by the copies at the end of each predecessor, which read the
+// incoming values there; a fused compare reads its operands at the branch.
+// A value is live from its definition to its last use, through every block
+// on a path in between, and gets registers that no other value live in the
+// hull of those points uses.  Registers above the live ones at an instruction
+// are free for its temporaries.
+//
+// Values only get registers up to MaxValueReg, which leaves enough for the
+// temporaries of any single instruction; the rest live in spill slots of the
+// frame and are reloaded into a temporary on each use.
+
+static const unsigned MaxValueReg = 224;
+// entry-block allocas beyond this many live on the guest stack instead of
+// holding a register for the whole function
+static const unsigned MaxDirectAllocas = 128;
+
+namespace {
+    struct LiveRange {
+        Value *V;
+        const BasicBlock *DefBB;
+        unsigned Def;
+        std::vector<std::pair<const BasicBlock*, unsigned> > Uses;
+        std::set<const BasicBlock*> LiveIn, LiveOut;
+        std::map<const BasicBlock*, unsigned> LastUse;
+        // the range whose registers this one shares, and the hull of all of
+        // them (kept on the leader)
+        unsigned Leader;
+        unsigned Start, End;
+    };
+}
+
+static bool isLiveAt(const LiveRange &R, const BasicBlock *BB, unsigned Point) {
+    if (!(R.DefBB == BB && R.Def <= Point) && !R.LiveIn.count(BB))
+        return false;
+    if (R.LiveOut.count(BB))
+        return true;
+    auto U = R.LastUse.find(BB);
+    return U != R.LastUse.end() && U->second >= Point;
+}
+
+void RbvmWriter::allocateRegisters(Function &F) {
+    unsigned NumDirect = 0;
+    for (Instruction &I : F.getEntryBlock())
+        if (isDirectAlloca(&I) && ++NumDirect > MaxDirectAllocas)
+            MemoryAllocas.insert(cast<AllocaInst>(&I));
+
+    std::map<const BasicBlock*, std::pair<unsigned, unsigned> > Span;
+    unsigned N = 0;
+    for (BasicBlock &BB : F) {
+        const unsigned Start = N++;
+        for (Instruction &I : BB)
+            InstPos[&I] = isa<PHINode>(I) ? Start : N++;
+        Span[&BB] = {Start, N - 1};
+    }
+    auto startOf = [&](const BasicBlock *BB) { return 2 * Span[BB].first; };
+    // where the PHI copies for the successors of BB are written
+    auto endOf = [&](const BasicBlock *BB) { return 2 * Span[BB].second + 1; };
+
+    std::vector<LiveRange> Ranges;
+    std::map<const Value*, unsigned> RangeOf;
+    auto addRange = [&](Value *V, const BasicBlock *BB, unsigned Def) {
+        LiveRange R;
+        R.V = V;
+        R.DefBB = BB;
+        R.Def = Def;
+        R.Leader = RangeOf[V] = Ranges.size();
+        Ranges.push_back(R);
+    };
+    for (Argument &A : F.args())
+        addRange(&A, &F.getEntryBlock(), 0);
+    for (BasicBlock &BB : F)
+        for (Instruction &I : BB)
+            if (!isEmptyType(I.getType()) && !isFusedCompare(&I) && !isFoldedAddress(&I))
+                addRange(&I, &BB, isa<PHINode>(I) ? startOf(&BB) : 2 * InstPos.lookup(&I) + 1);
+
+    std::vector<const BasicBlock*> Work;
+    for (LiveRange &R : Ranges) {
+        for (User *U : R.V->users()) {
+            Instruction *UI = dyn_cast<Instruction>(U);
+            if (!UI)
+                continue;
+            if (PHINode *PN = dyn_cast<PHINode>(UI)) {
+                for (unsigned i = 0, e = PN->getNumIncomingValues(); i != e; ++i)
+                    if (PN->getIncomingValue(i) == R.V)
+                        R.Uses.push_back({PN->getIncomingBlock(i), endOf(PN->getIncomingBlock(i)) - 1});
+                continue;
+            }
+            if (isFoldedAddress(UI)) {
+                for (User *M : UI->users())
+                    R.Uses.push_back({cast<Instruction>(M)->getParent(), 2 * InstPos.lookup(cast<Instruction>(M))});
+                continue;
+            }
+            if (isFusedCompare(UI))
+                UI = UI->getParent()->getTerminator();
+            R.Uses.push_back({UI->getParent(), 2 * InstPos.lookup(UI)});
+        }
+
+        for (const auto &U : R.Uses) {
+            unsigned &Last = R.LastUse[U.first];
+            Last = std::max(Last, U.second);
+            if (U.first != R.DefBB)
+                Work.push_back(U.first);
+        }
+        while (!Work.empty()) {
+            const BasicBlock *BB = Work.back();
+            Work.pop_back();
+            if (!R.LiveIn.insert(BB).second)
+                continue;
+            for (const BasicBlock *Pred : predecessors(BB)) {
+                R.LiveOut.insert(Pred);
+                if (Pred != R.DefBB)
+                    Work.push_back(Pred);
+            }
+        }
+    }
+
+    // Whether X is live where Y's registers are written.  The copy of X
+    // itself into a PHI does not count.
+    auto isLiveAtDefsOf = [&](const LiveRange &X, const LiveRange &Y) {
+        if (isLiveAt(X, Y.DefBB, Y.Def))
+            return true;
+        if (PHINode *PN = dyn_cast<PHINode>(Y.V))
+            for (unsigned i = 0, e = PN->getNumIncomingValues(); i != e; ++i) {
+                const BasicBlock *Pred = PN->getIncomingBlock(i);
+                if (PN->getIncomingValue(i) != X.V && isLiveAt(X, Pred, endOf(Pred)))
+                    return true;
+            }
+        return false;
+    };
+
+    // Give a PHI the registers of its incoming values where their ranges do
+    // not interfere; its copies then become no-ops.
+    std::map<unsigned, std::vector<unsigned> > Members;
+    for (unsigned i = 0; i < Ranges.size(); ++i)
+        Members[i].push_back(i);
+    for (BasicBlock &BB : F)
+        for (auto I = BB.begin(); isa<PHINode>(I); ++I) {
+            PHINode *PN = cast<PHINode>(I);
+            if (!RangeOf.count(PN))
+                continue;
+            const unsigned P = Ranges[RangeOf[PN]].Leader;
+            for (Value *IV : PN->incoming_values()) {
+                if (!isa<Instruction>(IV) || isDirectAlloca(IV) || !RangeOf.count(IV))
+                    continue;
+                const unsigned v = RangeOf[IV];
+                if (v == P || Ranges[v].Leader != v || Members[v].size() != 1 ||
+                    regsFor(IV->getType()) != regsFor(PN->getType()))
+                    continue;
+                const bool Interferes = std::any_of(Members[P].begin(), Members[P].end(), [&](unsigned m) {
+                    return isLiveAtDefsOf(Ranges[m], Ranges[v]) || isLiveAtDefsOf(Ranges[v], Ranges[m]);
+                });
+                if (!Interferes) {
+                    Members[P].push_back(v);
+                    Members.erase(v);
+                    Ranges[v].Leader = P;
+                }
+            }
+        }
+
+    std::vector<unsigned> Order;
+    for (auto &C : Members) {
+        LiveRange &L = Ranges[C.first];
+        L.Start = L.End = L.Def;
+        for (unsigned m : C.second) {
+            const LiveRange &R = Ranges[m];
+            std::vector<unsigned> Points = {R.Def};
+            for (const auto &U : R.Uses)
+                Points.push_back(U.second);
+            for (const BasicBlock *BB : R.LiveIn)
+                Points.push_back(startOf(BB));
+            for (const BasicBlock *BB : R.LiveOut)
+                Points.push_back(endOf(BB));
+            if (PHINode *PN = dyn_cast<PHINode>(R.V))
+                for (const BasicBlock *Pred : PN->blocks())
+                    Points.push_back(endOf(Pred));
+            // a direct alloca is a variable: it keeps its register throughout
+            if (isDirectAlloca(R.V)) {
+                Points.push_back(0);
+                Points.push_back(2 * N - 1);
+            }
+            L.Start = std::min(L.Start, *std::min_element(Points.begin(), Points.end()));
+            L.End = std::max(L.End, *std::max_element(Points.begin(), Points.end()));
+        }
+        Order.push_back(C.first);
+    }
+    // arguments first: the caller leaves them in R1..Rn
+    std::stable_sort(Order.begin(), Order.end(), [&](unsigned a, unsigned b) {
+        return std::make_pair(Ranges[a].Start, !isa<Argument>(Ranges[a].V)) <
+               std::make_pair(Ranges[b].Start, !isa<Argument>(Ranges[b].V));
+    });
+
+    // Linear scan: FreeFrom[r] is the first point at which r is unused.  R0 is
+    // never allocated.  When registers run out, the range ending last among
+    // the current one and those holding registers moves to a spill slot.
+    std::vector<unsigned> FreeFrom(1, ~0u);
+    std::map<unsigned, unsigned> RegOf;
+    std::vector<unsigned> Active;
+    auto canSpill = [&](unsigned c) {
+        return !isa<Argument>(Ranges[c].V) && !isDirectAlloca(Ranges[c].V) &&
+               regsFor(Ranges[c].V->getType()) == 1;
+    };
+    auto spill = [&](unsigned c) {
+        for (unsigned m : Members[c])
+            SpillSlots[Ranges[m].V] = NumSpillSlots;
+        ++NumSpillSlots;
+    };
+    for (unsigned c : Order) {
+        const LiveRange &L = Ranges[c];
+        const unsigned Count = regsFor(L.V->getType());
+        Active.erase(std::remove_if(Active.begin(), Active.end(), [&](unsigned a) {
+            return Ranges[a].End < L.Start;
+        }), Active.end());
+
+        unsigned Reg = 0;
+        if (const Argument *A = dyn_cast<Argument>(L.V))
+            Reg = A->getArgNo() + 1;
+        while (!Reg) {
+            for (Reg = 1; ; ++Reg) {
+                unsigned k = 0;
+                while (k < Count && (Reg + k >= FreeFrom.size() || FreeFrom[Reg + k] <= L.Start))
+                    ++k;
+                if (k == Count)
+                    break;
+            }
+            if (Reg + Count - 1 <= MaxValueReg)
+                break;
+            Reg = 0;
+
+            auto Victim = Active.end();
+            for (auto a = Active.begin(); a != Active.end(); ++a)
+                if (canSpill(*a) && (Victim == Active.end() || Ranges[*a].End > Ranges[*Victim].End))
+                    Victim = a;
+            if (Victim == Active.end() || (canSpill(c) && Ranges[*Victim].End <= L.End)) {
+                if (!canSpill(c))
+                    report_fatal_error("function " + F.getName() + " has too many values live at once");
+                break;
+            }
+            FreeFrom[RegOf[*Victim]] = 0;
+            RegOf.erase(*Victim);
+            spill(*Victim);
+            Active.erase(Victim);
+        }
+        if (!Reg) {
+            spill(c);
+            continue;
+        }
+
+        if (FreeFrom.size() < Reg + Count)
+            FreeFrom.resize(Reg + Count, 0);
+        for (unsigned k = 0; k < Count; ++k)
+            FreeFrom[Reg + k] = L.End + 1;
+        RegOf[c] = Reg;
+        Active.push_back(c);
+    }
+
+    FreeRegAt.assign(N, 1);
+    for (const auto &C : RegOf) {
+        const LiveRange &L = Ranges[C.first];
+        for (unsigned m : Members[C.first])
+            Locals[Ranges[m].V] = C.second;
+        for (unsigned p = L.Start / 2; p <= L.End / 2 && p < N; ++p)
+            FreeRegAt[p] = std::max(FreeRegAt[p], C.second + regsFor(L.V->getType()));
+    }
+}
+
+// Whether V and W are kept in the same register or spill slot.
+bool RbvmWriter::isSameHome(Value *V, Value *W) {
+    auto SV = SpillSlots.find(V), SW = SpillSlots.find(W);
+    if (SV != SpillSlots.end() || SW != SpillSlots.end())
+        return SV != SpillSlots.end() && SW != SpillSlots.end() && SV->second == SW->second;
+    return Locals.lookup(V) == Locals.lookup(W);
+}
+
 void RbvmWriter::writeInstComputationInline(Instruction &I) {
     visit(&I);
-    writeCastTo(I.getType());
 }
 
 void RbvmWriter::printBasicBlock(BasicBlock *BB) {
     rememberBlock(BB);
 
     for (BasicBlock::iterator II = BB->begin(), E = --BB->end(); II != E; ++II) {
-        if (!isDirectAlloca(&*II)) {
+        NextReg = FreeRegAt[InstPos.lookup(&*II)] - 1;
+        if (isTailCallInReturnPosition(&*II)) {
+            visit(*II);
+        } else if (!isa<PHINode>(*II) && !isDirectAlloca(&*II) && !isFusedCompare(&*II) &&
+                   !isFoldedAddress(&*II)) {
+            const bool HasResult = !isEmptyType(II->getType());
+            auto Slot = SpillSlots.find(&*II);
+            const bool Spilled = Slot != SpillSlots.end();
+            if (HasResult && !Spilled && regsFor(II->getType()) == 1)
+                DestReg = Locals.lookup(&*II);
             writeInstComputationInline(*II);
-            if (!isEmptyType(II->getType())) {
-                produceAmbigRR(Commands::CMD_MOV, Locals[&*II], ResultReg);
+            DestReg = 0;
+            if (HasResult && Spilled)
+                produceSpill(Slot->second, ResultReg);
+            else if (HasResult && ResultReg != Locals.lookup(&*II)) {
+                produceMove(II->getType(), Locals.lookup(&*II), ResultReg);
             }
         }
+        MaxReg = std::max(MaxReg, NextReg);
     }
+    NextReg = FreeRegAt[InstPos.lookup(BB->getTerminator())] - 1;
     visit(*BB->getTerminator());
+    MaxReg = std::max(MaxReg, NextReg);
 }
 
-void RbvmWriter::printLoop(Loop *L) {
-    const size_t begin_pos = markPosition();
-
+// Appends the blocks of L, its inner loops kept together.  A loop whose
+// header tests for the exit and whose latch only jumps back (a while loop
+// the passes did not rotate) is rotated: the header goes last, after the
+// latch, so that the body falls through into the test and the test jumps
+// back to the top.  Entering the loop takes a jump to the test; each
+// iteration then takes only the test's conditional jump.
+void RbvmWriter::layoutLoop(Loop *L, std::vector<BasicBlock*> &Layout) {
+    const size_t Start = Layout.size();
     for (BasicBlock *BB : L->getBlocks()) {
         Loop *BBLoop = LI->getLoopFor(BB);
         if (BBLoop == L)
-            printBasicBlock(BB);
+            Layout.push_back(BB);
         else if (BB == BBLoop->getHeader() && BBLoop->getParentLoop() == L)
-            printLoop(BBLoop);
+            layoutLoop(BBLoop, Layout);
     }
 
-    produceStraightJump(begin_pos);
+    BasicBlock *Header = L->getHeader(), *Latch = L->getLoopLatch();
+    if (!Latch || Latch == Header || LI->getLoopFor(Latch) != L || !L->isLoopExiting(Header))
+        return;
+    BranchInst *HeaderBr = dyn_cast<BranchInst>(Header->getTerminator());
+    BranchInst *LatchBr = dyn_cast<BranchInst>(Latch->getTerminator());
+    if (!HeaderBr || !HeaderBr->isConditional() || !LatchBr || LatchBr->isConditional())
+        return;
+    // the header is the first block of a loop
+    Layout.erase(Layout.begin() + Start);
+    Layout.erase(std::find(Layout.begin() + Start, Layout.end(), Latch));
+    Layout.push_back(Latch);
+    Layout.push_back(Header);
+}
+
+// The order to emit F's blocks in: by its profile if it has one, otherwise
+// as in F with every loop kept together and rotated by layoutLoop.
+std::vector<BasicBlock*> RbvmWriter::blockLayout(Function &F) {
+    std::vector<BasicBlock*> Layout = profileLayout(F);
+    if (!Layout.empty())
+        return Layout;
+    for (BasicBlock &BB : F) {
+        if (Loop *L = LI->getLoopFor(&BB)) {
+            if (L->getHeader() == &BB && !L->getParentLoop())
+                layoutLoop(L, Layout);
+        } else
+            Layout.push_back(&BB);
+    }
+    return Layout;
 }
 
-void RbvmWriter::printFunction(Function &F) {
+void RbvmWriter::printFunction(Function &F, const std::vector<BasicBlock*> &Layout) {
     assert(!F.isDeclaration());
 
     HandleFD h = produceFuncDecl(F.getName(),F.getFunctionType()->getNumParams());
+    BodyStart = h + 8;
 
     for (auto &ArgName : F.args()) {
-        Locals[&ArgName] = ++NextReg;
-    }
-    for (inst_iterator I = inst_begin(&F), E = inst_end(&F); I != E; ++I) {
-        if (!isEmptyType(I->getType())) {
-            Locals[&*I] = ++NextReg;
-        }
+        if (ArgName.getType()->isVectorTy())
+            report_fatal_error("vector arguments are not supported");
     }
+    allocateRegisters(F);
+    if (NumSpillSlots)
+        produceFrame(NumSpillSlots);
 
-    for (BasicBlock &BB_ref : F) {
-        BasicBlock *BB = &BB_ref;
-        if (Loop *L = LI->getLoopFor(BB)) {
-            if (L->getHeader() == BB && L->getParentLoop() == 0) {
-                printLoop(L);
-            }
-        } 
-        else
-            printBasicBlock(BB);
+    for (size_t k = 0; k < Layout.size(); ++k) {
+        NextBlock = k + 1 < Layout.size() ? Layout[k + 1] : nullptr;
+        printBasicBlock(Layout[k]);
     }
+    NextBlock = nullptr;
+
+    if (MaxReg > 255)
+        report_fatal_error("function " + F.getName() + " needs more than 255 registers");
 
     fixupFD(h);
     fixupPostponed();
 
     PostponedJumps.clear();
+    PostponedTableJumps.clear();
     BlockPositions.clear();
     Locals.clear();
+    InstPos.clear();
+    FreeRegAt.clear();
+    SpillSlots.clear();
+    MemoryAllocas.clear();
+    NumSpillSlots = 0;
+    MaxReg = 0;
     NextAnonValueNumber = 0;
     NextReg = 0;
     ResultReg = 0;
@@ -266,41 +1046,107 @@ void RbvmWriter::printFunction(Function &F) {
 
 void RbvmWriter::visitLoadInst(LoadInst &I) {
     Value *Operand = I.getOperand(0);
+    if (VectorType *VTy = dyn_cast<VectorType>(I.getType())) {
+        writeOperand(Operand);
+        auto Ptr = ResultReg;
+        ResultReg = allocRegs(VTy);
+        produce1(Commands::CMD_VLD);
+        produce1(vectorBytes(VTy));
+        produce1(ResultReg);
+        produce1(Ptr);
+        return;
+    }
+    uint64_t Addr;
+    IndexedAddress A;
+    const unsigned width = memoryBits(I.getType());
     if (isAddressExposed(Operand))
         writeOperandInternal(Operand);
-    else {
+    else if (getDataAddress(Operand, Addr)) {
+        ResultReg = resultRegister();
+        produceLD_RC(width, ResultReg, Addr);
+    } else if (writeFoldedAddress(Operand, A)) {
+        ResultReg = resultRegister();
+        produceLDX(width, ResultReg, A);
+    } else {
         writeOperand(Operand);
-        auto where = ++NextReg;
-
-        auto width = Operand->getType()->getPointerElementType()->getPrimitiveSizeInBits();
+        auto where = resultRegister();
         produceLD_RR(width, where, ResultReg);
-
         ResultReg = where;
     }
 }
 
 void RbvmWriter::visitStoreInst(StoreInst &I) {
     Value *Pointer = I.getPointerOperand();
+    if (VectorType *VTy = dyn_cast<VectorType>(I.getOperand(0)->getType())) {
+        writeOperand(I.getOperand(0));
+        auto Src = ResultReg;
+        writeOperand(Pointer);
+        produce1(Commands::CMD_VST);
+        produce1(vectorBytes(VTy));
+        produce1(ResultReg);
+        produce1(Src);
+        return;
+    }
+    if (I.getOperand(0)->getType()->isAggregateType()) {
+        // storing an aggregate copies it from where its address points
+        Constant *C = dyn_cast<Constant>(I.getOperand(0));
+        const bool Zero = C && C->isNullValue();
+        int Regs[3];
+        writeOperand(Pointer);
+        Regs[0] = ResultReg;
+        if (Zero) {
+            Regs[1] = ++NextReg;
+            produceAmbigRC(Commands::CMD_MOV, Regs[1], 0);
+        } else {
+            writeOperand(I.getOperand(0));
+            Regs[1] = ResultReg;
+        }
+        Regs[2] = ++NextReg;
+        produceAmbigRC(Commands::CMD_MOV, Regs[2], TD->getTypeStoreSize(I.getOperand(0)->getType()));
+        produce1(Zero ? Commands::CMD_MEMSET : Commands::CMD_MEMCPY);
+        for (int R : Regs)
+            produce1(R);
+        return;
+    }
     writeOperand(I.getOperand(0));
     auto whatToStore = ResultReg;
 
-    if (isa<GlobalValue>(Pointer)) {
-        if (GlobalAlias *GA = dyn_cast<GlobalAlias>(Pointer)) {
-            Pointer = GA->getAliasee();
-        }
-        modifyGlobal(Pointer->getName(), whatToStore);
-    } else if (isDirectAlloca(Pointer)) {
+    uint64_t Addr;
+    IndexedAddress A;
+    const unsigned width = memoryBits(I.getOperand(0)->getType());
+    if (getDataAddress(Pointer, Addr))
+        produceST_CR(width, Addr, whatToStore);
+    else if (writeFoldedAddress(Pointer, A))
+        produceSTX(width, A, whatToStore);
+    else if (isDirectAlloca(Pointer)) {
         writeOperandInternal(Pointer);
         produceAmbigRR(Commands::CMD_MOV, ResultReg, whatToStore);
     } else {
         writeOperandInternal(Pointer);
-        auto width = Pointer->getType()->getPointerElementType()->getPrimitiveSizeInBits();
         produceST_RR(width, ResultReg, whatToStore);
     }
 }
 
+void RbvmWriter::visitAllocaInst(AllocaInst &I) {
+    const uint64_t ElemSize = TD->getTypeAllocSize(I.getAllocatedType());
+    auto new_reg = ++NextReg;
+
+    if (ConstantInt *CI = dyn_cast<ConstantInt>(I.getArraySize()))
+        produceAmbigRC(Commands::CMD_ALLOCA, new_reg, ElemSize * CI->getZExtValue());
+    else {
+        writeOperand(I.getArraySize());
+        produceAmbig3(Commands::CMD_UMUL, new_reg, ResultReg, {true, ElemSize});
+        produceAmbigRR(Commands::CMD_ALLOCA, new_reg, new_reg);
+    }
+    ResultReg = new_reg;
+}
+
 void RbvmWriter::visitReturnInst(ReturnInst &I) {
+    if (isTailCallInReturnPosition(I.getPrevNode()))
+        return;
     if (I.getNumOperands()) {
+        if (I.getOperand(0)->getType()->isVectorTy())
+            report_fatal_error("vector results are not supported");
         writeOperand(I.getOperand(0));
         produceRetR(ResultReg);
         return;
@@ -317,11 +1163,19 @@ void RbvmWriter::writeOperandInternal(Value *Operand) {
         if (GlobalAlias *GA = dyn_cast<GlobalAlias>(Operand)) {
             Operand = GA->getAliasee();
         }
+        uint64_t Addr;
         ResultReg = ++NextReg;
-        produceGG(Mangle(Operand->getName()), ResultReg);
+        if (getDataAddress(Operand, Addr))
+            produceAmbigRC(Commands::CMD_MOV, ResultReg, Addr);
+        else
+            produceGG(Mangle(Operand->getName()), ResultReg);
     } 
+    else if (SpillSlots.count(Operand)) {
+        ResultReg = ++NextReg;
+        produceReload(ResultReg, SpillSlots.lookup(Operand));
+    }
     else
-        ResultReg = Locals[Operand];
+        ResultReg = Locals.lookup(Operand);
 }
 
 bool RbvmWriter::isAddressExposed(Value *V) {
@@ -340,66 +1194,666 @@ void RbvmWriter::writeOperand(Value *Operand) {
     }
 }
 
-bool RbvmTargetMachine::addPassesToEmitFile (
-        PassManagerBase &PM,
-        raw_pwrite_stream &out,
-#if ! LESSER_LLVM
-        raw_pwrite_stream *DwoOut,
-#endif
-        CodeGenFileType FileType,
-        bool DisableVerify,
-        MachineModuleInfo *MMI) {
-    
-    if (FileType != TargetMachine::CGFT_AssemblyFile)
-        return true;
+// A call costs the VM a frame, argument moves and a return, each a dispatch
+// of its own, while code size is cheap; so RBVM inlines more eagerly than
+// LLVM's native defaults (225 at -O2, 250 at -O3).
+static const int RbvmInlineThreshold = 300;
+static const int RbvmAggressiveInlineThreshold = 450;
+
+// IR optimizations run before RbvmWriter at -O1 and above.  Only passes whose
+// output the writer can lower are used: no vectorizers, no loop idiom
+// recognition, and library call simplification is held to the natives the
+// VM provides by the TargetLibraryInfo that llvm-rbvm sets up.
+static void addOptimizationPasses(PassManagerBase &PM, CodeGenOpt::Level OL) {
+    // promote allocas to registers first; everything after works on SSA
+    PM.add(createSROAPass());
+    PM.add(createPromoteMemoryToRegisterPass());
+    PM.add(createEarlyCSEPass());
+    PM.add(createInstructionCombiningPass());
+    PM.add(createCFGSimplificationPass());
+    if (OL == CodeGenOpt::Less)
+        return;
 
-    PM.add(createGCLoweringPass());
-    PM.add(createLowerInvokePass());
+    // function passes added after the inliner run inside it, callees first,
+    // so each caller sees its callees already simplified
+    InlineParams Params = getInlineParams(
+        OL == CodeGenOpt::Aggressive ? RbvmAggressiveInlineThreshold : RbvmInlineThreshold);
+    PM.add(createFunctionInliningPass(Params));
+    PM.add(createSROAPass());
+    PM.add(createEarlyCSEPass());
+    PM.add(createInstructionCombiningPass());
     PM.add(createCFGSimplificationPass());
-    PM.add(new RbvmWriter(out));
-    return false;
+
+    PM.add(createLoopSimplifyPass());
+    PM.add(createLCSSAPass());
+    PM.add(createLoopRotatePass());
+    PM.add(createLICMPass());
+    if (OL == CodeGenOpt::Aggressive)
+        PM.add(createSimpleLoopUnrollPass(3));
+    PM.add(createGVNPass());
+    PM.add(createInstructionCombiningPass());
+    PM.add(createDeadStoreEliminationPass());
+    PM.add(createAggressiveDCEPass());
+    PM.add(createCFGSimplificationPass());
+
+    // drops the functions that were inlined everywhere; being a module pass,
+    // it also makes RbvmWriter run after the inliner is done with the module
+    // rather than inside it
+    PM.add(createGlobalDCEPass());
 }
 
+// Profile-guided compilation.  A -fprofile-generate build tags the
+// terminator of every block with the block's number in the unoptimized IR,
+//   !rbvm.block !{!"function", i32 blocks, i32 number, i32 successors...},
+// which travels with the code through inlining and the other passes, and
+// puts prof records in the bytecode that tell the VM which tagged block each
+// two-way branch comes from.  The VM's --profile counts by those numbers;
+// a -fprofile-use build of the same source numbers the blocks the same way
+// before optimizing and turns the counts into branch weights and entry
+// counts.  Hot functions get inlinehint and functions never entered get
+// cold, which the inliner weighs; the writer lays blocks out by the weights
+// (profileLayout).
+
+static cl::opt<bool> ProfileGenerate("fprofile-generate",
+                                     cl::desc("Number blocks for the VM's --profile"));
+static cl::opt<std::string> ProfileUse("fprofile-use",
+                                       cl::desc("Optimize for a profile written by the VM's --profile"),
+                                       cl::value_desc("filename"));
+
+// functions entered at least 1/HotFunctionRatio as often as the most entered
+// one are hot
+static const uint64_t HotFunctionRatio = 100;
+
+char RbvmProfilePass::ID = 0;
+
+bool RbvmProfilePass::runOnModule(Module &M) {
+    if (!ProfileUse.empty())
+        applyProfile(M);
+    else
+        for (Function &F : M)
+            if (!F.isDeclaration())
+                tagBlocks(F);
+    return true;
+}
 
-static Commands GetMnemonics(unsigned opcode) {
-    switch (opcode) {
-    case Instruction::Add:      return Commands::CMD_IADD;
-    case Instruction::FAdd:     return Commands::CMD_FADD;
-    case Instruction::Sub:      return Commands::CMD_ISUB;
-    case Instruction::FSub:     return Commands::CMD_FSUB;
-    case Instruction::Mul:      return Commands::CMD_SMUL;
-    case Instruction::FMul:     return Commands::CMD_FMUL;
-    case Instruction::URem:     return Commands::CMD_UREM;
-    case Instruction::SRem:     return Commands::CMD_SREM;
-    case Instruction::FRem:     return Commands::CMD_FREM;
-    case Instruction::UDiv:     return Commands::CMD_UDIV;
-    case Instruction::SDiv:     return Commands::CMD_SDIV;
-    case Instruction::FDiv:     return Commands::CMD_FDIV;
-    case Instruction::And:      return Commands::CMD_AND;
-    case Instruction::Or:       return Commands::CMD_OR;
-    case Instruction::Xor:      return Commands::CMD_XOR;
-    case Instruction::Shl :     return Commands::CMD_SHL;
-    case Instruction::LShr:     return Commands::CMD_LSHR;
-    case Instruction::AShr:     return Commands::CMD_ASHR;
-    default:
-                            errs() << "Invalid operator type!" << opcode;
-                            llvm_unreachable(0);
+void RbvmProfilePass::tagBlocks(Function &F) {
+    LLVMContext &Ctx = F.getContext();
+    auto number = [&](uint64_t N) {
+        return ConstantAsMetadata::get(ConstantInt::get(Type::getInt32Ty(Ctx), N));
+    };
+    std::map<const BasicBlock*, unsigned> Number;
+    unsigned N = 0;
+    for (BasicBlock &BB : F)
+        Number[&BB] = N++;
+
+    for (BasicBlock &BB : F) {
+        Instruction *TI = BB.getTerminator();
+        std::vector<Metadata*> Ops = {MDString::get(Ctx, F.getName()), number(N), number(Number[&BB])};
+        for (unsigned k = 0, n = TI->getNumSuccessors(); k < n; ++k)
+            Ops.push_back(number(Number[TI->getSuccessor(k)]));
+        TI->setMetadata("rbvm.block", MDNode::get(Ctx, Ops));
     }
 }
 
+void RbvmProfilePass::applyProfile(Module &M) {
+    auto Buf = MemoryBuffer::getFile(ProfileUse);
+    if (!Buf)
+        report_fatal_error(Twine("cannot read profile ") + ProfileUse);
+
+    // entry <function> <count>
+    // branch <function> <blocks> <block> <count to successor 0> <count to successor 1>
+    std::map<StringRef, uint64_t> Entries;
+    std::map<std::pair<StringRef, uint64_t>, std::array<uint64_t, 3> > Branches;
+    uint64_t MaxEntries = 0;
+    for (line_iterator L(**Buf); !L.is_at_end(); ++L) {
+        SmallVector<StringRef, 6> Fields;
+        L->split(Fields, ' ');
+        bool Bad = true;
+        if (Fields[0] == "entry" && Fields.size() == 3) {
+            uint64_t &N = Entries[Fields[1]];
+            Bad = Fields[2].getAsInteger(10, N);
+            MaxEntries = std::max(MaxEntries, N);
+        } else if (Fields[0] == "branch" && Fields.size() == 6) {
+            uint64_t Block;
+            std::array<uint64_t, 3> B;
+            Bad = Fields[3].getAsInteger(10, Block) || Fields[2].getAsInteger(10, B[0]) ||
+                  Fields[4].getAsInteger(10, B[1]) || Fields[5].getAsInteger(10, B[2]);
+            Branches[std::make_pair(Fields[1], Block)] = B;
+        }
+        if (Bad)
+            report_fatal_error(Twine("malformed profile ") + ProfileUse);
+    }
 
-void RbvmWriter::visitBinaryOperator(BinaryOperator &I) {
-    assert(!I.getType()->isPointerTy());
-    writeOperand(I.getOperand(0));
-    auto new_reg = ++NextReg;
-    produceAmbigRR(Commands::CMD_MOV, new_reg, ResultReg);
+    MDBuilder MDB(M.getContext());
+    for (Function &F : M) {
+        if (F.isDeclaration())
+            continue;
+        auto E = Entries.find(F.getName());
+        if (E != Entries.end()) {
+            F.setEntryCount(E->second);
+            if (!E->second)
+                F.addFnAttr(Attribute::Cold);
+            else if (E->second * HotFunctionRatio >= MaxEntries && !F.hasFnAttribute(Attribute::NoInline))
+                F.addFnAttr(Attribute::InlineHint);
+        }
 
-    writeOperand(I.getOperand(1));
+        unsigned N = 0;
+        for (BasicBlock &BB : F) {
+            BranchInst *BI = dyn_cast<BranchInst>(BB.getTerminator());
+            auto B = Branches.find(std::make_pair(F.getName(), uint64_t(N++)));
+            // a profile of other code
+            if (!BI || !BI->isConditional() || B == Branches.end() || B->second[0] != F.size())
+                continue;
+            uint64_t W[2] = {B->second[1], B->second[2]};
+            while (std::max(W[0], W[1]) > UINT32_MAX) {
+                W[0] >>= 1;
+                W[1] >>= 1;
+            }
+            BI->setMetadata(LLVMContext::MD_prof, MDB.createBranchWeights(W[0], W[1]));
+        }
+    }
+}
 
-    produceAmbigRR(GetMnemonics(I.getOpcode()), new_reg, ResultReg);
-    ResultReg = new_reg;
+// The function, block count and number of the block TI was tagged in by
+// -fprofile-generate, followed by the numbers of its successors.
+static bool getBlockTag(const Instruction *TI, unsigned Kind, StringRef &Origin, std::vector<uint64_t> &Numbers) {
+    MDNode *MD = TI->getMetadata(Kind);
+    if (!MD || MD->getNumOperands() < 3)
+        return false;
+    Origin = cast<MDString>(MD->getOperand(0))->getString();
+    Numbers.clear();
+    for (unsigned k = 1, n = MD->getNumOperands(); k < n; ++k)
+        Numbers.push_back(mdconst::extract<ConstantInt>(MD->getOperand(k))->getZExtValue());
+    return true;
+}
+
+// Notes for the prof records that the jump at h is taken to successor
+// JumpSucc of I.  The passes may have swapped the successors of the tagged
+// branch or put blocks on its edges, so the tags of the blocks it leads to
+// tell which successor of the tagged branch that is, where they can.
+void RbvmWriter::recordProfBranch(BranchInst &I, HandleBR h, unsigned JumpSucc) {
+    StringRef Origin;
+    std::vector<uint64_t> N;
+    if (!ProfileGenerate || !getBlockTag(&I, BlockTagKind, Origin, N) || N.size() != 4)
+        return;
 
-    writeCastTo(I.getType());
+    int Tagged[2] = {-1, -1};
+    for (unsigned k = 0; k < 2; ++k) {
+        StringRef O;
+        std::vector<uint64_t> S;
+        if (getBlockTag(I.getSuccessor(k)->getTerminator(), BlockTagKind, O, S) && O == Origin && S[0] == N[0])
+            Tagged[k] = S[1] == N[2] ? 0 : S[1] == N[3] ? 1 : -1;
+    }
+    unsigned Succ = JumpSucc;
+    if (Tagged[JumpSucc] >= 0)
+        Succ = Tagged[JumpSucc];
+    else if (Tagged[1 - JumpSucc] >= 0)
+        Succ = 1 - Tagged[1 - JumpSucc];
+
+    auto &P = ProfBlocks[std::make_pair(I.getFunction()->getName().str(), Origin.str())];
+    P.first = N[0];
+    P.second.push_back(std::make_tuple(h - BodyStart, N[1], Succ));
+}
+
+// The weight of the edge from TI to its successor k, if TI has weights.
+static bool getEdgeWeight(const Instruction *TI, unsigned k, uint64_t &W) {
+    MDNode *MD = TI->getMetadata(LLVMContext::MD_prof);
+    if (!MD || MD->getNumOperands() != TI->getNumSuccessors() + 1)
+        return false;
+    MDString *Name = dyn_cast<MDString>(MD->getOperand(0));
+    ConstantInt *CI = mdconst::dyn_extract<ConstantInt>(MD->getOperand(k + 1));
+    if (!Name || Name->getString() != "branch_weights" || !CI)
+        return false;
+    W = CI->getZExtValue();
+    return true;
+}
+
+// Lays F out by its branch weights: each block is followed by its most
+// likely successor not placed yet, so that the hot path falls through, and
+// the blocks that only edges of weight 0 lead to go last.  Empty if F has no
+// weights.
+std::vector<BasicBlock*> RbvmWriter::profileLayout(Function &F) {
+    std::vector<BasicBlock*> Layout;
+    uint64_t W;
+    if (std::none_of(F.begin(), F.end(), [&](BasicBlock &BB) {
+            return BB.getTerminator()->getNumSuccessors() && getEdgeWeight(BB.getTerminator(), 0, W);
+        }))
+        return Layout;
+
+    std::set<BasicBlock*> Hot = {&F.getEntryBlock()};
+    std::vector<BasicBlock*> Work = {&F.getEntryBlock()};
+    while (!Work.empty()) {
+        Instruction *TI = Work.back()->getTerminator();
+        Work.pop_back();
+        for (unsigned k = 0, n = TI->getNumSuccessors(); k < n; ++k)
+            if ((!getEdgeWeight(TI, k, W) || W) && Hot.insert(TI->getSuccessor(k)).second)
+                Work.push_back(TI->getSuccessor(k));
+    }
+
+    std::set<BasicBlock*> Placed;
+    // the first blocks not placed yet: hot ones, and any
+    Function::iterator NextHot = F.begin(), NextAny = F.begin();
+    for (BasicBlock *BB = &F.getEntryBlock(); BB; ) {
+        Layout.push_back(BB);
+        Placed.insert(BB);
+
+        // a hot block is followed by a hot one, a cold block by a cold one
+        const bool IsHot = Hot.count(BB);
+        BasicBlock *Next = nullptr;
+        uint64_t Best = 0;
+        Instruction *TI = BB->getTerminator();
+        for (unsigned k = 0, n = TI->getNumSuccessors(); k < n; ++k) {
+            BasicBlock *S = TI->getSuccessor(k);
+            const uint64_t SW = getEdgeWeight(TI, k, W) ? W : 1;
+            if (!Placed.count(S) && Hot.count(S) == IsHot && (!Next || SW > Best)) {
+                Next = S;
+                Best = SW;
+            }
+        }
+        while (NextHot != F.end() && (Placed.count(&*NextHot) || !Hot.count(&*NextHot)))
+            ++NextHot;
+        while (NextAny != F.end() && Placed.count(&*NextAny))
+            ++NextAny;
+        if (!Next)
+            Next = NextHot != F.end() ? &*NextHot : NextAny != F.end() ? &*NextAny : nullptr;
+        BB = Next;
+    }
+    return Layout;
+}
+
+// The code cache.  With -cache-dir, the code of every function is kept in a
+// file named by the MD5 of everything it is generated from:
+//  - the function's IR as printed, without its metadata,
+//  - the contents of the metadata the writer reads, branch weights and block
+//    tags,
+//  - the name and data address of each global it uses, the address of each
+//    array and struct constant, and whether -fprofile-generate is on,
+//  - CacheFormat, the version of the code the backend generates.
+// A function whose key has an entry is not generated again, so after an edit
+// only the functions whose IR changed are.  An edit that moves a global also
+// changes the code of every function using it, and one that renumbers the
+// attribute groups or the debug info that calls refer to changes the printed
+// IR of the functions after it; those are generated again as well.  Entries
+// are written to a temporary file and renamed, so that compilations sharing
+// a directory see whole entries or none.  The cache is never cleaned.
+//
+// An entry holds: <Micros:u64> <CodeSize:u64> <Code> <Records:u32>
+// (<Func:string> <Origin:string> <Blocks:u32> <Count:u32> (<Off:u32> <Block:u32> <Succ:u8>)...)...
+// in the byte order of the host.
+
+// Bump this whenever the code generated for the same IR changes: a change to
+// the code generator, to the bytecode encoding or to the entry format.
+static const unsigned CacheFormat = 1;
+
+std::string RbvmWriter::cacheKey(Function &F) {
+    std::string Text;
+    raw_string_ostream OS(Text);
+    OS << "rbvm " << CacheFormat << '\n' << F.getParent()->getDataLayoutStr() << '\n' << bool(ProfileGenerate) << '\n';
+
+    // metadata is printed as numbers counted over the whole module, which
+    // any edit can shift; it is left out while F is printed and the contents
+    // of the kinds the writer reads are printed instead
+    std::vector<std::pair<Instruction*, SmallVector<std::pair<unsigned, MDNode*>, 4> > > Attached;
+    std::vector<Constant*> Work;
+    std::set<Constant*> Seen;
+    for (Instruction &I : instructions(F)) {
+        Attached.emplace_back(&I, SmallVector<std::pair<unsigned, MDNode*>, 4>());
+        I.getAllMetadata(Attached.back().second);
+        for (const auto &MD : Attached.back().second) {
+            I.setMetadata(MD.first, nullptr);
+            if (MD.first != LLVMContext::MD_prof && MD.first != BlockTagKind)
+                continue;
+            for (const MDOperand &Op : MD.second->operands()) {
+                if (MDString *S = dyn_cast_or_null<MDString>(Op))
+                    OS << S->getString() << ' ';
+                else if (ConstantInt *CI = mdconst::dyn_extract_or_null<ConstantInt>(Op))
+                    OS << CI->getValue() << ' ';
+            }
+            OS << '\n';
+        }
+        for (Value *Op : I.operands())
+            if (Constant *C = dyn_cast<Constant>(Op))
+                Work.push_back(C);
+    }
+    F.print(OS);
+    for (const auto &A : Attached)
+        for (const auto &MD : A.second)
+            A.first->setMetadata(MD.first, MD.second);
+    while (!Work.empty()) {
+        Constant *C = Work.back();
+        Work.pop_back();
+        if (!Seen.insert(C).second)
+            continue;
+        uint64_t Addr = 0;
+        if (GlobalValue *GV = dyn_cast<GlobalValue>(C)) {
+            getDataAddress(GV, Addr);
+            OS << GV->getName() << ' ' << *GV->getValueType() << ' ' << Addr << '\n';
+        } else if (ConstantOffsets.count(C))
+            OS << getConstantAddress(C) << '\n';
+        else if (isa<ConstantExpr>(C))
+            for (Value *Op : C->operands())
+                Work.push_back(cast<Constant>(Op));
+    }
+    OS.flush();
+
+    MD5 Hash;
+    Hash.update(Text);
+    MD5::MD5Result Result;
+    Hash.final(Result);
+    SmallString<32> Hex;
+    MD5::stringifyResult(Result, Hex);
+    return std::string(Hex.str());
+}
+
+static std::string cachePath(StringRef Key) {
+    SmallString<128> Path(CacheDir);
+    sys::path::append(Path, Key + ".rbvmc");
+    return std::string(Path.str());
+}
+
+// Fills in the code of P from its cache entry, if it has one.
+bool RbvmWriter::readCache(PendingFunction &P) {
+    if (CacheDir.empty())
+        return false;
+    P.CacheKey = cacheKey(*P.F);
+    auto Buf = MemoryBuffer::getFile(cachePath(P.CacheKey));
+    if (!Buf)
+        return false;
+
+    StringRef In = (*Buf)->getBuffer();
+    bool Bad = false;
+    auto read = [&](void *To, size_t Size) {
+        if (Bad || In.size() < Size) {
+            Bad = true;
+            return;
+        }
+        memcpy(To, In.data(), Size);
+        In = In.drop_front(Size);
+    };
+    auto readString = [&](std::string &S) {
+        uint32_t Size = 0;
+        read(&Size, sizeof(Size));
+        Bad |= In.size() < Size;
+        if (!Bad) {
+            S = In.take_front(Size);
+            In = In.drop_front(Size);
+        }
+    };
+
+    uint64_t CodeSize = 0;
+    uint32_t Records = 0;
+    read(&P.Micros, sizeof(P.Micros));
+    read(&CodeSize, sizeof(CodeSize));
+    Bad |= In.size() < CodeSize;
+    if (!Bad) {
+        P.Code = In.take_front(CodeSize);
+        In = In.drop_front(CodeSize);
+    }
+    read(&Records, sizeof(Records));
+    for (uint32_t r = 0; r < Records && !Bad; ++r) {
+        std::pair<std::string, std::string> Key;
+        uint32_t Blocks = 0, Count = 0;
+        readString(Key.first);
+        readString(Key.second);
+        read(&Blocks, sizeof(Blocks));
+        read(&Count, sizeof(Count));
+        auto &Branches = P.Prof[Key];
+        Branches.first = Blocks;
+        for (uint32_t k = 0; k < Count && !Bad; ++k) {
+            uint32_t Off = 0, Block = 0;
+            uint8_t Succ = 0;
+            read(&Off, sizeof(Off));
+            read(&Block, sizeof(Block));
+            read(&Succ, sizeof(Succ));
+            Branches.second.push_back(std::make_tuple(Off, Block, Succ));
+        }
+    }
+
+    if (Bad || !In.empty()) {
+        P.Code.clear();
+        P.Prof.clear();
+        P.Micros = 0;
+        return false;
+    }
+    P.Done = P.Cached = true;
+    return true;
+}
+
+// Errors are ignored: the cache only saves time.
+void RbvmWriter::writeCache(const PendingFunction &P) {
+    if (P.CacheKey.empty() || sys::fs::create_directories(CacheDir))
+        return;
+    const std::string Path = cachePath(P.CacheKey);
+    int FD;
+    SmallString<128> TempPath;
+    if (sys::fs::createUniqueFile(Path + "-%%%%%%", FD, TempPath))
+        return;
+
+    std::string Out;
+    auto write = [&](const void *From, size_t Size) { Out.append((const char *) From, Size); };
+    auto writeString = [&](const std::string &S) {
+        const uint32_t Size = S.size();
+        write(&Size, sizeof(Size));
+        Out += S;
+    };
+    const uint64_t CodeSize = P.Code.size();
+    const uint32_t Records = P.Prof.size();
+    write(&P.Micros, sizeof(P.Micros));
+    write(&CodeSize, sizeof(CodeSize));
+    Out += P.Code;
+    write(&Records, sizeof(Records));
+    for (const auto &R : P.Prof) {
+        const uint32_t Blocks = R.second.first, Count = R.second.second.size();
+        writeString(R.first.first);
+        writeString(R.first.second);
+        write(&Blocks, sizeof(Blocks));
+        write(&Count, sizeof(Count));
+        for (const auto &B : R.second.second) {
+            write(&std::get<0>(B), 4);
+            write(&std::get<1>(B), 4);
+            write(&std::get<2>(B), 1);
+        }
+    }
+
+    {
+        raw_fd_ostream OS(FD, true);
+        OS << Out;
+        if (OS.has_error()) {
+            OS.clear_error();
+            sys::fs::remove(TempPath);
+            return;
+        }
+    }
+    if (sys::fs::rename(TempPath, Path))
+        sys::fs::remove(TempPath);
+}
+
+bool RbvmTargetMachine::addPassesToEmitFile (
+        PassManagerBase &PM,
+        raw_pwrite_stream &out,
+#if ! LESSER_LLVM
+        raw_pwrite_stream *DwoOut,
+#endif
+        CodeGenFileType FileType,
+        bool DisableVerify,
+        MachineModuleInfo *MMI) {
+    
+    if (FileType != TargetMachine::CGFT_AssemblyFile)
+        return true;
+
+    if (ProfileGenerate || !ProfileUse.empty())
+        PM.add(new RbvmProfilePass());
+    if (getOptLevel() != CodeGenOpt::None)
+        addOptimizationPasses(PM, getOptLevel());
+    PM.add(createGCLoweringPass());
+    PM.add(createLowerInvokePass());
+    PM.add(createCFGSimplificationPass());
+    PM.add(new RbvmWriter(out));
+    return false;
+}
+
+
+static Commands GetMnemonics(unsigned opcode) {
+    switch (opcode) {
+    case Instruction::Add:      return Commands::CMD_IADD;
+    case Instruction::FAdd:     return Commands::CMD_FADD;
+    case Instruction::Sub:      return Commands::CMD_ISUB;
+    case Instruction::FSub:     return Commands::CMD_FSUB;
+    case Instruction::Mul:      return Commands::CMD_SMUL;
+    case Instruction::FMul:     return Commands::CMD_FMUL;
+    case Instruction::URem:     return Commands::CMD_UREM;
+    case Instruction::SRem:     return Commands::CMD_SREM;
+    case Instruction::FRem:     return Commands::CMD_FREM;
+    case Instruction::UDiv:     return Commands::CMD_UDIV;
+    case Instruction::SDiv:     return Commands::CMD_SDIV;
+    case Instruction::FDiv:     return Commands::CMD_FDIV;
+    case Instruction::And:      return Commands::CMD_AND;
+    case Instruction::Or:       return Commands::CMD_OR;
+    case Instruction::Xor:      return Commands::CMD_XOR;
+    case Instruction::Shl :     return Commands::CMD_SHL;
+    case Instruction::LShr:     return Commands::CMD_LSHR;
+    case Instruction::AShr:     return Commands::CMD_ASHR;
+    default:
+                            errs() << "Invalid operator type!" << opcode;
+                            llvm_unreachable(0);
+    }
+}
+
+// The i32 forms of the operations whose result depends on the bits above the
+// 32nd; the rest are exact on zero-extended operands.
+static Commands GetMnemonics32(unsigned opcode) {
+    switch (opcode) {
+    case Instruction::Add:      return Commands::CMD_IADD32;
+    case Instruction::Sub:      return Commands::CMD_ISUB32;
+    case Instruction::Mul:      return Commands::CMD_IMUL32;
+    case Instruction::SRem:     return Commands::CMD_SREM32;
+    case Instruction::SDiv:     return Commands::CMD_SDIV32;
+    case Instruction::Shl:      return Commands::CMD_SHL32;
+    case Instruction::AShr:     return Commands::CMD_ASHR32;
+    default:                    return GetMnemonics(opcode);
+    }
+}
+
+// Whether the 64-bit operation can set bits above a narrower operand width.
+static bool dirtiesHighBits(unsigned opcode) {
+    switch (opcode) {
+    case Instruction::Add:
+    case Instruction::Sub:
+    case Instruction::Mul:
+    case Instruction::Shl:
+    case Instruction::SDiv:
+    case Instruction::SRem:
+    case Instruction::AShr:
+        return true;
+    default:
+        return false;
+    }
+}
+
+
+static unsigned getVectorOp(unsigned opcode, bool BoolLanes) {
+    // i1 lanes are bytes holding 0 or 1: add and sub wrap like xor, mul is and
+    if (BoolLanes) {
+        switch (opcode) {
+        case Instruction::Add:
+        case Instruction::Sub: return VOP_XOR;
+        case Instruction::Mul: return VOP_AND;
+        }
+    }
+    switch (opcode) {
+    case Instruction::Add:  return VOP_ADD;
+    case Instruction::Sub:  return VOP_SUB;
+    case Instruction::Mul:  return VOP_MUL;
+    case Instruction::UDiv: return VOP_UDIV;
+    case Instruction::SDiv: return VOP_SDIV;
+    case Instruction::URem: return VOP_UREM;
+    case Instruction::SRem: return VOP_SREM;
+    case Instruction::And:  return VOP_AND;
+    case Instruction::Or:   return VOP_OR;
+    case Instruction::Xor:  return VOP_XOR;
+    case Instruction::Shl:  return VOP_SHL;
+    case Instruction::LShr: return VOP_LSHR;
+    case Instruction::AShr: return VOP_ASHR;
+    case Instruction::FAdd: return VOP_FADD;
+    case Instruction::FSub: return VOP_FSUB;
+    case Instruction::FMul: return VOP_FMUL;
+    case Instruction::FDiv: return VOP_FDIV;
+    default:
+        report_fatal_error("unsupported vector operation");
+    }
+}
+
+static unsigned getVectorPredicate(unsigned predicate) {
+    switch (predicate) {
+    case CmpInst::ICMP_EQ:  return VOP_EQ;
+    case CmpInst::ICMP_NE:  return VOP_NE;
+    case CmpInst::ICMP_ULT: return VOP_ULT;
+    case CmpInst::ICMP_ULE: return VOP_ULE;
+    case CmpInst::ICMP_UGT: return VOP_UGT;
+    case CmpInst::ICMP_UGE: return VOP_UGE;
+    case CmpInst::ICMP_SLT: return VOP_SLT;
+    case CmpInst::ICMP_SLE: return VOP_SLE;
+    case CmpInst::ICMP_SGT: return VOP_SGT;
+    case CmpInst::ICMP_SGE: return VOP_SGE;
+    case CmpInst::FCMP_OEQ: return VOP_FOEQ;
+    case CmpInst::FCMP_ONE: return VOP_FONE;
+    case CmpInst::FCMP_OLT: return VOP_FOLT;
+    case CmpInst::FCMP_OLE: return VOP_FOLE;
+    case CmpInst::FCMP_OGT: return VOP_FOGT;
+    case CmpInst::FCMP_OGE: return VOP_FOGE;
+    case CmpInst::FCMP_ORD: return VOP_FORD;
+    case CmpInst::FCMP_UNO: return VOP_FUNO;
+    case CmpInst::FCMP_UEQ: return VOP_FUEQ;
+    case CmpInst::FCMP_UNE: return VOP_FUNE;
+    case CmpInst::FCMP_ULT: return VOP_FULT;
+    case CmpInst::FCMP_ULE: return VOP_FULE;
+    case CmpInst::FCMP_UGT: return VOP_FUGT;
+    case CmpInst::FCMP_UGE: return VOP_FUGE;
+    default:
+        report_fatal_error("unsupported vector predicate");
+    }
+}
+
+void RbvmWriter::visitBinaryOperator(BinaryOperator &I) {
+    assert(!I.getType()->isPointerTy());
+    if (VectorType *VTy = dyn_cast<VectorType>(I.getType())) {
+        writeOperand(I.getOperand(0));
+        auto A = ResultReg;
+        writeOperand(I.getOperand(1));
+        auto B = ResultReg;
+
+        produce1(Commands::CMD_VBIN);
+        produce1(getVectorOp(I.getOpcode(), isBoolVector(VTy)));
+        produce1(vectorLaneType(VTy->getElementType()));
+        produce1(VTy->getNumElements());
+        ResultReg = allocRegs(VTy);
+        produce1(ResultReg);
+        produce1(A);
+        produce1(B);
+        return;
+    }
+    const unsigned Opcode = I.getOpcode();
+    const unsigned Bits = integerBits(I.getType());
+    // i32 has its own opcodes; other narrow widths go through the 64-bit
+    // ones, sign-extending the operands of signed operations first
+    const bool Narrow = Bits < 64 && Bits != 32;
+    const bool Signed = Opcode == Instruction::SDiv || Opcode == Instruction::SRem ||
+                        Opcode == Instruction::AShr;
+
+    writeOperand(I.getOperand(0));
+    unsigned A = ResultReg;
+    if (Narrow && Signed) {
+        A = ++NextReg;
+        produceSExt(Bits, A, ResultReg);
+    }
+    ValOperand B = writeValOperand(I.getOperand(1),
+                                   Narrow && Signed && Opcode != Instruction::AShr ? Bits : 0);
+
+    auto new_reg = resultRegister();
+    produceAmbig3(Bits == 32 ? GetMnemonics32(Opcode) : GetMnemonics(Opcode), new_reg, A, B);
+    if (Narrow && dirtiesHighBits(Opcode))
+        produceZExt(Bits, new_reg, new_reg);
+    ResultReg = new_reg;
 }
 
 
@@ -421,111 +1875,635 @@ static Commands getPredicate(unsigned opcode) {
     }
 }
 
+static Commands getPredicate32(unsigned opcode) {
+    switch (opcode) {
+    case ICmpInst::ICMP_SLE: return Commands::CMD_SLE32;
+    case ICmpInst::ICMP_SGE: return Commands::CMD_SGE32;
+    case ICmpInst::ICMP_SLT: return Commands::CMD_SLT32;
+    case ICmpInst::ICMP_SGT: return Commands::CMD_SGT32;
+    default:                 return getPredicate(opcode);
+    }
+}
+
 
 void RbvmWriter::visitICmpInst(ICmpInst &I) {
-    writeOperand(I.getOperand(0));
-    auto new_reg = ++NextReg;
-    produceAmbigRR(Commands::CMD_MOV, new_reg, ResultReg);
+    if (VectorType *VTy = dyn_cast<VectorType>(I.getOperand(0)->getType())) {
+        writeOperand(I.getOperand(0));
+        auto A = ResultReg;
+        writeOperand(I.getOperand(1));
+        auto B = ResultReg;
+
+        produce1(Commands::CMD_VCMP);
+        produce1(getVectorPredicate(I.getPredicate()));
+        produce1(vectorLaneType(VTy->getElementType()));
+        produce1(VTy->getNumElements());
+        ResultReg = allocRegs(I.getType());
+        produce1(ResultReg);
+        produce1(A);
+        produce1(B);
+        return;
+    }
+    // equality and unsigned order hold on zero-extended values as they are
+    const unsigned Bits = integerBits(I.getOperand(0)->getType());
+    const bool Narrow = I.isSigned() && Bits < 64 && Bits != 32;
 
-    writeOperand(I.getOperand(1));
+    writeOperand(I.getOperand(0));
+    unsigned A = ResultReg;
+    if (Narrow) {
+        A = ++NextReg;
+        produceSExt(Bits, A, ResultReg);
+    }
+    ValOperand B = writeValOperand(I.getOperand(1), Narrow ? Bits : 0);
 
-    produceAmbigRR(getPredicate(I.getPredicate()), new_reg, ResultReg);
+    auto new_reg = resultRegister();
+    produceAmbig3(Bits == 32 ? getPredicate32(I.getPredicate()) : getPredicate(I.getPredicate()),
+                  new_reg, A, B);
     ResultReg = new_reg;
 }
 
+// The VM's float comparisons are the ordered ones (false if an operand is
+// NaN), except fne which is unordered.  The other unordered predicates are
+// the negation of an ordered one.
+static Commands getFPredicate(unsigned predicate, bool &Negate) {
+    Negate = false;
+    switch (predicate) {
+    case FCmpInst::FCMP_OEQ: return Commands::CMD_FEQ;
+    case FCmpInst::FCMP_UNE: return Commands::CMD_FNE;
+    case FCmpInst::FCMP_OLT: return Commands::CMD_FLT;
+    case FCmpInst::FCMP_OLE: return Commands::CMD_FLE;
+    case FCmpInst::FCMP_OGT: return Commands::CMD_FGT;
+    case FCmpInst::FCMP_OGE: return Commands::CMD_FGE;
+    case FCmpInst::FCMP_UGE: Negate = true; return Commands::CMD_FLT;
+    case FCmpInst::FCMP_UGT: Negate = true; return Commands::CMD_FLE;
+    case FCmpInst::FCMP_ULE: Negate = true; return Commands::CMD_FGT;
+    case FCmpInst::FCMP_ULT: Negate = true; return Commands::CMD_FGE;
+    default:
+                errs() << "Invalid fcmp predicate!" << predicate;
+                llvm_unreachable(0);
+    }
+}
 
-void RbvmWriter::visitFCmpInst(FCmpInst &I) {
-    writeOperand(I.getOperand(0));
-    auto new_reg = ++NextReg;
-    produceAmbigRR(Commands::CMD_MOV, new_reg, ResultReg);
 
-    writeOperand(I.getOperand(1));
+void RbvmWriter::visitFCmpInst(FCmpInst &I) {
+    if (VectorType *VTy = dyn_cast<VectorType>(I.getOperand(0)->getType())) {
+        writeOperand(I.getOperand(0));
+        auto A = ResultReg;
+        writeOperand(I.getOperand(1));
+        auto B = ResultReg;
+
+        produce1(Commands::CMD_VCMP);
+        produce1(getVectorPredicate(I.getPredicate()));
+        produce1(vectorLaneType(VTy->getElementType()));
+        produce1(VTy->getNumElements());
+        ResultReg = allocRegs(I.getType());
+        produce1(ResultReg);
+        produce1(A);
+        produce1(B);
+        return;
+    }
+    const unsigned Pred = I.getPredicate();
+    if (Pred == FCmpInst::FCMP_FALSE || Pred == FCmpInst::FCMP_TRUE) {
+        ResultReg = resultRegister();
+        produceAmbigRC(Commands::CMD_MOV, ResultReg, Pred == FCmpInst::FCMP_TRUE);
+        return;
+    }
 
-    produceAmbigRR(getPredicate(I.getPredicate()), new_reg, ResultReg);
+    writeOperand(I.getOperand(0));
+    unsigned A = ResultReg;
+    ValOperand B = writeValOperand(I.getOperand(1));
+
+    // the two-step forms write new_reg before reading B again
+    bool Negate;
+    unsigned new_reg;
+    switch (Pred) {
+    case FCmpInst::FCMP_ORD:
+    case FCmpInst::FCMP_UNO: {
+        new_reg = ++NextReg;
+        // neither operand is NaN
+        produceAmbig3(Commands::CMD_FEQ, new_reg, A, {false, A});
+        if (!B.IsConst) {
+            auto tmp_reg = ++NextReg;
+            produceAmbig3(Commands::CMD_FEQ, tmp_reg, B.Value, B);
+            produceAmbigRR(Commands::CMD_AND, new_reg, tmp_reg);
+        } else if (cast<ConstantFP>(I.getOperand(1))->isNaN())
+            produceAmbigRC(Commands::CMD_MOV, new_reg, 0);
+        Negate = Pred == FCmpInst::FCMP_UNO;
+        break;
+    }
+    case FCmpInst::FCMP_ONE:
+    case FCmpInst::FCMP_UEQ: {
+        new_reg = ++NextReg;
+        auto tmp_reg = ++NextReg;
+        produceAmbig3(Commands::CMD_FLT, new_reg, A, B);
+        produceAmbig3(Commands::CMD_FGT, tmp_reg, A, B);
+        produceAmbigRR(Commands::CMD_OR, new_reg, tmp_reg);
+        Negate = Pred == FCmpInst::FCMP_UEQ;
+        break;
+    }
+    default:
+        new_reg = resultRegister();
+        produceAmbig3(getFPredicate(Pred, Negate), new_reg, A, B);
+    }
+    if (Negate)
+        produceAmbigRC(Commands::CMD_XOR, new_reg, 1);
     ResultReg = new_reg;
 }
 
 
 void RbvmWriter::printPHICopiesForSuccessor(BasicBlock *CurBlock, BasicBlock *Successor, unsigned Indent) {
+    // The copies between registers happen at once: one PHI may take the
+    // value another is about to overwrite, as in a swap.
+    std::vector<std::pair<unsigned, unsigned> > Moves;
+    std::vector<std::pair<unsigned, unsigned> > Spills;
+    std::vector<PHINode*> Materialized;
     for (auto I = Successor->begin(); isa<PHINode>(I); ++I) {
         PHINode *PN = cast<PHINode>(I);
         Value *IV = PN->getIncomingValueForBlock(CurBlock);
-        if (!isa<UndefValue>(IV) && !isEmptyType(IV->getType())) {
-            writeOperand(IV);
-            if (isa<GlobalValue>(&*I))
-                modifyGlobal(Mangle(I->getName()), ResultReg);
-            else
-                produceAmbigRR(Commands::CMD_MOV, Locals[&*I], ResultReg);
+        if (isa<UndefValue>(IV) || isEmptyType(IV->getType()))
+            continue;
+        // constants, globals and the addresses of direct allocas are
+        // materialized after the moves
+        if (isa<Constant>(IV) || isDirectAlloca(IV)) {
+            Materialized.push_back(PN);
+            continue;
         }
+        if (isSameHome(PN, IV))
+            continue;
+        // spilled sources are reloaded before any slot is written
+        writeOperand(IV);
+        auto Slot = SpillSlots.find(PN);
+        if (Slot != SpillSlots.end())
+            Spills.push_back({Slot->second, ResultReg});
+        else
+            for (unsigned k = 0, n = regsFor(IV->getType()); k < n; ++k)
+                Moves.push_back({Locals.lookup(PN) + k, ResultReg + k});
     }
+
+    // stores to slots read their registers before the moves overwrite them
+    for (const auto &S : Spills)
+        produceSpill(S.first, S.second);
+
+    while (!Moves.empty()) {
+        // a move whose destination no other move still reads
+        auto Ready = std::find_if(Moves.begin(), Moves.end(), [&](const std::pair<unsigned, unsigned> &M) {
+            return std::none_of(Moves.begin(), Moves.end(), [&](const std::pair<unsigned, unsigned> &O) {
+                return O.second == M.first;
+            });
+        });
+        if (Ready == Moves.end()) {
+            // only cycles are left: save one source and break its cycle
+            const unsigned Saved = Moves.front().second, Tmp = ++NextReg;
+            produceAmbigRR(Commands::CMD_MOV, Tmp, Saved);
+            for (auto &M : Moves)
+                if (M.second == Saved)
+                    M.second = Tmp;
+            continue;
+        }
+        produceAmbigRR(Commands::CMD_MOV, Ready->first, Ready->second);
+        Moves.erase(Ready);
+    }
+
+    for (PHINode *PN : Materialized) {
+        Value *IV = PN->getIncomingValueForBlock(CurBlock);
+        auto Slot = SpillSlots.find(PN);
+        if (Slot != SpillSlots.end()) {
+            writeOperand(IV);
+            produceSpill(Slot->second, ResultReg);
+        } else if (IV->getType()->isVectorTy()) {
+            writeOperand(IV);
+            produceMove(IV->getType(), Locals.lookup(PN), ResultReg);
+        } else
+            produceAmbig(Commands::CMD_MOV, Locals.lookup(PN), writeValOperand(IV));
+    }
+}
+
+bool RbvmWriter::hasPHICopies(BasicBlock *CurBlock, BasicBlock *Successor) {
+    for (auto I = Successor->begin(); isa<PHINode>(I); ++I) {
+        Value *IV = cast<PHINode>(I)->getIncomingValueForBlock(CurBlock);
+        if (isa<UndefValue>(IV) || isEmptyType(IV->getType()))
+            continue;
+        if (isa<Constant>(IV) || isDirectAlloca(IV) || !isSameHome(&*I, IV))
+            return true;
+    }
+    return false;
 }
 
 void RbvmWriter::printBranchToBlock(BasicBlock *CurBB, BasicBlock *Succ, unsigned Indent) {
     postponeJmp(Succ);
 }
 
+static Commands getBranchPredicate(unsigned predicate, bool Is32) {
+    switch (predicate) {
+    case ICmpInst::ICMP_EQ:  return Commands::CMD_BEQ;
+    case ICmpInst::ICMP_NE:  return Commands::CMD_BNE;
+    case ICmpInst::ICMP_ULE: return Commands::CMD_BULE;
+    case ICmpInst::ICMP_SLE: return Is32 ? Commands::CMD_BSLE32 : Commands::CMD_BSLE;
+    case ICmpInst::ICMP_UGE: return Commands::CMD_BUGE;
+    case ICmpInst::ICMP_SGE: return Is32 ? Commands::CMD_BSGE32 : Commands::CMD_BSGE;
+    case ICmpInst::ICMP_ULT: return Commands::CMD_BULT;
+    case ICmpInst::ICMP_SLT: return Is32 ? Commands::CMD_BSLT32 : Commands::CMD_BSLT;
+    case ICmpInst::ICMP_UGT: return Commands::CMD_BUGT;
+    case ICmpInst::ICMP_SGT: return Is32 ? Commands::CMD_BSGT32 : Commands::CMD_BSGT;
+    default:
+                errs() << "Invalid icmp predicate!" << predicate;
+                llvm_unreachable(0);
+    }
+}
+
+// Emits b<cc> on the operands of Cmp (on its inverse if Negate) with the
+// target left to fixupLocalBranch or postponeBranch.
+RbvmWriter::HandleBR RbvmWriter::writeCompareAndBranch(ICmpInst *Cmp, bool Negate) {
+    Value *A = Cmp->getOperand(0), *B = Cmp->getOperand(1);
+    CmpInst::Predicate Pred = Negate ? Cmp->getInversePredicate() : Cmp->getPredicate();
+    if (isa<ConstantInt>(A) && !isa<ConstantInt>(B)) {
+        std::swap(A, B);
+        Pred = CmpInst::getSwappedPredicate(Pred);
+    }
+    const unsigned Bits = integerBits(A->getType());
+    const bool Narrow = CmpInst::isSigned(Pred) && Bits < 64 && Bits != 32;
+    const Commands Cmd = getBranchPredicate(Pred, Bits == 32);
+
+    writeOperand(A);
+    unsigned RA = ResultReg;
+    if (Narrow) {
+        RA = ++NextReg;
+        produceSExt(Bits, RA, ResultReg);
+    }
+    ValOperand RB = writeValOperand(B, Narrow ? Bits : 0);
+
+    const HandleBR h = markPosition();
+    produceAmbig(Cmd, RA, RB);
+    produce8(0);
+    return h;
+}
+
 void RbvmWriter::visitBranchInst(BranchInst &I) {
     if (I.isConditional()) {
-        writeOperand(I.getCondition());
-        HandleJZ jz = localJZ(ResultReg);
-
-        printPHICopiesForSuccessor(I.getParent(), I.getSuccessor(0), 4);
-        printBranchToBlock(I.getParent(), I.getSuccessor(0), 4);
-        HandleJMP jmp = localJMP();
-        fixupLocalJZ(jz);
-        printPHICopiesForSuccessor(I.getParent(), I.getSuccessor(1), 4);
-        printBranchToBlock(I.getParent(), I.getSuccessor(1), 4);
-        fixupLocalJMP(jmp);
+        BasicBlock *BB = I.getParent();
+        BasicBlock *Succ[2] = {I.getSuccessor(0), I.getSuccessor(1)};
+        ICmpInst *Cmp = getFusedCompare(&I);
+
+        // Jump straight to a successor that needs no PHI copies, preferring
+        // the one not laid out next, so that the other is reached by falling
+        // through; otherwise skip over the copies and jump of one edge, ending
+        // with the edge to the next block.
+        int Direct = !hasPHICopies(BB, Succ[0]) ? 0 : !hasPHICopies(BB, Succ[1]) ? 1 : -1;
+        if (Direct == 0 && Succ[0] == NextBlock && !hasPHICopies(BB, Succ[1]))
+            Direct = 1;
+        const unsigned Taken = Direct >= 0 ? Direct : Succ[1] == NextBlock ? 1 : 0;
+        const bool JumpIfTrue = Taken == 0;
+        HandleBR h;
+        if (Cmp)
+            h = writeCompareAndBranch(Cmp, !JumpIfTrue);
+        else {
+            writeOperand(I.getCondition());
+            h = JumpIfTrue ? localJNZ(ResultReg) : localJZ(ResultReg);
+        }
+        recordProfBranch(I, h, Taken);
+
+        if (Direct >= 0) {
+            postponeBranch(Succ[Direct], h);
+            printPHICopiesForSuccessor(BB, Succ[1 - Direct], 4);
+            if (Succ[1 - Direct] != NextBlock)
+                printBranchToBlock(BB, Succ[1 - Direct], 4);
+            return;
+        }
+        printPHICopiesForSuccessor(BB, Succ[1 - Taken], 4);
+        printBranchToBlock(BB, Succ[1 - Taken], 4);
+        fixupLocalBranch(h);
+        printPHICopiesForSuccessor(BB, Succ[Taken], 4);
+        if (Succ[Taken] != NextBlock)
+            printBranchToBlock(BB, Succ[Taken], 4);
     } else {
         printPHICopiesForSuccessor(I.getParent(), I.getSuccessor(0), 0);
-        printBranchToBlock(I.getParent(), I.getSuccessor(0), 0);
+        if (I.getSuccessor(0) != NextBlock)
+            printBranchToBlock(I.getParent(), I.getSuccessor(0), 0);
     }
 }
 
 
-void RbvmWriter::visitSwitchInst(SwitchInst &SI) {
-    Value* Cond = SI.getCondition();
-
-    if (SI.getNumCases() == 0) {
-        printPHICopiesForSuccessor(SI.getParent(), SI.getDefaultDest(), 4);
-        printBranchToBlock(SI.getParent(), SI.getDefaultDest(), 4);
-    } else {
-        for (auto i = SI.case_begin(), e = SI.case_end(); i != e; ++i) {
-            ConstantInt* CaseVal = i->getCaseValue();
-            BasicBlock* Succ = i->getCaseSuccessor();
+// Switch lowering.  Cases are sorted by their value as the zero-extended
+// register holds it and split into clusters, each tested at once:
+//
+//  - a jtab for a run of at least MinJumpTableCases cases that fill at least
+//    JumpTableDensity percent of their range,
+//  - a bit test for a run within 64 values going to n <= 3 blocks, once it
+//    has BitTestMinCases[n] cases,
+//  - otherwise a single value or a range of consecutive values.
+//
+// The clusters are searched by a balanced tree of bult down to at most
+// MaxLinearClusters, tested one after another; a value that none takes ends
+// up at a jump to the default block.
+static const unsigned MinJumpTableCases = 4;
+static const unsigned JumpTableDensity = 10;
+static const uint64_t MaxJumpTableSize = 4096;
+static const unsigned BitTestMinCases[] = {0, 3, 5, 6};
+static const unsigned MaxLinearClusters = 3;
+
+static std::vector<SwitchCluster> clusterSwitchCases(SwitchInst &SI) {
+    std::vector<std::pair<uint64_t, BasicBlock *> > Cases;
+    for (auto i = SI.case_begin(), e = SI.case_end(); i != e; ++i)
+        Cases.push_back({i->getCaseValue()->getZExtValue(), i->getCaseSuccessor()});
+    std::sort(Cases.begin(), Cases.end(),
+              [](const std::pair<uint64_t, BasicBlock *> &A, const std::pair<uint64_t, BasicBlock *> &B) {
+                  return A.first < B.first;
+              });
+
+    std::vector<SwitchCluster> Clusters;
+    for (size_t i = 0, n = Cases.size(); i < n; ) {
+        SwitchCluster C;
+        C.Low = Cases[i].first;
+
+        // consecutive values going to one block are a range, which a table or
+        // a bit test is only worth it for if it takes more cases than that
+        size_t RangeLast = i;
+        while (RangeLast + 1 < n && Cases[RangeLast + 1].first == Cases[RangeLast].first + 1 &&
+               Cases[RangeLast + 1].second == Cases[i].second)
+            ++RangeLast;
+
+        // the longest run dense enough for a table
+        size_t Last = i;
+        for (size_t j = i + MinJumpTableCases - 1; j < n; ++j) {
+            const uint64_t Range = Cases[j].first - C.Low + 1;
+            if (Range > MaxJumpTableSize)
+                break;
+            if ((j - i + 1) * 100 >= Range * JumpTableDensity)
+                Last = j;
+        }
+        if (Last > RangeLast) {
+            C.Kind = SwitchCluster::Table;
+            C.High = Cases[Last].first;
+            C.Targets.assign(C.High - C.Low + 1, nullptr);
+            for (size_t j = i; j <= Last; ++j)
+                C.Targets[Cases[j].first - C.Low] = Cases[j].second;
+            Clusters.push_back(C);
+            i = Last + 1;
+            continue;
+        }
 
-            ICmpInst *icmp = new ICmpInst(CmpInst::ICMP_EQ, Cond, CaseVal);
-            visitICmpInst(*icmp);
-            delete icmp;
+        // the longest run a 64-bit mask covers, with at most three blocks
+        std::vector<BasicBlock *> Dests;
+        Last = i;
+        for (size_t j = i; j < n && Cases[j].first - C.Low < 64; ++j) {
+            if (std::find(Dests.begin(), Dests.end(), Cases[j].second) == Dests.end()) {
+                if (Dests.size() == 3)
+                    break;
+                Dests.push_back(Cases[j].second);
+            }
+            if (j - i + 1 >= BitTestMinCases[Dests.size()])
+                Last = j;
+        }
+        if (Last > RangeLast) {
+            C.Kind = SwitchCluster::BitTest;
+            C.High = Cases[Last].first;
+            for (size_t j = i; j <= Last; ++j) {
+                auto It = std::find_if(C.Masks.begin(), C.Masks.end(),
+                                       [&](const std::pair<BasicBlock *, uint64_t> &M) {
+                                           return M.first == Cases[j].second;
+                                       });
+                if (It == C.Masks.end())
+                    It = C.Masks.insert(C.Masks.end(), {Cases[j].second, 0});
+                It->second |= uint64_t(1) << (Cases[j].first - C.Low);
+            }
+            Clusters.push_back(C);
+            i = Last + 1;
+            continue;
+        }
 
-            HandleJZ jz = localJZ(ResultReg);
+        C.Kind = SwitchCluster::Range;
+        C.Dest = Cases[i].second;
+        C.High = Cases[RangeLast].first;
+        Clusters.push_back(C);
+        i = RangeLast + 1;
+    }
+    return Clusters;
+}
 
-            printPHICopiesForSuccessor(SI.getParent(), Succ, 4);
-            printBranchToBlock(SI.getParent(), Succ, 4);
+// Jumps to a successor with PHI copies go to a copy of them emitted after the
+// whole switch, one per successor.
+void RbvmWriter::jumpToSwitchTarget(BasicBlock *Succ, size_t Instr, size_t Field) {
+    if (!hasPHICopies(SwitchBlock, Succ)) {
+        PostponedTableJumps.push_back(std::make_tuple(Succ, Instr, Field));
+        return;
+    }
+    auto It = std::find_if(SwitchPads.begin(), SwitchPads.end(),
+                           [&](const std::pair<BasicBlock *, std::vector<std::pair<size_t, size_t> > > &P) {
+                               return P.first == Succ;
+                           });
+    if (It == SwitchPads.end())
+        It = SwitchPads.insert(SwitchPads.end(), {Succ, {}});
+    It->second.push_back({Instr, Field});
+}
 
-            fixupLocalJZ(jz);
+// Jumps to the cluster's blocks if Cond, known to be within Low..High, is
+// one of its values, and falls through otherwise.
+void RbvmWriter::writeSwitchCluster(const SwitchCluster &C, unsigned Cond, uint64_t Low, uint64_t High) {
+    switch (C.Kind) {
+    case SwitchCluster::Range: {
+        HandleBR h;
+        if (C.Low <= Low && C.High >= High)
+            h = localJMP();
+        else if (C.Low == C.High)
+            h = produceBranchRC(Commands::CMD_BEQ, Cond, C.Low);
+        else if (C.Low <= Low)
+            h = produceBranchRC(Commands::CMD_BULE, Cond, C.High);
+        else if (C.High >= High)
+            h = produceBranchRC(Commands::CMD_BUGE, Cond, C.Low);
+        else {
+            auto Index = ++NextReg;
+            produceAmbig3(Commands::CMD_ISUB, Index, Cond, {true, C.Low});
+            h = produceBranchRC(Commands::CMD_BULE, Index, C.High - C.Low);
+        }
+        jumpToSwitchTarget(C.Dest, h, jumpOffsetField(h));
+        break;
+    }
+    case SwitchCluster::Table: {
+        const size_t h = markPosition();
+        produce1(Commands::CMD_JTAB);
+        produce1(Cond);
+        produce8(C.Low);
+        produce4(C.Targets.size());
+        for (BasicBlock *Succ : C.Targets) {
+            jumpToSwitchTarget(Succ ? Succ : SwitchDefault, h, markPosition());
+            produce8(0);
+        }
+        break;
+    }
+    case SwitchCluster::BitTest: {
+        auto Index = Cond;
+        if (C.Low) {
+            Index = ++NextReg;
+            produceAmbig3(Commands::CMD_ISUB, Index, Cond, {true, C.Low});
         }
-        printPHICopiesForSuccessor(SI.getParent(), SI.getDefaultDest(), 4);
-        printBranchToBlock(SI.getParent(), SI.getDefaultDest(), 4);
+        const bool Bounded = C.Low <= Low && C.High >= High;
+        HandleBR Skip = 0;
+        if (!Bounded)
+            Skip = produceBranchRC(Commands::CMD_BUGT, Index, C.High - C.Low);
+        auto Bit = ++NextReg;
+        produceAmbigRC(Commands::CMD_MOV, Bit, 1);
+        produceAmbigRR(Commands::CMD_SHL, Bit, Index);
+        for (const auto &M : C.Masks) {
+            auto Test = ++NextReg;
+            produceAmbig3(Commands::CMD_AND, Test, Bit, {true, M.second});
+            const HandleJZ h = localJNZ(Test);
+            jumpToSwitchTarget(M.first, h, jumpOffsetField(h));
+        }
+        if (!Bounded)
+            fixupLocalBranch(Skip);
+        break;
+    }
     }
 }
 
-bool RbvmWriter::printConstantString(Constant *C, unsigned new_reg) {
-    ConstantDataSequential *CDS = dyn_cast<ConstantDataSequential>(C);
-    if (!CDS || !CDS->isCString())
-        return false;
+void RbvmWriter::writeSwitchTree(const SwitchCluster *First, const SwitchCluster *Last, unsigned Cond,
+                                 uint64_t Low, uint64_t High) {
+    if (Last - First <= (ptrdiff_t) MaxLinearClusters) {
+        for (const SwitchCluster *C = First; C != Last; ++C)
+            writeSwitchCluster(*C, Cond, Low, High);
+        const HandleJMP h = localJMP();
+        jumpToSwitchTarget(SwitchDefault, h, jumpOffsetField(h));
+        return;
+    }
+    const SwitchCluster *Mid = First + (Last - First) / 2;
+    const HandleBR h = produceBranchRC(Commands::CMD_BULT, Cond, Mid->Low);
+    writeSwitchTree(Mid, Last, Cond, Mid->Low, High);
+    fixupLocalBranch(h);
+    writeSwitchTree(First, Mid, Cond, Low, Mid->Low - 1);
+}
 
-    produce1(Commands::CMD_CSS);
-    produceString(CDS->getAsString());
-    produce1(new_reg);
+void RbvmWriter::visitSwitchInst(SwitchInst &SI) {
+    BasicBlock *BB = SI.getParent();
+    if (SI.getNumCases() == 0) {
+        printPHICopiesForSuccessor(BB, SI.getDefaultDest(), 4);
+        if (SI.getDefaultDest() != NextBlock)
+            printBranchToBlock(BB, SI.getDefaultDest(), 4);
+        return;
+    }
+
+    writeOperand(SI.getCondition());
+    const unsigned Cond = ResultReg;
+    const unsigned Bits = integerBits(SI.getCondition()->getType());
+    const std::vector<SwitchCluster> Clusters = clusterSwitchCases(SI);
+
+    SwitchBlock = BB;
+    SwitchDefault = SI.getDefaultDest();
+    writeSwitchTree(Clusters.data(), Clusters.data() + Clusters.size(), Cond,
+                    0, Bits < 64 ? (uint64_t(1) << Bits) - 1 : ~uint64_t(0));
+
+    for (const auto &Pad : SwitchPads) {
+        const size_t Here = markPosition();
+        for (const auto &J : Pad.second)
+            fixup8(J.second, Here - J.first);
+        printPHICopiesForSuccessor(BB, Pad.first, 4);
+        if (Pad.first != NextBlock || &Pad != &SwitchPads.back())
+            printBranchToBlock(BB, Pad.first, 4);
+    }
+    SwitchPads.clear();
+    SwitchBlock = SwitchDefault = nullptr;
+}
 
+// Lane K of the vector constant C as the bits a register holds it in; false
+// for an undef lane, which reads as zero.  The lanes are read in place:
+// getAggregateElement() creates a constant for the lanes of a
+// ConstantDataVector or a zeroinitializer, which the threads of
+// generateFunctions() must not do.
+static bool getConstantLane(const Constant *C, unsigned K, uint64_t &V) {
+    V = 0;
+    if (isa<UndefValue>(C))
+        return false;
+    if (isa<ConstantAggregateZero>(C))
+        return true;
+    if (const ConstantDataSequential *CDS = dyn_cast<ConstantDataSequential>(C)) {
+        if (CDS->getElementType()->isFloatingPointTy())
+            V = CDS->getElementAsAPFloat(K).bitcastToAPInt().getZExtValue();
+        else
+            V = CDS->getElementAsInteger(K);
+        return true;
+    }
+    const ConstantVector *CV = dyn_cast<ConstantVector>(C);
+    if (!CV)
+        report_fatal_error("unsupported vector constant");
+    const Constant *Elt = CV->getOperand(K);
+    if (isa<UndefValue>(Elt))
+        return false;
+    if (const ConstantInt *CI = dyn_cast<ConstantInt>(Elt))
+        V = CI->getZExtValue();
+    else if (const ConstantFP *FPC = dyn_cast<ConstantFP>(Elt))
+        V = FPC->getValueAPF().bitcastToAPInt().getZExtValue();
+    else if (!Elt->isNullValue())
+        report_fatal_error("unsupported vector constant");
     return true;
 }
 
+void RbvmWriter::printConstantVector(Constant *CPV) {
+    VectorType *VTy = cast<VectorType>(CPV->getType());
+    const unsigned LaneBytes = vectorLaneBytes(VTy->getElementType());
+    unsigned char Bytes[32] = {};
+
+    for (unsigned k = 0, n = VTy->getNumElements(); k < n; ++k) {
+        uint64_t V;
+        getConstantLane(CPV, k, V);
+        memcpy(Bytes + k * LaneBytes, &V, LaneBytes);
+    }
+
+    ResultReg = allocRegs(VTy);
+    for (unsigned k = 0, n = regsFor(VTy); k < n; ++k) {
+        uint64_t V;
+        memcpy(&V, Bytes + 8 * k, 8);
+        produceAmbigRC(Commands::CMD_MOV, ResultReg + k, V);
+    }
+}
+
+// Scalar floats of every type are held as doubles.
+static double constantFPToDouble(ConstantFP *FPC) {
+    if (FPC->getType()->isFloatTy())
+        return FPC->getValueAPF().convertToFloat();
+    if (FPC->getType()->isDoubleTy())
+        return FPC->getValueAPF().convertToDouble();
+    APFloat Tmp = FPC->getValueAPF();
+    bool LosesInfo;
+    Tmp.convert(APFloat::IEEEdouble(), APFloat::rmTowardZero, &LosesInfo);
+    return Tmp.convertToDouble();
+}
+
+// Constants that fit in 64 bits become immediates; anything else is written
+// to a register.  SExtBits > 0 sign-extends an integer of that width first.
+RbvmWriter::ValOperand RbvmWriter::writeValOperand(Value *V, unsigned SExtBits) {
+    if (ConstantInt *CI = dyn_cast<ConstantInt>(V)) {
+        if (CI->getBitWidth() <= 64)
+            return {true, SExtBits ? uint64_t(CI->getSExtValue()) : CI->getZExtValue()};
+    } else if (ConstantFP *FPC = dyn_cast<ConstantFP>(V)) {
+        const double D = constantFPToDouble(FPC);
+        uint64_t Bits;
+        memcpy(&Bits, &D, sizeof(Bits));
+        return {true, Bits};
+    }
+
+    writeOperand(V);
+    if (SExtBits) {
+        auto tmp_reg = ++NextReg;
+        produceSExt(SExtBits, tmp_reg, ResultReg);
+        ResultReg = tmp_reg;
+    }
+    return {false, ResultReg};
+}
 
 void RbvmWriter::printConstant(Constant *CPV) {
+    if (CPV->getType()->isVectorTy()) {
+        printConstantVector(CPV);
+        return;
+    }
+
     auto new_reg = ++NextReg;
 
+    // casts of and offsets into globals in the data segment fold to one address
+    uint64_t Addr;
+    if (isa<ConstantExpr>(CPV) && getDataAddress(CPV, Addr)) {
+        produceAmbigRC(Commands::CMD_MOV, new_reg, Addr);
+        ResultReg = new_reg;
+        return;
+    }
+
     if (ConstantExpr *CE = dyn_cast<ConstantExpr>(CPV)) {
         assert(CE->getType()->isIntegerTy() || CE->getType()->isFloatingPointTy() || CE->getType()->isPointerTy());
         switch (CE->getOpcode()) {
@@ -559,7 +2537,7 @@ void RbvmWriter::printConstant(Constant *CPV) {
                 break;
 
             case Instruction::GetElementPtr:
-                writeGEPExpression(CE->getOperand(0), gep_type_begin(CPV), gep_type_end(CPV));
+                writeGEPExpression(CE->getOperand(0), gep_type_begin(CPV), gep_type_end(CPV), false);
                 produceAmbigRR(Commands::CMD_MOV, new_reg, ResultReg);
                 break;
             case Instruction::Select: {
@@ -616,19 +2594,11 @@ void RbvmWriter::printConstant(Constant *CPV) {
                     llvm_unreachable(0);
         }
     } else if (isa<UndefValue>(CPV) && CPV->getType()->isSingleValueType()) {
-        Constant *Zero = Constant::getNullValue(CPV->getType());
-        printConstant(Zero);
-        produceAmbigRR(Commands::CMD_MOV, new_reg, ResultReg);
+        // zero, 0.0 and null alike; no constant is created, which the
+        // threads of generateFunctions() must not do
+        produceAmbigRC(Commands::CMD_MOV, new_reg, 0);
     } else if (ConstantInt *CI = dyn_cast<ConstantInt>(CPV)) {
-        Type* Ty = CI->getType();
-        if (Ty == Type::getInt1Ty(CPV->getContext()))
-            produceAmbigRC(Commands::CMD_MOV, new_reg, !!CI->getZExtValue());
-        else {
-            const int64_t val = CI->getSExtValue();
-            produceAmbigRC(Commands::CMD_MOV, new_reg, val);
-            ResultReg = new_reg;
-            writeCastTo(Ty);
-        }
+        produceAmbigRC(Commands::CMD_MOV, new_reg, CI->getZExtValue());
     } else 
         switch (CPV->getType()->getTypeID()) {
             case Type::FloatTyID:
@@ -636,30 +2606,14 @@ void RbvmWriter::printConstant(Constant *CPV) {
             case Type::X86_FP80TyID:
             case Type::PPC_FP128TyID:
             case Type::FP128TyID: {
-                ConstantFP *FPC = cast<ConstantFP>(CPV);
-                double V;
-                if (FPC->getType() == Type::getFloatTy(CPV->getContext()))
-                    V = FPC->getValueAPF().convertToFloat();
-                else if (FPC->getType() == Type::getDoubleTy(CPV->getContext()))
-                    V = FPC->getValueAPF().convertToDouble();
-                else {
-                    APFloat Tmp = FPC->getValueAPF();
-                    bool LosesInfo;
-                    Tmp.convert(APFloat::IEEEdouble(), APFloat::rmTowardZero, &LosesInfo);
-                    V = Tmp.convertToDouble();
-                }
-
-                produceAmbigRC_D(Commands::CMD_MOV, new_reg, V);
+                produceAmbigRC_D(Commands::CMD_MOV, new_reg, constantFPToDouble(cast<ConstantFP>(CPV)));
                 break;
             }
-            case Type::ArrayTyID: {                                                                             // TODO
-                if (printConstantString(CPV, new_reg))
-                    break;
+            // aggregates are handled by address
+            case Type::ArrayTyID:
+            case Type::StructTyID:
+                produceAmbigRC(Commands::CMD_MOV, new_reg, getConstantAddress(CPV));
                 break;
-            }
-
-            case Type::StructTyID: {}                                                                           // TODO
-            break;
 
             case Type::PointerTyID:
                 if (isa<ConstantPointerNull>(CPV)) {
@@ -682,66 +2636,405 @@ void RbvmWriter::printConstant(Constant *CPV) {
 void RbvmWriter::visitCastInst(CastInst &I) {
     Type *DstTy = I.getType();
 
-    writeOperand(I.getOperand(0));
+    if (DstTy->isVectorTy() || I.getOperand(0)->getType()->isVectorTy()) {
+        writeVectorCast(I);
+        return;
+    }
 
-    if (DstTy == Type::getInt1Ty(I.getContext()) &&
-            (I.getOpcode() == Instruction::Trunc ||
-             I.getOpcode() == Instruction::FPToUI ||
-             I.getOpcode() == Instruction::FPToSI ||
-             I.getOpcode() == Instruction::PtrToInt)) {
+    writeOperand(I.getOperand(0));
 
-        auto new_reg = ++NextReg;
-        produceAmbigRR(Commands::CMD_MOV, new_reg, ResultReg);
-        produceAmbigRC(Commands::CMD_AND, new_reg, 1);
+    switch (I.getOpcode()) {
+    case Instruction::ZExt:
+    case Instruction::IntToPtr:
+        // the source is already zero-extended
+        break;
+    case Instruction::SExt: {
+        const unsigned SrcBits = integerBits(I.getOperand(0)->getType());
+        auto new_reg = resultRegister();
+        produceSExt(SrcBits, new_reg, ResultReg);
         ResultReg = new_reg;
-    } else
+        if (integerBits(DstTy) < 64)
+            produceZExt(integerBits(DstTy), new_reg, new_reg);
+        break;
+    }
+    default:
         writeCastTo(DstTy);
+    }
+}
+
+static unsigned getVectorCast(unsigned opcode) {
+    switch (opcode) {
+    case Instruction::Trunc:   return VOP_TRUNC;
+    case Instruction::ZExt:    return VOP_ZEXT;
+    case Instruction::SExt:    return VOP_SEXT;
+    case Instruction::SIToFP:  return VOP_SITOFP;
+    case Instruction::UIToFP:  return VOP_UITOFP;
+    case Instruction::FPToSI:  return VOP_FPTOSI;
+    case Instruction::FPToUI:  return VOP_FPTOUI;
+    case Instruction::FPTrunc:
+    case Instruction::FPExt:   return VOP_FPCONV;
+    default:
+        report_fatal_error("unsupported vector cast");
+    }
+}
+
+// Fills a fresh register group with LaneValue in every lane.
+void RbvmWriter::writeVectorSplat(VectorType *VTy, uint64_t LaneValue) {
+    const unsigned LaneBytes = vectorLaneBytes(VTy->getElementType());
+    unsigned char Bytes[32] = {};
+    for (unsigned k = 0, n = VTy->getNumElements(); k < n; ++k)
+        memcpy(Bytes + k * LaneBytes, &LaneValue, LaneBytes);
+
+    ResultReg = allocRegs(VTy);
+    for (unsigned k = 0, n = regsFor(VTy); k < n; ++k) {
+        uint64_t V;
+        memcpy(&V, Bytes + 8 * k, 8);
+        produceAmbigRC(Commands::CMD_MOV, ResultReg + k, V);
+    }
+}
+
+void RbvmWriter::writeVectorCast(CastInst &I) {
+    Type *SrcTy = I.getOperand(0)->getType();
+    Type *DstTy = I.getType();
+
+    writeOperand(I.getOperand(0));
+
+    switch (I.getOpcode()) {
+    case Instruction::BitCast:
+    case Instruction::PtrToInt:
+    case Instruction::IntToPtr:
+        // lanes are packed as in memory, so only the register count may
+        // change; f32 scalars are held as double and bools as bytes, which
+        // breaks that
+        if (isBoolVector(SrcTy) || isBoolVector(DstTy) || SrcTy->isFloatTy() || DstTy->isFloatTy())
+            report_fatal_error("unsupported vector bitcast");
+        return;
+    default:
+        break;
+    }
+
+    VectorType *SrcVTy = cast<VectorType>(SrcTy);
+    VectorType *DstVTy = cast<VectorType>(DstTy);
+    const unsigned Lanes = SrcVTy->getNumElements();
+    unsigned Op = getVectorCast(I.getOpcode());
+
+    // a true i1 lane is -1 when read as signed
+    if (isBoolVector(SrcTy) && (Op == VOP_SEXT || Op == VOP_SITOFP)) {
+        auto Src = ResultReg;
+        writeVectorSplat(SrcVTy, 0);
+        produce1(Commands::CMD_VBIN);
+        produce1(VOP_SUB);
+        produce1(VT_I8);
+        produce1(Lanes);
+        produce1(ResultReg);
+        produce1(ResultReg);
+        produce1(Src);
+    }
+
+    auto Src = ResultReg;
+    auto Dst = allocRegs(DstVTy);
+    produce1(Commands::CMD_VCVT);
+    produce1(Op);
+    produce1(vectorLaneType(SrcVTy->getElementType()));
+    produce1(vectorLaneType(DstVTy->getElementType()));
+    produce1(Lanes);
+    produce1(Dst);
+    produce1(Src);
+    ResultReg = Dst;
+
+    if (isBoolVector(DstTy)) {
+        writeVectorSplat(DstVTy, 1);
+        produce1(Commands::CMD_VBIN);
+        produce1(VOP_AND);
+        produce1(VT_I8);
+        produce1(Lanes);
+        produce1(Dst);
+        produce1(Dst);
+        produce1(ResultReg);
+        ResultReg = Dst;
+    }
 }
 
 void RbvmWriter::visitSelectInst(SelectInst &I) {
-    auto new_reg = ++NextReg;
+    if (I.getCondition()->getType()->isVectorTy()) {
+        VectorType *VTy = cast<VectorType>(I.getType());
+        writeOperand(I.getCondition());
+        auto M = ResultReg;
+        writeOperand(I.getTrueValue());
+        auto A = ResultReg;
+        writeOperand(I.getFalseValue());
+        auto B = ResultReg;
+
+        produce1(Commands::CMD_VSEL);
+        produce1(vectorLaneType(VTy->getElementType()));
+        produce1(VTy->getNumElements());
+        ResultReg = allocRegs(VTy);
+        produce1(ResultReg);
+        produce1(M);
+        produce1(A);
+        produce1(B);
+        return;
+    }
+
+    // each arm reads its value before writing new_reg
+    auto new_reg = regsFor(I.getType()) == 1 ? resultRegister() : allocRegs(I.getType());
 
     writeOperand(I.getCondition());
     HandleJZ jz = localJZ(ResultReg);
 
     writeOperand(I.getTrueValue());
-    produceAmbigRR(Commands::CMD_MOV, new_reg, ResultReg);
+    produceMove(I.getType(), new_reg, ResultReg);
     HandleJMP jmp = localJMP();
 
     fixupLocalJZ(jz);
     writeOperand(I.getFalseValue());
-    produceAmbigRR(Commands::CMD_MOV, new_reg, ResultReg);
+    produceMove(I.getType(), new_reg, ResultReg);
     fixupLocalJMP(jmp);
 
     ResultReg = new_reg;
-    writeCastTo(I.getType());
 }
 
-void RbvmWriter::writeGEPExpression(Value *Ptr, gep_type_iterator B, gep_type_iterator E) {
+// IntoResult: the last step may write resultRegister(); false for constant
+// expressions, which are evaluated as operands of another instruction.
+// Constant indices and field offsets add up to one displacement, added last;
+// variable indices are scaled with shl where the element size allows.
+void RbvmWriter::writeGEPExpression(Value *Ptr, gep_type_iterator B, gep_type_iterator E,
+                                    bool IntoResult) {
     writeOperand(Ptr);
-    auto new_reg = ++NextReg;
-    produceAmbigRR(Commands::CMD_MOV, new_reg, ResultReg);
-    auto tmp_reg = ++NextReg;
+    unsigned Base = ResultReg;
+    int64_t Disp = 0;
+    std::vector<ValOperand> Terms;
 
     for (gep_type_iterator I = B; I != E; ++I) {
-        writeOperand(I.getOperand());
-        Type *IntoT = I.getIndexedType();
-        unsigned width = IntoT->getPrimitiveSizeInBits();
-        if (width && width % 8 == 0 && width != 8) {
-            produceAmbigRR(Commands::CMD_MOV, tmp_reg, ResultReg);
-            produceAmbigRC(Commands::CMD_UMUL, tmp_reg, width / 8);
-            produceAmbigRR(Commands::CMD_IADD, new_reg, tmp_reg);
+        Value *Op = I.getOperand();
+        if (StructType *STy = I.getStructTypeOrNull()) {
+            Disp += TD->getStructLayout(STy)->getElementOffset(cast<ConstantInt>(Op)->getZExtValue());
+            continue;
+        }
+        const uint64_t Size = TD->getTypeAllocSize(I.getIndexedType());
+        if (ConstantInt *CI = dyn_cast<ConstantInt>(Op)) {
+            Disp += CI->getSExtValue() * Size;
+            continue;
+        }
+
+        // indices are signed
+        const unsigned IdxBits = integerBits(Op->getType());
+        ValOperand Idx = writeValOperand(Op, IdxBits < 64 ? IdxBits : 0);
+        if (Idx.IsConst)
+            Idx.Value *= Size;
+        else if (Size != 1) {
+            auto tmp_reg = ++NextReg;
+            if (isPowerOf2_64(Size))
+                produceAmbig3(Commands::CMD_SHL, tmp_reg, Idx.Value, {true, Log2_64(Size)});
+            else
+                produceAmbig3(Commands::CMD_UMUL, tmp_reg, Idx.Value, {true, Size});
+            Idx.Value = tmp_reg;
+        }
+        Terms.push_back(Idx);
+    }
+    if (Disp || Terms.empty())
+        Terms.push_back({true, uint64_t(Disp)});
+
+    for (size_t k = 0; k < Terms.size(); ++k) {
+        const unsigned new_reg = k + 1 == Terms.size() && IntoResult ? resultRegister() : ++NextReg;
+        produceAmbig3(Commands::CMD_IADD, new_reg, Base, Terms[k]);
+        Base = new_reg;
+    }
+    ResultReg = Base;
+}
+
+// Splits a GEP into a constant displacement and at most one variable i64
+// index scaled by a power of two, the form an ldx/stx address takes.
+static bool decomposeGEP(const GEPOperator *GEP, const DataLayout &DL,
+                         Value *&Index, uint64_t &Scale, int64_t &Disp) {
+    Index = nullptr;
+    Scale = 0;
+    Disp = 0;
+    for (gep_type_iterator I = gep_type_begin(GEP), E = gep_type_end(GEP); I != E; ++I) {
+        const ConstantInt *CI = dyn_cast<ConstantInt>(I.getOperand());
+        if (StructType *STy = I.getStructTypeOrNull()) {
+            Disp += DL.getStructLayout(STy)->getElementOffset(CI->getZExtValue());
+            continue;
+        }
+        const uint64_t Size = DL.getTypeAllocSize(I.getIndexedType());
+        if (CI) {
+            Disp += CI->getSExtValue() * Size;
+            continue;
+        }
+        if (Index || !isPowerOf2_64(Size) || !I.getOperand()->getType()->isIntegerTy(64))
+            return false;
+        Index = I.getOperand();
+        Scale = Size;
+    }
+    return true;
+}
+
+// A GEP used only as the address of scalar loads and stores is folded into
+// their ldx/stx: it gets no register, and its operands are read where it is
+// used.
+bool RbvmWriter::isFoldedAddress(Instruction *I) const {
+    GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(I);
+    if (!GEP || GEP->getType()->isVectorTy() || GEP->user_empty() ||
+        isDirectAlloca(GEP->getPointerOperand()))
+        return false;
+
+    Value *Index;
+    uint64_t Scale;
+    int64_t Disp;
+    if (!decomposeGEP(cast<GEPOperator>(GEP), *TD, Index, Scale, Disp))
+        return false;
+
+    for (User *U : GEP->users()) {
+        Type *Ty;
+        if (LoadInst *Load = dyn_cast<LoadInst>(U))
+            Ty = Load->getType();
+        else if (StoreInst *Store = dyn_cast<StoreInst>(U)) {
+            if (Store->getValueOperand() == GEP)
+                return false;
+            Ty = Store->getValueOperand()->getType();
         } else
-            produceAmbigRR(Commands::CMD_IADD, new_reg, ResultReg);
+            return false;
+        if (!(Ty->isIntegerTy() || Ty->isPointerTy() || Ty->isFloatingPointTy()))
+            return false;
+        // ldx and stx move 1, 2, 4 or 8 bytes; not the 3 of an i24
+        const unsigned Bits = memoryBits(Ty);
+        if (Bits != 8 && Bits != 16 && Bits != 32 && Bits != 64)
+            return false;
     }
-    ResultReg = new_reg;
+    return true;
+}
+
+bool RbvmWriter::writeFoldedAddress(Value *Ptr, IndexedAddress &A) {
+    Instruction *I = dyn_cast<Instruction>(Ptr);
+    if (!I || !isFoldedAddress(I))
+        return false;
+
+    GEPOperator *GEP = cast<GEPOperator>(I);
+    Value *Index;
+    uint64_t Scale, Addr;
+    decomposeGEP(GEP, *TD, Index, Scale, A.Disp);
+    A.Shift = 0;
+    if (getDataAddress(GEP->getPointerOperand(), Addr)) {
+        A.Disp += Addr;
+        A.Shift |= BASE_NONE;
+    } else {
+        writeOperand(GEP->getPointerOperand());
+        A.Base = ResultReg;
+    }
+    if (Index) {
+        writeOperand(Index);
+        A.Index = ResultReg;
+        A.Shift |= Log2_64(Scale);
+    } else
+        A.Shift |= INDEX_NONE;
+    return true;
 }
 
 void RbvmWriter::visitGetElementPtrInst(GetElementPtrInst &I) {
-    writeGEPExpression(I.getPointerOperand(), gep_type_begin(I), gep_type_end(I));
+    if (I.getType()->isVectorTy())
+        report_fatal_error("vector getelementptr is not supported");
+    writeGEPExpression(I.getPointerOperand(), gep_type_begin(I), gep_type_end(I), true);
+}
+
+void RbvmWriter::visitExtractElementInst(ExtractElementInst &I) {
+    VectorType *VTy = I.getVectorOperandType();
+    writeOperand(I.getVectorOperand());
+    auto Src = ResultReg;
+    writeOperand(I.getIndexOperand());
+    auto Idx = ResultReg;
+
+    produce1(Commands::CMD_VEXT);
+    produce1(vectorLaneType(VTy->getElementType()));
+    produce1(VTy->getNumElements());
+    ResultReg = ++NextReg;
+    produce1(ResultReg);
+    produce1(Src);
+    produce1(Idx);
+}
+
+void RbvmWriter::visitInsertElementInst(InsertElementInst &I) {
+    VectorType *VTy = I.getType();
+    writeOperand(I.getOperand(0));
+    auto Dst = allocRegs(VTy);
+    produceMove(VTy, Dst, ResultReg);
+    writeOperand(I.getOperand(1));
+    auto Elt = ResultReg;
+    writeOperand(I.getOperand(2));
+    auto Idx = ResultReg;
+
+    produce1(Commands::CMD_VINS);
+    produce1(vectorLaneType(VTy->getElementType()));
+    produce1(VTy->getNumElements());
+    produce1(Dst);
+    produce1(Elt);
+    produce1(Idx);
+    ResultReg = Dst;
+}
+
+void RbvmWriter::visitShuffleVectorInst(ShuffleVectorInst &I) {
+    VectorType *VTy = I.getType();
+    VectorType *InTy = cast<VectorType>(I.getOperand(0)->getType());
+    writeOperand(I.getOperand(0));
+    auto A = ResultReg;
+    writeOperand(I.getOperand(1));
+    auto B = ResultReg;
+
+    produce1(Commands::CMD_VSHUF);
+    produce1(vectorLaneType(VTy->getElementType()));
+    produce1(VTy->getNumElements());
+    produce1(InTy->getNumElements());
+    ResultReg = allocRegs(VTy);
+    produce1(ResultReg);
+    produce1(A);
+    produce1(B);
+    // undef lanes come out as zero; the mask is read with getConstantLane()
+    // because getShuffleMask() creates constants for a zeroinitializer mask
+    Constant *Mask = cast<Constant>(I.getOperand(2));
+    for (unsigned k = 0, n = VTy->getNumElements(); k < n; ++k) {
+        uint64_t M;
+        produce1(getConstantLane(Mask, k, M) ? M : 255);
+    }
 }
 
 void RbvmWriter::visitCallInst(CallInst &I) {
+    if (Function *F = I.getCalledFunction()) {
+        switch (F->getIntrinsicID()) {
+        case Intrinsic::stacksave:
+            ResultReg = ++NextReg;
+            produce1(Commands::CMD_STACKSAVE);
+            produce1(ResultReg);
+            return;
+        case Intrinsic::stackrestore:
+            writeOperand(I.getArgOperand(0));
+            produce1(Commands::CMD_STACKRESTORE);
+            produce1(ResultReg);
+            return;
+        case Intrinsic::memcpy:
+        case Intrinsic::memmove:
+        case Intrinsic::memset: {
+            // dst, src (or fill byte), length; alignment and volatility do
+            // not matter to the VM
+            int Regs[3];
+            for (unsigned k = 0; k < 3; ++k) {
+                writeOperand(I.getArgOperand(k));
+                Regs[k] = ResultReg;
+            }
+            produce1(F->getIntrinsicID() == Intrinsic::memcpy ? Commands::CMD_MEMCPY :
+                     F->getIntrinsicID() == Intrinsic::memmove ? Commands::CMD_MEMMOVE :
+                     Commands::CMD_MEMSET);
+            for (int R : Regs)
+                produce1(R);
+            return;
+        }
+        default:
+            break;
+        }
+    }
+
+    if (I.getType()->isVectorTy() ||
+        std::any_of(I.arg_begin(), I.arg_end(), [](Value *V) { return V->getType()->isVectorTy(); }))
+        report_fatal_error("vector arguments and results are not supported in calls");
+
     Value *Callee = I.getCalledValue();
     writeOperand(Callee);
     auto new_reg = ++NextReg;
@@ -764,11 +3057,18 @@ void RbvmWriter::visitCallInst(CallInst &I) {
             RegArgs.push_back(ResultReg);
     }
 
-    produce1(Commands::CMD_CALL0 + RegArgs.size());
+    // call0..call8 and tailcall0..tailcall8; the next opcodes are others
+    if (RegArgs.size() > size_t(Commands::CMD_CALL8 - Commands::CMD_CALL0))
+        report_fatal_error("calls with more than 8 arguments are not supported");
+    const bool Tail = isTailCallInReturnPosition(&I);
+    produce1((Tail ? Commands::CMD_TAILCALL0 : Commands::CMD_CALL0) + RegArgs.size());
     produce1(new_reg);
     
     for (int R : RegArgs) 
         produce1(R);
 
     ResultReg = new_reg;
+    // natives return int and narrower types sign-extended
+    if (!Tail)
+        writeCastTo(I.getType());
 }
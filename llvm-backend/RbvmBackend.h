@@ -1,4 +1,6 @@
 #include "RbvmTargetMachine.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/ADT/StringExtras.h"
 #include "llvm/ADT/SmallString.h"
 #include "llvm/ADT/STLExtras.h"
@@ -36,6 +38,10 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <set>
+#include <tuple>
+#include <algorithm>
+#include <memory>
 #include <string.h>
 
 namespace {
@@ -46,10 +52,70 @@ namespace {
         RbvmMCAsmInfo() { PrivateGlobalPrefix = ""; }
     };
 
+    // Switch cases with values Low..High that are tested at once; see
+    // visitSwitchInst.
+    struct SwitchCluster {
+        enum { Range, Table, BitTest } Kind;
+        uint64_t Low, High;
+        // Range: where all of Low..High go
+        BasicBlock *Dest;
+        // Table: Targets[k] is where Low + k goes, nullptr for the default
+        std::vector<BasicBlock *> Targets;
+        // BitTest: bit k of a mask stands for Low + k
+        std::vector<std::pair<BasicBlock *, uint64_t> > Masks;
+    };
+
+    // An ldx/stx address, Base + (Index << Shift) + Disp; Shift carries the
+    // BASE_NONE and INDEX_NONE flags.  See writeFoldedAddress.
+    struct IndexedAddress {
+        int Base = 0, Index = 0;
+        unsigned Shift = 0;
+        int64_t Disp = 0;
+    };
+
+    // Numbers the blocks of every function before any optimization, for
+    // -fprofile-generate and -fprofile-use; see runOnModule.
+    class RbvmProfilePass : public ModulePass {
+    public:
+        static char ID;
+        RbvmProfilePass() : ModulePass(ID) {}
+
+        virtual StringRef getPassName() const { return "RBVM profile"; }
+        bool runOnModule(Module &M);
+
+    private:
+        void tagBlocks(Function &F);
+        void applyProfile(Module &M);
+    };
+
     class RbvmWriter : public FunctionPass, 
                        public InstVisitor<RbvmWriter> {
     private:
-        typedef size_t HandleFD, HandleJMP, HandleJZ;
+        typedef size_t HandleFD, HandleJMP, HandleJZ, HandleBR;
+
+        // The last operand of a <Val> instruction: a register or a constant.
+        struct ValOperand {
+            bool IsConst;
+            uint64_t Value;
+        };
+
+        typedef std::map<std::pair<std::string, std::string>,
+                         std::pair<uint32_t, std::vector<std::tuple<uint32_t, uint32_t, uint8_t> > > > ProfMap;
+
+        // A function to generate in doFinalization and, once it is known, its
+        // code: generated, or read from the -cache-dir entry named by CacheKey.
+        struct PendingFunction {
+            Function *F;
+            std::vector<BasicBlock *> Layout;
+            std::string CacheKey;
+            bool Cached = false;
+            // Code and Prof are filled in
+            bool Done = false;
+            std::string Code;
+            ProfMap Prof;
+            // time it took to generate
+            uint64_t Micros = 0;
+        };
 
         std::string Mem;
         raw_pwrite_stream &out;
@@ -57,12 +123,62 @@ namespace {
         IntrinsicLowering *IL = nullptr;
         const DataLayout *TD = nullptr;
         std::vector<Function *> prototypesToGen;
+        // functions to generate in doFinalization, with their block layout
+        std::vector<PendingFunction> PendingFunctions;
+        // a worker's own copy of TD, which computes struct layouts on demand
+        std::unique_ptr<const DataLayout> WorkerTD;
+        unsigned BlockTagKind = 0;
         std::vector<std::pair<BasicBlock *, size_t> > PostponedJumps;
-        std::map<const Value*, size_t> BlockPositions;
-        std::map<const Value*, unsigned> Locals;
+        // (block, instruction, offset field) for jumps whose offset is not
+        // where jumpOffsetField looks: jtab entries
+        std::vector<std::tuple<BasicBlock *, size_t, size_t> > PostponedTableJumps;
+        DenseMap<const Value*, size_t> BlockPositions;
+        // the block emitted after the current one; a jump to it is left out
+        BasicBlock *NextBlock = nullptr;
+        // -fprofile-generate: start of the current function's body and the
+        // prof records for the whole module
+        size_t BodyStart = 0;
+        // prof records: for a function and the function its blocks were
+        // tagged in, that function's block count and (offset, block, the
+        // successor the jump goes to) for each branch
+        ProfMap ProfBlocks;
+        DenseMap<const Value*, unsigned> Locals;
+        // instruction numbers of the register allocator; PHIs share the
+        // number of their block's start
+        DenseMap<const Instruction*, unsigned> InstPos;
+        // the lowest register free for temporaries at each instruction number
+        std::vector<unsigned> FreeRegAt;
+        // values that did not get a register
+        DenseMap<const Value*, unsigned> SpillSlots;
+        unsigned NumSpillSlots = 0;
+        // entry-block allocas kept on the guest stack despite fitting a register
+        SmallPtrSet<const AllocaInst*, 8> MemoryAllocas;
         unsigned NextAnonValueNumber = 0;
         unsigned ResultReg = 0;
         unsigned NextReg = 0;
+        // register the instruction being emitted should leave its result in
+        unsigned DestReg = 0;
+        unsigned MaxReg = 0;
+        // offset of every global variable defined in the module in the data
+        // segment; the constants come first, DataReadOnly bytes of them
+        std::map<const GlobalVariable*, uint64_t> DataOffsets;
+        // array and struct constants used as operands, with the constant
+        // globals; they are handled by address like any aggregate
+        std::map<const Constant*, uint64_t> ConstantOffsets;
+        std::vector<Constant*> ConstantPool;
+        uint64_t DataSize = 0;
+        uint64_t DataReadOnly = 0;
+        bool DataLaidOut = false;
+        // contents of the data segment while it is being written
+        std::string DataBytes;
+        // pointers in initializers to what only has an address at run time,
+        // functions and globals defined elsewhere: (offset, global, addend)
+        std::vector<std::tuple<uint64_t, const GlobalValue *, int64_t> > DataFixups;
+        // the switch being lowered and, for each successor that needs PHI
+        // copies, the jumps to its copies (instruction, offset field)
+        BasicBlock *SwitchBlock = nullptr;
+        BasicBlock *SwitchDefault = nullptr;
+        std::vector<std::pair<BasicBlock *, std::vector<std::pair<size_t, size_t> > > > SwitchPads;
 
 
     public:
@@ -71,6 +187,16 @@ namespace {
         explicit RbvmWriter(raw_pwrite_stream &out)
             : FunctionPass(ID), out(out) {}
 
+        // A writer for one thread of generateFunctions(); it reads the
+        // module-wide state of Module, which must not change meanwhile.
+        RbvmWriter(const RbvmWriter &Module)
+            : FunctionPass(ID), out(Module.out), WorkerTD(new DataLayout(*Module.TD)),
+              BlockTagKind(Module.BlockTagKind), DataOffsets(Module.DataOffsets),
+              ConstantOffsets(Module.ConstantOffsets), DataSize(Module.DataSize),
+              DataReadOnly(Module.DataReadOnly), DataLaidOut(true) {
+            TD = WorkerTD.get();
+        }
+
         virtual StringRef getPassName() const { return "RBVM backend"; }
 
         /// getAnalysisUsage - This function should be overriden by passes that need
@@ -92,9 +218,6 @@ namespace {
         virtual bool runOnFunction(Function &F);
 
     private:
-        void writeAddress(Value *Operand);
-        void modifyGlobal(const std::string &Name, int WhatToStore);
-
         void produce1(uint8_t V) {
             Mem.append((const char *) &V, sizeof(V));
         }
@@ -130,27 +253,69 @@ namespace {
             fixup8(h, markPosition() - (h + 8));
         }
 
+        void produceFrame(uint32_t nslots) {
+            produce1(Commands::CMD_FRAME);
+            produce4(nslots);
+        }
+
+        void produceSpill(uint32_t slot, int reg) {
+            produce1(Commands::CMD_SPILL);
+            produce4(slot);
+            produce1(reg);
+        }
+
+        void produceReload(int reg, uint32_t slot) {
+            produce1(Commands::CMD_RELOAD);
+            produce1(reg);
+            produce4(slot);
+        }
+
         void produceAmbigRR(Commands cmd, int R1, int R2) {
             produce1(cmd);
-            produce1(0);
+            produce1(MODE_REG);
+            produce1(R1);
+            produce1(R2);
+        }
+
+        void produceRR(Commands cmd, int R1, int R2) {
+            produce1(cmd);
             produce1(R1);
             produce1(R2);
         }
 
         void produceAmbigRC(Commands cmd, int R, uint64_t C) {
             produce1(cmd);
-            produce1(1);
+            produce1(MODE_CONST);
             produce1(R);
             produce8(C);
         }
 
         void produceAmbigRC_D(Commands cmd, int R, double C) {
             produce1(cmd);
-            produce1(1);
+            produce1(MODE_CONST);
             produce1(R);
             produce8_D(C);
         }
 
+        void produceAmbig(Commands cmd, int R, ValOperand V) {
+            if (V.IsConst)
+                produceAmbigRC(cmd, R, V.Value);
+            else
+                produceAmbigRR(cmd, R, V.Value);
+        }
+
+        // R1 = R2 <cmd> V
+        void produceAmbig3(Commands cmd, int R1, int R2, ValOperand V) {
+            produce1(cmd);
+            produce1(V.IsConst ? MODE_CONST3 : MODE_REG3);
+            produce1(R1);
+            produce1(R2);
+            if (V.IsConst)
+                produce8(V.Value);
+            else
+                produce1(V.Value);
+        }
+
         void produceSG(const std::string &name, int reg) {
             produce1(Commands::CMD_SG);
             produceString(name);
@@ -163,27 +328,107 @@ namespace {
             produce1(reg);
         }
 
-        void produceCSS_DYN(int r1, int r2) {
-            produce1(Commands::CMD_CSS_DYN);
-            produce1(r1);
-            produce1(r2);
-        }
-
         void produceST_RR(int width, int r1, int r2) {
             switch (width) {
             case 8: produceAmbigRR(Commands::CMD_ST8, r1, r2); break;
             case 16: produceAmbigRR(Commands::CMD_ST16, r1, r2); break;
             case 32: produceAmbigRR(Commands::CMD_ST32, r1, r2); break;
             case 64: produceAmbigRR(Commands::CMD_ST64, r1, r2); break;
+            default: report_fatal_error("unsupported width of a store");
             }
         }
 
+        // ld<width> r, [addr]
+        void produceLD_RC(int width, int r, uint64_t addr) {
+            switch (width) {
+            case 8: produceAmbigRC(Commands::CMD_LD8, r, addr); break;
+            case 16: produceAmbigRC(Commands::CMD_LD16, r, addr); break;
+            case 32: produceAmbigRC(Commands::CMD_LD32, r, addr); break;
+            case 64: produceAmbigRC(Commands::CMD_LD64, r, addr); break;
+            default: report_fatal_error("unsupported width of a load");
+            }
+        }
+
+        // st<width> [addr], r
+        void produceST_CR(int width, uint64_t addr, int r) {
+            switch (width) {
+            case 8: produce1(Commands::CMD_ST8); break;
+            case 16: produce1(Commands::CMD_ST16); break;
+            case 32: produce1(Commands::CMD_ST32); break;
+            case 64: produce1(Commands::CMD_ST64); break;
+            default: report_fatal_error("unsupported width of a store");
+            }
+            produce1(MODE_CONST);
+            produce8(addr);
+            produce1(r);
+        }
+
+        // ldx<width> r, [A]
+        void produceLDX(int width, int r, const IndexedAddress &A) {
+            switch (width) {
+            case 8: produce1(Commands::CMD_LDX8); break;
+            case 16: produce1(Commands::CMD_LDX16); break;
+            case 32: produce1(Commands::CMD_LDX32); break;
+            case 64: produce1(Commands::CMD_LDX64); break;
+            default: report_fatal_error("unsupported width of an indexed load");
+            }
+            produce1(r);
+            produceIndexedAddress(A);
+        }
+
+        // stx<width> [A], r
+        void produceSTX(int width, const IndexedAddress &A, int r) {
+            switch (width) {
+            case 8: produce1(Commands::CMD_STX8); break;
+            case 16: produce1(Commands::CMD_STX16); break;
+            case 32: produce1(Commands::CMD_STX32); break;
+            case 64: produce1(Commands::CMD_STX64); break;
+            default: report_fatal_error("unsupported width of an indexed store");
+            }
+            produceIndexedAddress(A);
+            produce1(r);
+        }
+
+        void produceIndexedAddress(const IndexedAddress &A) {
+            produce1(A.Base);
+            produce1(A.Index);
+            produce1(A.Shift);
+            produce8(A.Disp);
+        }
+
         void produceLD_RR(int width, int r1, int r2) {
             switch (width) {
             case 8: produceAmbigRR(Commands::CMD_LD8, r1, r2); break;
             case 16: produceAmbigRR(Commands::CMD_LD16, r1, r2); break;
             case 32: produceAmbigRR(Commands::CMD_LD32, r1, r2); break;
             case 64: produceAmbigRR(Commands::CMD_LD64, r1, r2); break;
+            default: report_fatal_error("unsupported width of a load");
+            }
+        }
+
+        // r1 = the low `width` bits of r2, zero- or sign-extended to 64 bits
+        void produceZExt(unsigned width, int r1, int r2) {
+            switch (width) {
+            case 8:  produceRR(Commands::CMD_ZEXT8, r1, r2); break;
+            case 16: produceRR(Commands::CMD_ZEXT16, r1, r2); break;
+            case 32: produceRR(Commands::CMD_ZEXT32, r1, r2); break;
+            default:
+                if (r1 != r2)
+                    produceAmbigRR(Commands::CMD_MOV, r1, r2);
+                produceAmbigRC(Commands::CMD_AND, r1, (uint64_t(1) << width) - 1);
+            }
+        }
+
+        void produceSExt(unsigned width, int r1, int r2) {
+            switch (width) {
+            case 8:  produceRR(Commands::CMD_SEXT8, r1, r2); break;
+            case 16: produceRR(Commands::CMD_SEXT16, r1, r2); break;
+            case 32: produceRR(Commands::CMD_SEXT32, r1, r2); break;
+            default:
+                if (r1 != r2)
+                    produceAmbigRR(Commands::CMD_MOV, r1, r2);
+                produceAmbigRC(Commands::CMD_SHL, r1, 64 - width);
+                produceAmbigRC(Commands::CMD_ASHR, r1, 64 - width);
             }
         }
 
@@ -220,6 +465,36 @@ namespace {
             return pos;
         }
 
+        HandleJZ localJNZ(int reg) {
+            const size_t pos = markPosition();
+            produce1(Commands::CMD_JNZ);
+            produce1(reg);
+            produce8(0);
+            return pos;
+        }
+
+        // Position of the offset operand of the jump instruction at pos.
+        size_t jumpOffsetField(size_t pos) const {
+            switch ((unsigned char) Mem[pos]) {
+            case Commands::CMD_JMP:
+                return pos + 1;
+            case Commands::CMD_JZ:
+            case Commands::CMD_JNZ:
+                return pos + 2;
+            default:
+                // b<cc> <mode> <Reg> <Reg|u64> <Off>
+                return pos + (Mem[pos + 1] ? 11 : 4);
+            }
+        }
+
+        void fixupLocalBranch(HandleBR h) {
+            fixup8(jumpOffsetField(h), markPosition() - h);
+        }
+
+        void postponeBranch(BasicBlock *BB, HandleBR h) {
+            PostponedJumps.push_back({BB, h});
+        }
+
         void fixupLocalJMP(HandleJMP h) {
             fixup8(h + 1, markPosition() - h);
         }
@@ -228,10 +503,11 @@ namespace {
             fixup8(h + 2, markPosition() - h);
         }
 
-        void produceStraightJump(size_t to) {
+        HandleBR produceBranchRC(Commands cmd, int R, uint64_t C) {
             const size_t pos = markPosition();
-            produce1(Commands::CMD_JMP);
-            produce8(to - pos);
+            produceAmbigRC(cmd, R, C);
+            produce8(0);
+            return pos;
         }
 
         void postponeJmp(BasicBlock *BB) {
@@ -242,7 +518,9 @@ namespace {
 
         void fixupPostponed() {
             for (const auto &p : PostponedJumps)
-                fixup8(p.second + 1, BlockPositions[p.first] - p.second);
+                fixup8(jumpOffsetField(p.second), BlockPositions.lookup(p.first) - p.second);
+            for (const auto &t : PostponedTableJumps)
+                fixup8(std::get<2>(t), BlockPositions.lookup(std::get<0>(t)) - std::get<1>(t));
         }
 
         /// releaseMemory() - This member can be implemented by a pass if it wants to
@@ -257,31 +535,61 @@ namespace {
         /// longer used.
         void releaseMemory();
 
-        void declareGlobalVariable(GlobalVariable*);
+        void layoutDataSegment(Module&);
+        uint64_t allocateData(Type*, uint64_t Align = 1);
+        void layoutConstants(Function&, bool ReadOnly = false);
+        uint64_t getConstantAddress(Constant*);
+        bool getDataAddress(const Value*, uint64_t &Addr);
+        void writeInitializer(Constant*, uint64_t Offset);
+        void produceDataSegment(Module&);
+        unsigned memoryBits(Type*) const;
 
         void lowerIntrinsics(Function&);
-        void printFunction(Function&);
-        void printLoop(Loop*);
+        void printFunction(Function&, const std::vector<BasicBlock*> &Layout);
+        void generateFunctions();
+        std::string cacheKey(Function&);
+        bool readCache(PendingFunction&);
+        void writeCache(const PendingFunction&);
+        void allocateRegisters(Function&);
+        bool isSameHome(Value*, Value*);
+        void layoutLoop(Loop*, std::vector<BasicBlock*> &Layout);
         void printBasicBlock(BasicBlock*);
+        std::vector<BasicBlock*> blockLayout(Function&);
+        std::vector<BasicBlock*> profileLayout(Function&);
+        void recordProfBranch(BranchInst&, HandleBR, unsigned JumpSucc);
 
         friend class InstVisitor<RbvmWriter>;
 
         AllocaInst* isDirectAlloca(Value*) const;
         void writeInstComputationInline(Instruction&);
         bool isAddressExposed(Value*);
+        bool isFoldedAddress(Instruction*) const;
+        bool writeFoldedAddress(Value*, IndexedAddress&);
         void writeOperandDeref(Value*);
         void writeOperandInternal(Value*);
         void writeOperand(Value*);
         void printConstant(Constant*);
-        bool printConstantString(Constant*, unsigned new_reg);
         void printConstantArray(ConstantArray*);
         void printConstantDataSequential(ConstantDataSequential*);
 
         void writeCastTo(Type*);
+        HandleBR writeCompareAndBranch(ICmpInst*, bool Negate);
+        ValOperand writeValOperand(Value*, unsigned SExtBits = 0);
+
+        unsigned allocRegs(Type*);
+        unsigned resultRegister();
+        void produceMove(Type*, unsigned Dst, unsigned Src);
+        void printConstantVector(Constant*);
+        void writeVectorSplat(VectorType*, uint64_t LaneValue);
+        void writeVectorCast(CastInst&);
 
         void visitReturnInst(ReturnInst&);
         void visitBranchInst(BranchInst&);
         void visitSwitchInst(SwitchInst&);
+        void jumpToSwitchTarget(BasicBlock *Succ, size_t Instr, size_t Field);
+        void writeSwitchCluster(const SwitchCluster &C, unsigned Cond, uint64_t Low, uint64_t High);
+        void writeSwitchTree(const SwitchCluster *First, const SwitchCluster *Last, unsigned Cond,
+                             uint64_t Low, uint64_t High);
 
         void visitUnreachable(UnreachableInst&) {}
         
@@ -304,12 +612,17 @@ namespace {
         void visitSelectInst(SelectInst&);
         void visitCallInst(CallInst&);
 
+        void visitAllocaInst(AllocaInst&);
         void visitLoadInst(LoadInst&);
         void visitStoreInst(StoreInst&);
+        bool hasPHICopies(BasicBlock *CurBlock, BasicBlock *Successor);
         void printPHICopiesForSuccessor(BasicBlock *CurBlock, BasicBlock *Successor, unsigned Indent);
         void printBranchToBlock(BasicBlock *CurBlock, BasicBlock *Successor, unsigned Indent);
-        void writeGEPExpression(Value*, gep_type_iterator, gep_type_iterator);
+        void writeGEPExpression(Value*, gep_type_iterator, gep_type_iterator, bool IntoResult);
         void visitGetElementPtrInst(GetElementPtrInst&);
+        void visitExtractElementInst(ExtractElementInst&);
+        void visitInsertElementInst(InsertElementInst&);
+        void visitShuffleVectorInst(ShuffleVectorInst&);
         // void visitVAArgInst (VAArgInst &I);????
 
         void visitInstruction(Instruction &I) { 
@@ -10,7 +10,9 @@ struct RbvmTargetMachine : public TargetMachine {
     RbvmTargetMachine(const Target &T, const Triple &TT, StringRef CPU, StringRef FS,
                       const TargetOptions &Options, Optional<Reloc::Model> RM,
                       Optional<CodeModel::Model> CM, CodeGenOpt::Level OL, bool JIT)
-                    : TargetMachine(T, "", TT, CPU, FS, Options) {}
+                    : TargetMachine(T, "", TT, CPU, FS, Options) {
+        setOptLevel(OL);
+    }
 
     bool addPassesToEmitFile(
         PassManagerBase &PM, raw_pwrite_stream &Out,
@@ -28,8 +28,11 @@
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Support/ToolOutputFile.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
 #include "llvm/Target/TargetMachine.h"
+#include <chrono>
 #include <memory>
+#include <sys/resource.h>
 #include "compat.h"
 using namespace llvm;
 
@@ -48,7 +51,8 @@ static cl::opt<std::string> OutputFilename("o",
 
 static cl::opt<unsigned> TimeCompilations("time-compilations", cl::Hidden, cl::init(1u),
                                           cl::value_desc("N"),
-                                          cl::desc("Repeat compilation N times for timing"));
+                                          cl::desc("Repeat compilation N times for timing, "
+                                                   "reporting the time and peak memory of each"));
 
 static cl::opt<char> OptLevel("O",
                               cl::desc("Optimization level. [-O0, -O1, -O2, or -O3] "
@@ -160,9 +164,18 @@ int main(int argc, char **argv) {
 
     cl::ParseCommandLineOptions(argc, argv, "llvm system compiler\n");
 
-    for (unsigned I = TimeCompilations; I; --I)
+    for (unsigned I = 1; I <= TimeCompilations; ++I) {
+        const auto Start = std::chrono::steady_clock::now();
         if (int RetVal = compileModule(argv, TheContext))
             return RetVal;
+        if (TimeCompilations.getNumOccurrences()) {
+            const std::chrono::duration<double, std::milli> Time = std::chrono::steady_clock::now() - Start;
+            struct rusage Usage;
+            getrusage(RUSAGE_SELF, &Usage);
+            // peak RSS of the process so far; ru_maxrss is in KiB on Linux
+            errs() << format("compilation %u: %.1f ms, peak RSS %ld KiB\n", I, Time.count(), Usage.ru_maxrss);
+        }
+    }
     return 0;
 }
 
@@ -256,8 +269,16 @@ static int compileModule(char** argv, LLVMContext &Context) {
 
     legacy::PassManager PM;
 
-    TargetLibraryInfoWrapperPass *TLI = new TargetLibraryInfoWrapperPass(TheTriple);
-    PM.add(TLI);
+    // Library call simplification may only turn calls into calls of functions
+    // the VM implements as natives (printf into puts, but not into putchar).
+    TargetLibraryInfoImpl TLII(TheTriple);
+    TLII.disableAllFunctions();
+    for (LibFunc F : {LibFunc_malloc, LibFunc_calloc, LibFunc_realloc, LibFunc_free,
+                      LibFunc_memcmp, LibFunc_memcpy, LibFunc_memmove, LibFunc_memset,
+                      LibFunc_strlen, LibFunc_strcmp, LibFunc_printf, LibFunc_puts,
+                      LibFunc_scanf})
+        TLII.setAvailable(F);
+    PM.add(new TargetLibraryInfoWrapperPass(TLII));
 
     PM.add(createTargetTransformInfoWrapperPass(Target.getTargetIRAnalysis()));
 
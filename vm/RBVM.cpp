@@ -14,9 +14,15 @@
 #include <math.h>
 #include <assert.h>
 #include <array>
+#include <algorithm>
+#include <unordered_map>
 
 #include "opcode.h"
+#include "opinfo.h"
 #include "reader.h"
+#include "heap.h"
+#include "output.h"
+#include "vector.h"
 
 #define PAIR(S_) (int) (S_).size(), (S_).data()
 
@@ -36,13 +42,18 @@ struct Function
         : header{0}, offset(offset), nargs(nargs), nskip(nskip) {}
 };
 
+// Natives receive their arguments already read from the caller's registers;
+// the call site checks nargs against [min_args, max_args].
 struct NativeFunction
 {
-    typedef uint64_t (*Call)(unsigned nargs, const unsigned char *regs);
+    typedef uint64_t (*Call)(const uint64_t *args, unsigned nargs);
     FunctionHeader header;
     Call ptr;
+    const char *name;
+    unsigned min_args, max_args;
 
-    NativeFunction(Call ptr_) : header{1}, ptr(ptr_) {}
+    NativeFunction(const char *name, unsigned min_args, unsigned max_args, Call ptr_)
+        : header{1}, ptr(ptr_), name(name), min_args(min_args), max_args(max_args) {}
 };
 
 
@@ -51,11 +62,227 @@ static std::vector<stack_frame> reg_stack;
 
 #define REG reg_stack.back().data()
 
-static std::vector<std::pair<unsigned, unsigned char>> call_stack;
+struct CallFrame
+{
+    unsigned ret;
+    unsigned char reg;
+    // guest stack pointer at entry; everything above it is released on return
+    char *fp;
+    // spill slots reserved by `frame`, on the guest stack
+    uint64_t *spill = nullptr;
+};
+
+static std::vector<CallFrame> call_stack;
+
+// Guest stack: backs locals that do not live in registers (arrays, structs,
+// dynamic allocas).  Allocation is a pointer bump; frames are popped by
+// restoring the stack pointer saved in the CallFrame.
+struct GuestStack
+{
+    char *base = nullptr;
+    char *sp = nullptr;
+    char *limit = nullptr;
+    size_t size = size_t(8) << 20;
+};
+
+static GuestStack guest_stack;
+
+static void guest_stack_init() {
+    void *p = mmap(nullptr, guest_stack.size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("cannot reserve the guest stack");
+        exit(1);
+    }
+    guest_stack.base = guest_stack.sp = static_cast<char *>(p);
+    guest_stack.limit = guest_stack.base + guest_stack.size;
+}
+
+static uint64_t guest_alloca(uint64_t n) {
+    n = (n + 15) & ~uint64_t(15);
+    if (n > uint64_t(guest_stack.limit - guest_stack.sp)) {
+        fprintf(stderr, "guest stack overflow\n");
+        exit(1);
+    }
+    char *p = guest_stack.sp;
+    guest_stack.sp += n;
+    return (uintptr_t) p;
+}
 
 static std::map<std::string, void*> names;
 
 
+// Dynamic opcode statistics (--opstats): a histogram of executed opcodes split
+// by operand form, plus adjacent pairs and triples in execution order.
+struct OpStats
+{
+    enum { FORM_NONE, FORM_REG, FORM_CONST };
+
+    bool enabled = false;
+    FILE *out = nullptr;
+    size_t top = 32;
+
+    uint64_t total = 0;
+    uint64_t ops[__CMD_LAST__][3] = {};
+    std::vector<uint64_t> pairs;
+    std::unordered_map<uint32_t, uint64_t> triples;
+    int prev1 = -1, prev2 = -1;
+};
+
+static OpStats opstats;
+
+static void opstats_record(unsigned char command, const char *operands) {
+    int form = OpStats::FORM_NONE;
+    if (has_val_operand(command))
+        form = (*operands & MODE_CONST) ? OpStats::FORM_CONST : OpStats::FORM_REG;
+
+    ++opstats.total;
+    ++opstats.ops[command][form];
+
+    if (opstats.prev1 >= 0) {
+        ++opstats.pairs[opstats.prev1 * __CMD_LAST__ + command];
+        if (opstats.prev2 >= 0)
+            ++opstats.triples[(opstats.prev2 * __CMD_LAST__ + opstats.prev1) * __CMD_LAST__ + command];
+    }
+    opstats.prev2 = opstats.prev1;
+    opstats.prev1 = command;
+}
+
+static void opstats_dump() {
+    static const char *form_names[] = {"", "reg", "const"};
+    FILE *out = opstats.out;
+
+    fprintf(out, "kind,ops,form,count\n");
+    fprintf(out, "total,,,%llu\n", (unsigned long long) opstats.total);
+    for (unsigned c = 0; c < __CMD_LAST__; ++c)
+        for (int form = 0; form < 3; ++form)
+            if (opstats.ops[c][form])
+                fprintf(out, "op,%s,%s,%llu\n", opcode_names[c], form_names[form],
+                        (unsigned long long) opstats.ops[c][form]);
+
+    std::vector<std::pair<uint64_t, uint32_t>> seq;
+    for (uint32_t k = 0; k < opstats.pairs.size(); ++k)
+        if (opstats.pairs[k])
+            seq.push_back({opstats.pairs[k], k});
+    auto emit_top = [&](const char *kind, unsigned len) {
+        size_t n = std::min(opstats.top, seq.size());
+        std::partial_sort(seq.begin(), seq.begin() + n, seq.end(), std::greater<>());
+        for (size_t j = 0; j < n; ++j) {
+            uint32_t k = seq[j].second;
+            unsigned char c[3];
+            for (unsigned l = len; l--; k /= __CMD_LAST__)
+                c[l] = k % __CMD_LAST__;
+            fprintf(out, "%s,%s", kind, opcode_names[c[0]]);
+            for (unsigned l = 1; l < len; ++l)
+                fprintf(out, " %s", opcode_names[c[l]]);
+            fprintf(out, ",,%llu\n", (unsigned long long) seq[j].first);
+        }
+    };
+    emit_top("pair", 2);
+
+    seq.clear();
+    for (const auto &t : opstats.triples)
+        seq.push_back({t.second, t.first});
+    emit_top("triple", 3);
+
+    fflush(out);
+}
+
+// Branch profile (--profile=FILE) for llvm-rbvm -fprofile-use: how often each
+// function is entered and which way each two-way branch goes.  The VM counts
+// by bytecode offset; the prof records of a -fprofile-generate build tell
+// which block of the unoptimized IR each branch comes from, so the profile
+// is written by those block ids and stays valid when the program is
+// compiled again.
+struct Profile
+{
+    struct Block {
+        std::string origin;     // function the block was in before inlining
+        uint32_t blocks, block;
+        unsigned char succ;     // successor the jump goes to
+    };
+
+    bool enabled = false;
+    FILE *out = nullptr;
+
+    // the instruction just dispatched: a branch and where it falls through
+    // to, or a call
+    bool in_branch = false, in_call = false;
+    unsigned branch_at = 0, fallthrough = 0;
+
+    std::unordered_map<unsigned, uint64_t> entries;                 // by body offset
+    std::unordered_map<unsigned, std::array<uint64_t, 2> > branches; // not taken, taken
+    std::unordered_map<unsigned, Block> blocks;                     // by branch offset
+};
+
+static Profile profile;
+
+static void profile_record(const char *bytecode, unsigned at) {
+    if (profile.in_branch)
+        ++profile.branches[profile.branch_at][at != profile.fallthrough];
+    if (profile.in_call)
+        ++profile.entries[at];
+    profile.in_branch = profile.in_call = false;
+
+    const unsigned char command = bytecode[at];
+    if (command == CMD_JZ || command == CMD_JNZ || (command >= CMD_BEQ && command <= CMD_BSGE32)) {
+        profile.in_branch = true;
+        profile.branch_at = at;
+        profile.fallthrough = at + (command < CMD_BEQ ? 10 : bytecode[at + 1] ? 19 : 12);
+    } else
+        profile.in_call = (command >= CMD_CALL0 && command <= CMD_CALL8) ||
+                          (command >= CMD_TAILCALL0 && command <= CMD_TAILCALL8);
+}
+
+static void profile_dump() {
+    FILE *out = profile.out;
+    for (const auto &n : names) {
+        if (((FunctionHeader *) n.second)->native)
+            continue;
+        fprintf(out, "entry %s %llu\n", n.first.c_str(),
+                (unsigned long long) profile.entries[((Function *) n.second)->offset]);
+    }
+
+    // inlined copies of a block add up
+    std::map<std::tuple<std::string, uint32_t, uint32_t>, std::array<uint64_t, 2> > counts;
+    for (const auto &b : profile.blocks) {
+        auto &c = counts[std::make_tuple(b.second.origin, b.second.blocks, b.second.block)];
+        const auto &n = profile.branches[b.first];
+        c[b.second.succ] += n[1];
+        c[!b.second.succ] += n[0];
+    }
+    for (const auto &c : counts)
+        fprintf(out, "branch %s %u %u %llu %llu\n", std::get<0>(c.first).c_str(),
+                std::get<1>(c.first), std::get<2>(c.first),
+                (unsigned long long) c.second[0], (unsigned long long) c.second[1]);
+    fflush(out);
+}
+
+
+// Pops the current frame and returns to the caller; the result is the
+// caller's register that receives the return value.
+static unsigned char leave_frame(unsigned &i) {
+    const CallFrame frame = call_stack.back();
+    call_stack.pop_back();
+    reg_stack.pop_back();
+    i = frame.ret;
+    guest_stack.sp = frame.fp;
+    return frame.reg;
+}
+
+// Replaces the current frame's arguments for a tail call: registers and the
+// call-stack entry are reused, and the guest stack is unwound to the frame
+// pointer.
+static void reuse_frame(unsigned n, const char* bytecode, unsigned& i) {
+    uint64_t args[8];
+    for (unsigned j = 0; j < n; ++j)
+        args[j] = REG[*(unsigned char*)(bytecode + i++)];
+
+    for (unsigned j = 0; j < n; ++j)
+        REG[j + 1] = args[j];
+
+    guest_stack.sp = call_stack.back().fp;
+}
 
 static void init_call(unsigned n, const char* bytecode, unsigned& i) {
     std::vector<uint64_t> args(n);
@@ -69,26 +296,43 @@ static void init_call(unsigned n, const char* bytecode, unsigned& i) {
 }
 
 
+// register image of an instruction result: doubles keep their bits, integers
+// and comparison results convert
+static inline uint64_t to_reg(double v) {
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    return bits;
+}
+
+template <typename T>
+static inline uint64_t to_reg(T v) {
+    return (uint64_t) v;
+}
+
 template <typename T, class Instruction>
 void perform_reg_val_instruction(const char* bytecode, unsigned& i, Instruction instruction) {
-    auto has_const = *(unsigned char*)(bytecode + i++);
+    auto mode = *(unsigned char*)(bytecode + i++);
     auto r1 = *(unsigned char*)(bytecode + i++);
+    // the first operand is <Reg1> itself unless the mode is three-address
+    auto src = r1;
+    if (mode & MODE_REG3)
+        src = *(unsigned char*)(bytecode + i++);
 
 
-    if (has_const) {
+    if (mode & MODE_CONST) {
         auto value = *(T*)(bytecode + i);
 #ifdef TEXT
-        printf("~~~ R%d, %d\n", (int) r1, (int) value);
+        printf("~~~ R%d, R%d, %d\n", (int) r1, (int) src, (int) value);
 #endif
         i += sizeof(T);
-        REG[r1] = (uint64_t)(instruction(*(T*)(REG + r1), value));
+        REG[r1] = to_reg(instruction(*(T*)(REG + src), value));
     }
     else {
         auto r2 = *(unsigned char*)(bytecode + i++);
 #ifdef TEXT
-        printf("~~~ R%d, R%d\n", (int) r1, (int) r2);
+        printf("~~~ R%d, R%d, R%d\n", (int) r1, (int) src, (int) r2);
 #endif
-        REG[r1] = (uint64_t)(instruction(*(T*)(REG + r1), *(T*)(REG + r2)));
+        REG[r1] = to_reg(instruction(*(T*)(REG + src), *(T*)(REG + r2)));
     }
 }
 
@@ -115,6 +359,97 @@ static void ld(const char *bytecode, unsigned &i)
     }
 }
 
+// ldx/stx address: <Base> <Index> <Shift:u8> <Disp:u64> is
+// <Base> + (<Index> << <Shift>) + <Disp>, less the registers that <Shift>
+// flags with BASE_NONE or INDEX_NONE.
+static inline uint64_t indexed_address(const char *bytecode, unsigned &i)
+{
+    auto base = *(unsigned char*)(bytecode + i++);
+    auto index = *(unsigned char*)(bytecode + i++);
+    auto shift = *(unsigned char*)(bytecode + i++);
+    uint64_t addr = *(uint64_t*)(bytecode + i);
+    i += sizeof(uint64_t);
+#ifdef TEXT
+    printf("[");
+    if (!(shift & BASE_NONE))
+        printf("R%d + ", (int) base);
+    if (!(shift & INDEX_NONE))
+        printf("R%d << %d + ", (int) index, shift & 63);
+    printf("%lld]", (long long) addr);
+#endif
+    if (!(shift & BASE_NONE))
+        addr += REG[base];
+    if (!(shift & INDEX_NONE))
+        addr += REG[index] << (shift & 63);
+    return addr;
+}
+
+template <typename T>
+static void ldx(const char *bytecode, unsigned &i)
+{
+    auto r1 = *(unsigned char*)(bytecode + i++);
+#ifdef TEXT
+    printf("ldx%d R%d, ", (int) sizeof(T) * 8, (int) r1);
+#endif
+    auto addr = indexed_address(bytecode, i);
+#ifdef TEXT
+    printf("\n");
+#endif
+    REG[r1] = *(T*) addr;
+}
+
+template <typename T>
+static void stx(const char *bytecode, unsigned &i)
+{
+#ifdef TEXT
+    printf("stx%d ", (int) sizeof(T) * 8);
+#endif
+    auto addr = indexed_address(bytecode, i);
+    auto r = *(unsigned char*)(bytecode + i++);
+#ifdef TEXT
+    printf(", R%d\n", (int) r);
+#endif
+    *(T*) addr = REG[r];
+}
+
+template <typename T>
+static void extend(const char *bytecode, unsigned &i)
+{
+    auto r1 = *(unsigned char*)(bytecode + i++);
+    auto r2 = *(unsigned char*)(bytecode + i++);
+#ifdef TEXT
+    printf("%s R%d, R%d\n", opcode_names[(unsigned char) bytecode[i - 3]], (int) r1, (int) r2);
+#endif
+    REG[r1] = (uint64_t)(int64_t)(T) REG[r2];
+}
+
+// b<cc> <Reg> <Val> <Off>: jumps by <Off> from the start of the instruction if
+// the comparison holds; the operands are compared as T.
+template <typename T, class Compare>
+static void branch_if(const char *bytecode, unsigned &i, Compare compare)
+{
+    const unsigned start = i - 1;
+    auto has_const = *(unsigned char*)(bytecode + i++);
+    auto r1 = *(unsigned char*)(bytecode + i++);
+    uint64_t value;
+
+    if (has_const) {
+        value = *(uint64_t*)(bytecode + i);
+        i += sizeof(uint64_t);
+    } else
+        value = REG[*(unsigned char*)(bytecode + i++)];
+
+    auto offset = *(int64_t*)(bytecode + i);
+#ifdef TEXT
+    printf("%s R%d, %llu, %d\n", opcode_names[(unsigned char) bytecode[start]], (int) r1,
+           (unsigned long long) value, (int) offset);
+#endif
+    if (compare((T) REG[r1], (T) value))
+        i = start + offset;
+    else
+        i += sizeof(int64_t);
+}
+
 template <typename T>
 void st(const char* bytecode, unsigned& i) {
     auto has_const = *(unsigned char*)(bytecode + i++);
@@ -140,106 +475,254 @@ void st(const char* bytecode, unsigned& i) {
     }
 }
 
+// Constant pool: css copies every literal here once, keyed by its position
+// in the bytecode, so that a literal keeps one address for the whole run.
+// No literal is longer than the bytecode holding it, which bounds the pool.
+struct ConstPool
+{
+    char *base = nullptr;
+    char *top = nullptr;
+    std::unordered_map<const char *, char *> interned;
+};
+
+static ConstPool const_pool;
+
+static void const_pool_init(size_t bytecode_size) {
+    const_pool.base = const_pool.top = new char[bytecode_size + 1];
+}
+
+static bool const_pool_owns(const char *p) {
+    return p >= const_pool.base && p < const_pool.top;
+}
+
+// Data segment: the globals of the program, mapped at DATA_SEGMENT_BASE by
+// the data instruction.  Its first `readonly` bytes are the constants; the
+// whole pages among them are made read-only.
+struct DataSegment
+{
+    char *base = nullptr;
+    uint64_t size = 0;
+    uint64_t readonly = 0;
+};
+
+static DataSegment data_segment;
+
+#ifndef MAP_FIXED_NOREPLACE
+// older headers; kernels before 4.17 take the address as a hint, which
+// map_data_segment checks
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+static bool data_segment_readonly(const char *p) {
+    return p >= data_segment.base && p < data_segment.base + data_segment.readonly;
+}
+
+static void map_data_segment(uint64_t size, uint64_t readonly, const char *init, uint64_t init_size) {
+    if (data_segment.base || init_size > size || readonly > size) {
+        fprintf(stderr, "invalid data segment\n");
+        exit(1);
+    }
+    const uint64_t page = sysconf(_SC_PAGESIZE);
+    char *base = (char *) DATA_SEGMENT_BASE;
+    if (size) {
+        void *p = mmap(base, (size + page - 1) & ~(page - 1), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+        if (p != base) {
+            perror("cannot map the data segment");
+            exit(1);
+        }
+        memcpy(base, init, init_size);
+        if (readonly >= page)
+            mprotect(base, readonly & ~(page - 1), PROT_READ);
+    }
+    data_segment.base = base;
+    data_segment.size = size;
+    data_segment.readonly = readonly;
+}
+
 static void * copy_static_str(std::pair<const char *, size_t> span) {
-    char *ptr = new char[span.second];
-    if (span.second) {
-        memcpy(ptr, span.first, span.second);
+    char *&ptr = const_pool.interned[span.first];
+    if (!ptr) {
+        ptr = const_pool.top;
+        if (span.second) {
+            memcpy(ptr, span.first, span.second);
+        }
+        const_pool.top += span.second;
     }
     return ptr;
 }
 
+static uint64_t call_native(const NativeFunction &f, unsigned nargs, const unsigned char *regs) {
+    if (nargs < f.min_args || nargs > f.max_args) {
+        if (f.min_args == f.max_args)
+            fprintf(stderr, "'%s' requires exactly %u argument%s\n", f.name, f.min_args, f.min_args == 1 ? "" : "s");
+        else
+            fprintf(stderr, "'%s' requires at least %u argument%s\n", f.name, f.min_args, f.min_args == 1 ? "" : "s");
+        exit(1);
+    }
+    uint64_t args[8];
+    for (unsigned j = 0; j < nargs; ++j)
+        args[j] = REG[regs[j]];
+    return f.ptr(args, nargs);
+}
+
+static void register_native(const char *name, unsigned min_args, unsigned max_args, NativeFunction::Call ptr) {
+    names[name] = new NativeFunction(name, min_args, max_args, ptr);
+}
+
 static void register_globals() {
-    names["puts"] = new NativeFunction([](unsigned nargs, const unsigned char *regs) -> uint64_t {
-        if (nargs != 1) {
-            fprintf(stderr, "'puts' requires exactly 1 argument\n");
-            exit(1);
-        }
-        auto r = (unsigned char) regs[0];
-        void *ptr = (void *) REG[r];
-        puts((const char *) ptr);
+    register_native("puts", 1, 1, [](const uint64_t *args, unsigned) -> uint64_t {
+        const char *str = (const char *) args[0];
+        guest_out_write(str, strlen(str));
+        guest_out_write("\n", 1);
         return 0;
     });
 
-    names["printf"] = new NativeFunction([](unsigned nargs, const unsigned char *regs) -> uint64_t {
-        if (!nargs) {
-            fprintf(stderr, "'printf' requires at least 1 argument\n");
-            exit(1);
-        }
-        const char *fmt = (const char* ) REG[regs[0]];
-        switch (nargs) {
-        case 1: return printf(fmt);
-        case 2: return printf(fmt, REG[regs[1]]);
-        case 3: return printf(fmt, REG[regs[1]], REG[regs[2]]);
-        case 4: return printf(fmt, REG[regs[1]], REG[regs[2]], REG[regs[3]]);
-        case 5: return printf(fmt, REG[regs[1]], REG[regs[2]], REG[regs[3]], REG[regs[4]]);
-        case 6: return printf(fmt, REG[regs[1]], REG[regs[2]], REG[regs[3]], REG[regs[4]], REG[regs[5]]);
-        case 7: return printf(fmt, REG[regs[1]], REG[regs[2]], REG[regs[3]], REG[regs[4]], REG[regs[5]], REG[regs[6]]);
-        case 8: return printf(fmt, REG[regs[1]], REG[regs[2]], REG[regs[3]], REG[regs[4]], REG[regs[5]], REG[regs[6]], REG[regs[7]]);
-        default: assert(0);
-        }
+    register_native("printf", 1, 8, [](const uint64_t *args, unsigned nargs) -> uint64_t {
+        const char *fmt = (const char *) args[0];
+        // only literals are cached; other formats may live in freed memory
+        if (const_pool_owns(fmt) || data_segment_readonly(fmt))
+            return guest_printf(cached_format(fmt), args + 1, nargs - 1);
+        return guest_printf(parse_format(fmt), args + 1, nargs - 1);
     });
 
-    names["scanf"] = names["__isoc99_scanf"] = new NativeFunction([](unsigned nargs, const unsigned char *regs) -> uint64_t {
-        if (!nargs) {
-            fprintf(stderr, "'scanf' requires at least 1 argument\n");
-            exit(1);
-        }
-        const char *fmt = (const char* ) REG[regs[0]];
+    auto scanf_native = [](const uint64_t *args, unsigned nargs) -> uint64_t {
+        if (guest_out.flush_on_input)
+            guest_out_flush();
+        const char *fmt = (const char* ) args[0];
         switch (nargs) {
         case 1: return scanf(fmt);
-        case 2: return scanf(fmt, REG[regs[1]]);
-        case 3: return scanf(fmt, REG[regs[1]], REG[regs[2]]);
-        case 4: return scanf(fmt, REG[regs[1]], REG[regs[2]], REG[regs[3]]);
-        case 5: return scanf(fmt, REG[regs[1]], REG[regs[2]], REG[regs[3]], REG[regs[4]]);
-        case 6: return scanf(fmt, REG[regs[1]], REG[regs[2]], REG[regs[3]], REG[regs[4]], REG[regs[5]]);
-        case 7: return scanf(fmt, REG[regs[1]], REG[regs[2]], REG[regs[3]], REG[regs[4]], REG[regs[5]], REG[regs[6]]);
-        case 8: return scanf(fmt, REG[regs[1]], REG[regs[2]], REG[regs[3]], REG[regs[4]], REG[regs[5]], REG[regs[6]], REG[regs[7]]);
+        case 2: return scanf(fmt, args[1]);
+        case 3: return scanf(fmt, args[1], args[2]);
+        case 4: return scanf(fmt, args[1], args[2], args[3]);
+        case 5: return scanf(fmt, args[1], args[2], args[3], args[4]);
+        case 6: return scanf(fmt, args[1], args[2], args[3], args[4], args[5]);
+        case 7: return scanf(fmt, args[1], args[2], args[3], args[4], args[5], args[6]);
+        case 8: return scanf(fmt, args[1], args[2], args[3], args[4], args[5], args[6], args[7]);
         default: assert(0);
         }
+        return 0;
+    };
+    register_native("scanf", 1, 8, scanf_native);
+    register_native("__isoc99_scanf", 1, 8, scanf_native);
+
+    register_native("memcpy", 3, 3, [](const uint64_t *args, unsigned) -> uint64_t {
+        return (uintptr_t) memcpy((void *) args[0], (const void *) args[1], args[2]);
     });
 
-    names["exit"] = new NativeFunction([](unsigned nargs, const unsigned char *regs) -> uint64_t {
-        if (nargs != 1) {
-            fprintf(stderr, "'exit' requires exactly 1 argument\n");
-            exit(1);
-        }
-        exit(REG[regs[0]]);
+    register_native("memmove", 3, 3, [](const uint64_t *args, unsigned) -> uint64_t {
+        return (uintptr_t) memmove((void *) args[0], (const void *) args[1], args[2]);
     });
 
-    names["malloc"] = new NativeFunction([](unsigned nargs, const unsigned char *regs) -> uint64_t {
-        if (nargs != 1) {
-            fprintf(stderr, "'malloc' requires exactly 1 argument\n");
-            exit(1);
-        }
-        return (uintptr_t) ::malloc(REG[regs[0]]);
+    register_native("memset", 3, 3, [](const uint64_t *args, unsigned) -> uint64_t {
+        return (uintptr_t) memset((void *) args[0], (unsigned char) args[1], args[2]);
     });
 
-    names["free"] = new NativeFunction([](unsigned nargs, const unsigned char *regs) -> uint64_t {
-        if (nargs != 1) {
-            fprintf(stderr, "'free' requires exactly 1 argument\n");
-            exit(1);
-        }
-        free((void*)REG[regs[0]]);
+    register_native("memcmp", 3, 3, [](const uint64_t *args, unsigned) -> uint64_t {
+        return (int64_t) memcmp((const void *) args[0], (const void *) args[1], args[2]);
+    });
+
+    register_native("strlen", 1, 1, [](const uint64_t *args, unsigned) -> uint64_t {
+        return strlen((const char *) args[0]);
+    });
+
+    register_native("strcmp", 2, 2, [](const uint64_t *args, unsigned) -> uint64_t {
+        return (int64_t) strcmp((const char *) args[0], (const char *) args[1]);
+    });
+
+    register_native("exit", 1, 1, [](const uint64_t *args, unsigned) -> uint64_t {
+        exit(args[0]);
+    });
+
+    register_native("malloc", 1, 1, [](const uint64_t *args, unsigned) -> uint64_t {
+        return (uintptr_t) guest_malloc(args[0]);
+    });
+
+    register_native("calloc", 2, 2, [](const uint64_t *args, unsigned) -> uint64_t {
+        return (uintptr_t) guest_calloc(args[0], args[1]);
+    });
+
+    register_native("realloc", 2, 2, [](const uint64_t *args, unsigned) -> uint64_t {
+        return (uintptr_t) guest_realloc((void*)args[0], args[1]);
+    });
+
+    register_native("free", 1, 1, [](const uint64_t *args, unsigned) -> uint64_t {
+        guest_free((void*)args[0]);
         return 0;
     });
 }
 
+static void usage(const char *argv0) {
+    fprintf(stderr, "USAGE: %s [--opstats[=FILE]] [--opstats-top=N] [--profile=FILE]\n"
+                    "          [--heap-size=BYTES] [--stack-size=BYTES] [<file.rbvm>]\n", argv0);
+    exit(1);
+}
+
 int main(int argc, char** argv) {
+    const char* path = nullptr;
+    for (int a = 1; a < argc; ++a) {
+        const char *arg = argv[a];
+        if (!strcmp(arg, "--opstats")) {
+            opstats.enabled = true;
+        } else if (!strncmp(arg, "--opstats=", 10)) {
+            opstats.enabled = true;
+            opstats.out = fopen(arg + 10, "w");
+            if (!opstats.out)
+                PANIC();
+        } else if (!strncmp(arg, "--opstats-top=", 14)) {
+            opstats.top = strtoul(arg + 14, nullptr, 10);
+        } else if (!strncmp(arg, "--profile=", 10)) {
+            profile.enabled = true;
+            profile.out = fopen(arg + 10, "w");
+            if (!profile.out)
+                PANIC();
+        } else if (!strncmp(arg, "--heap-size=", 12)) {
+            guest_heap.reserve = strtoull(arg + 12, nullptr, 10);
+        } else if (!strncmp(arg, "--stack-size=", 13)) {
+            guest_stack.size = strtoull(arg + 13, nullptr, 10);
+        } else if (arg[0] == '-' && arg[1] == '-') {
+            usage(argv[0]);
+        } else if (!path) {
+            path = arg;
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    if (opstats.enabled) {
+        init_opcode_names();
+        if (!opstats.out)
+            opstats.out = stderr;
+        opstats.pairs.resize(__CMD_LAST__ * __CMD_LAST__);
+        // guest code may leave through the 'exit' native
+        atexit(opstats_dump);
+    }
+    if (profile.enabled)
+        atexit(profile_dump);
+
+    struct stat stdin_stat;
+    guest_out.flush_on_input = fstat(0, &stdin_stat) || !S_ISREG(stdin_stat.st_mode);
+    atexit(guest_out_flush);
+
+    guest_heap_init();
+    guest_stack_init();
     register_globals();
     reg_stack.emplace_back();
 
     const char* bytecode = nullptr;
     size_t size = 0;
 
-    if (argc < 2)
+    if (!path)
         std::tie(bytecode, size) = read_text(stdin);
     else {
-        FILE* file = fopen(argv[1], "rb");
+        FILE* file = fopen(path, "rb");
         if (!file)
             PANIC();
         std::tie(bytecode, size) = read_text(file);
     }
 
+    const_pool_init(size);
+
     unsigned i = 0;
 
     while (i < size) {
@@ -249,6 +732,11 @@ int main(int argc, char** argv) {
 #endif
         ++i;
 
+        if (opstats.enabled)
+            opstats_record(command, bytecode + i);
+        if (profile.enabled)
+            profile_record(bytecode, i - 1);
+
         switch (command) {
 // function declaration
             case CMD_FD: {
@@ -333,6 +821,47 @@ int main(int argc, char** argv) {
 //endif
                 break;
             }
+            case CMD_DATA: {
+                auto size = *(uint64_t*)(bytecode + i);
+                i += sizeof(uint64_t);
+                auto readonly = *(uint64_t*)(bytecode + i);
+                i += sizeof(uint64_t);
+                auto init = *(uint64_t*)(bytecode + i);
+                i += sizeof(uint64_t);
+#ifdef TEXT
+                printf("data %llu, %llu, %llu\n", (unsigned long long) size, (unsigned long long) readonly,
+                       (unsigned long long) init);
+#endif
+                map_data_segment(size, readonly, bytecode + i, init);
+                i += init;
+                break;
+            }
+            case CMD_PROF: {
+                auto len = *(uint32_t*)(bytecode + i);
+                i += sizeof(uint32_t);
+                std::string name(bytecode + i, bytecode + i + len);
+                i += len;
+                len = *(uint32_t*)(bytecode + i);
+                i += sizeof(uint32_t);
+                std::string origin(bytecode + i, bytecode + i + len);
+                i += len;
+                auto blocks = *(uint32_t*)(bytecode + i);
+                i += sizeof(uint32_t);
+                auto count = *(uint32_t*)(bytecode + i);
+                i += sizeof(uint32_t);
+#ifdef TEXT
+                printf("prof '%.*s', '%.*s', %u, %u\n", PAIR(name), PAIR(origin), blocks, count);
+#endif
+                auto f = (Function *) names[name];
+                for (uint32_t k = 0; k < count; ++k, i += 9) {
+                    if (!profile.enabled || !f || f->header.native)
+                        continue;
+                    // <Off:u32> <Block:u32> <Succ:u8>
+                    profile.blocks[f->offset + *(uint32_t*)(bytecode + i)] =
+                        {origin, blocks, *(uint32_t*)(bytecode + i + 4), (unsigned char) bytecode[i + 8]};
+                }
+                break;
+            }
             case CMD_CSS_DYN: {
                 auto r1 = *(unsigned char*)(bytecode + i++);
                 auto r2 = *(unsigned char*)(bytecode + i++);
@@ -364,6 +893,14 @@ int main(int argc, char** argv) {
                 st<uint64_t>(bytecode, i);
                 break;
             }
+            case CMD_LDX8:  ldx<uint8_t>(bytecode, i); break;
+            case CMD_LDX16: ldx<uint16_t>(bytecode, i); break;
+            case CMD_LDX32: ldx<uint32_t>(bytecode, i); break;
+            case CMD_LDX64: ldx<uint64_t>(bytecode, i); break;
+            case CMD_STX8:  stx<uint8_t>(bytecode, i); break;
+            case CMD_STX16: stx<uint16_t>(bytecode, i); break;
+            case CMD_STX32: stx<uint32_t>(bytecode, i); break;
+            case CMD_STX64: stx<uint64_t>(bytecode, i); break;
             case CMD_LEA: {
                 auto r1 = *(unsigned char*)(bytecode + i++);
                 auto r2 = *(unsigned char*)(bytecode + i++);
@@ -396,7 +933,7 @@ int main(int argc, char** argv) {
                 break;
             }
             case CMD_SREM: {
-                perform_reg_val_instruction<int64_t>(bytecode, i, [](uint64_t a, uint64_t b)
+                perform_reg_val_instruction<int64_t>(bytecode, i, [](int64_t a, int64_t b)
                                                                     {return a % b;});
                 break;
             }
@@ -406,7 +943,7 @@ int main(int argc, char** argv) {
                 break;
             }
             case CMD_SDIV: {
-                perform_reg_val_instruction<int64_t>(bytecode, i, [](uint64_t a, uint64_t b)
+                perform_reg_val_instruction<int64_t>(bytecode, i, [](int64_t a, int64_t b)
                                                                     {return a / b;});
                 break;
             }
@@ -436,14 +973,13 @@ int main(int argc, char** argv) {
                                                                     {return a << b;});
                 break;
             }
-            // check
             case CMD_LSHR: {
-                perform_reg_val_instruction<uint32_t>(bytecode, i, [](uint32_t a, uint32_t b)
+                perform_reg_val_instruction<uint64_t>(bytecode, i, [](uint64_t a, uint64_t b)
                                                                     {return a >> b;});
                 break;
             }
             case CMD_ASHR: {
-                perform_reg_val_instruction<uint64_t>(bytecode, i, [](uint64_t a, uint64_t b)
+                perform_reg_val_instruction<int64_t>(bytecode, i, [](int64_t a, int64_t b)
                                                                     {return a >> b;});
                 break;
             }
@@ -533,6 +1069,71 @@ int main(int argc, char** argv) {
                                                                       {return a >= b;});
                 break;
             }
+// 32-bit integer arithmetic and comparison: only the low 32 bits of the
+// operands are used, results are zero-extended to 64 bits
+            case CMD_IADD32: {
+                perform_reg_val_instruction<uint64_t>(bytecode, i, [](uint64_t a, uint64_t b)
+                                                                    {return (uint32_t)(a + b);});
+                break;
+            }
+            case CMD_ISUB32: {
+                perform_reg_val_instruction<uint64_t>(bytecode, i, [](uint64_t a, uint64_t b)
+                                                                    {return (uint32_t)(a - b);});
+                break;
+            }
+            case CMD_IMUL32: {
+                perform_reg_val_instruction<uint64_t>(bytecode, i, [](uint64_t a, uint64_t b)
+                                                                    {return (uint32_t)a * (uint32_t)b;});
+                break;
+            }
+            case CMD_SHL32: {
+                perform_reg_val_instruction<uint64_t>(bytecode, i, [](uint64_t a, uint64_t b)
+                                                                    {return (uint32_t)a << (b & 31);});
+                break;
+            }
+            case CMD_ASHR32: {
+                perform_reg_val_instruction<uint64_t>(bytecode, i, [](uint64_t a, uint64_t b)
+                                                                    {return (uint32_t)((int32_t)a >> (b & 31));});
+                break;
+            }
+            // computed in 64 bits, so INT_MIN / -1 wraps instead of trapping
+            case CMD_SDIV32: {
+                perform_reg_val_instruction<uint64_t>(bytecode, i, [](uint64_t a, uint64_t b)
+                                                                    {return (uint32_t)((int64_t)(int32_t)a / (int32_t)b);});
+                break;
+            }
+            case CMD_SREM32: {
+                perform_reg_val_instruction<uint64_t>(bytecode, i, [](uint64_t a, uint64_t b)
+                                                                    {return (uint32_t)((int64_t)(int32_t)a % (int32_t)b);});
+                break;
+            }
+            case CMD_SLT32: {
+                perform_reg_val_instruction<uint64_t>(bytecode, i, [](uint64_t a, uint64_t b)
+                                                                      {return (int32_t)a < (int32_t)b;});
+                break;
+            }
+            case CMD_SLE32: {
+                perform_reg_val_instruction<uint64_t>(bytecode, i, [](uint64_t a, uint64_t b)
+                                                                      {return (int32_t)a <= (int32_t)b;});
+                break;
+            }
+            case CMD_SGT32: {
+                perform_reg_val_instruction<uint64_t>(bytecode, i, [](uint64_t a, uint64_t b)
+                                                                      {return (int32_t)a > (int32_t)b;});
+                break;
+            }
+            case CMD_SGE32: {
+                perform_reg_val_instruction<uint64_t>(bytecode, i, [](uint64_t a, uint64_t b)
+                                                                      {return (int32_t)a >= (int32_t)b;});
+                break;
+            }
+// width conversion: <Reg1> = low bits of <Reg2>, zero- or sign-extended
+            case CMD_ZEXT8:  extend<uint8_t>(bytecode, i); break;
+            case CMD_ZEXT16: extend<uint16_t>(bytecode, i); break;
+            case CMD_ZEXT32: extend<uint32_t>(bytecode, i); break;
+            case CMD_SEXT8:  extend<int8_t>(bytecode, i); break;
+            case CMD_SEXT16: extend<int16_t>(bytecode, i); break;
+            case CMD_SEXT32: extend<int32_t>(bytecode, i); break;
 // float-point comparison
             case CMD_FEQ: {
                 perform_reg_val_instruction<double>(bytecode, i, [](double a, double b)
@@ -596,6 +1197,80 @@ int main(int argc, char** argv) {
 //endif
                 break;
             }
+// compare and branch
+            case CMD_BEQ: {
+                branch_if<uint64_t>(bytecode, i, [](uint64_t a, uint64_t b) {return a == b;});
+                break;
+            }
+            case CMD_BNE: {
+                branch_if<uint64_t>(bytecode, i, [](uint64_t a, uint64_t b) {return a != b;});
+                break;
+            }
+            case CMD_BSLT: {
+                branch_if<int64_t>(bytecode, i, [](int64_t a, int64_t b) {return a < b;});
+                break;
+            }
+            case CMD_BSLE: {
+                branch_if<int64_t>(bytecode, i, [](int64_t a, int64_t b) {return a <= b;});
+                break;
+            }
+            case CMD_BSGT: {
+                branch_if<int64_t>(bytecode, i, [](int64_t a, int64_t b) {return a > b;});
+                break;
+            }
+            case CMD_BSGE: {
+                branch_if<int64_t>(bytecode, i, [](int64_t a, int64_t b) {return a >= b;});
+                break;
+            }
+            case CMD_BULT: {
+                branch_if<uint64_t>(bytecode, i, [](uint64_t a, uint64_t b) {return a < b;});
+                break;
+            }
+            case CMD_BULE: {
+                branch_if<uint64_t>(bytecode, i, [](uint64_t a, uint64_t b) {return a <= b;});
+                break;
+            }
+            case CMD_BUGT: {
+                branch_if<uint64_t>(bytecode, i, [](uint64_t a, uint64_t b) {return a > b;});
+                break;
+            }
+            case CMD_BUGE: {
+                branch_if<uint64_t>(bytecode, i, [](uint64_t a, uint64_t b) {return a >= b;});
+                break;
+            }
+            case CMD_BSLT32: {
+                branch_if<int32_t>(bytecode, i, [](int32_t a, int32_t b) {return a < b;});
+                break;
+            }
+            case CMD_BSLE32: {
+                branch_if<int32_t>(bytecode, i, [](int32_t a, int32_t b) {return a <= b;});
+                break;
+            }
+            case CMD_BSGT32: {
+                branch_if<int32_t>(bytecode, i, [](int32_t a, int32_t b) {return a > b;});
+                break;
+            }
+            case CMD_BSGE32: {
+                branch_if<int32_t>(bytecode, i, [](int32_t a, int32_t b) {return a >= b;});
+                break;
+            }
+            case CMD_JTAB: {
+                const unsigned start = i - 1;
+                auto r = *(unsigned char*)(bytecode + i++);
+                auto min = *(uint64_t*)(bytecode + i);
+                i += sizeof(uint64_t);
+                auto count = *(uint32_t*)(bytecode + i);
+                i += sizeof(uint32_t);
+#ifdef TEXT
+                printf("jtab R%d, %llu, %u\n", (int) r, (unsigned long long) min, count);
+#endif
+                const uint64_t k = REG[r] - min;
+                if (k < count)
+                    i = start + *(int64_t*)(bytecode + i + k * sizeof(int64_t));
+                else
+                    i += uint64_t(count) * sizeof(int64_t);
+                break;
+            }
 // call
             case CMD_CALL0:
             case CMD_CALL1:
@@ -618,8 +1293,8 @@ int main(int argc, char** argv) {
                 if (REG[r]) {
                     FunctionHeader hdr = *(FunctionHeader*)REG[r];
                     if (hdr.native) {
-                        NativeFunction f = *(NativeFunction*)REG[r];
-                        REG[r] = f.ptr(n, (unsigned char *) bytecode + i);
+                        const NativeFunction &f = *(NativeFunction*)REG[r];
+                        REG[r] = call_native(f, n, (unsigned char *) bytecode + i);
                         i += n;
                     } else {
                         Function f = *(Function*)REG[r];
@@ -628,7 +1303,7 @@ int main(int argc, char** argv) {
 
                         init_call(n, bytecode, i);
 
-                        call_stack.push_back({i, r});
+                        call_stack.push_back({i, r, guest_stack.sp});
                         i = f.offset;
                     }
                 } else {
@@ -637,6 +1312,47 @@ int main(int argc, char** argv) {
                 }
 //endif
 
+                break;
+            }
+            case CMD_TAILCALL0:
+            case CMD_TAILCALL1:
+            case CMD_TAILCALL2:
+            case CMD_TAILCALL3:
+            case CMD_TAILCALL4:
+            case CMD_TAILCALL5:
+            case CMD_TAILCALL6:
+            case CMD_TAILCALL7:
+            case CMD_TAILCALL8: {
+                auto r = *(unsigned char*)(bytecode + i++);
+                uint64_t n = command - CMD_TAILCALL0;
+#ifdef TEXT
+                printf("tailcall%d %d", (int) n, (int) r);
+                for (int j = 0; j < (int) n; ++j) {
+                    printf(", %d", (int) bytecode[i + j]);
+                }
+                printf("\n");
+#endif
+                assert(!call_stack.empty());
+                if (REG[r]) {
+                    FunctionHeader hdr = *(FunctionHeader*)REG[r];
+                    if (hdr.native) {
+                        const NativeFunction &f = *(NativeFunction*)REG[r];
+                        uint64_t value = call_native(f, n, (unsigned char *) bytecode + i);
+                        unsigned char ret_reg = leave_frame(i);
+                        REG[ret_reg] = value;
+                    } else {
+                        Function f = *(Function*)REG[r];
+
+                        assert(n == f.nargs);
+
+                        reuse_frame(n, bytecode, i);
+                        i = f.offset;
+                    }
+                } else {
+                    fprintf(stderr, "(refusing to call a null pointer)\n");
+                    leave_frame(i);
+                }
+
                 break;
             }
 // ret
@@ -658,25 +1374,103 @@ int main(int argc, char** argv) {
                     value = REG[r1];
                 }
 
-                unsigned char r = 0;
-                std::tie(i, r) = call_stack.back();
-                reg_stack.pop_back();
-
-                REG[r] = value;
-
-                call_stack.pop_back();
+                unsigned char ret_reg = leave_frame(i);
+                REG[ret_reg] = value;
                 break;
             }
             case CMD_LEAVE: {
 #ifdef TEXT
                 printf("leave\n");
 #endif
-                unsigned char r = 0;
-                std::tie(i, r) = call_stack.back();
-
-                reg_stack.pop_back();
-
-                call_stack.pop_back();
+                leave_frame(i);
+                break;
+            }
+// guest stack
+            case CMD_ALLOCA: {
+                perform_reg_val_instruction<uint64_t>(bytecode, i, [](uint64_t a, uint64_t b)
+                                                                      {(void) a; return guest_alloca(b);});
+                break;
+            }
+            case CMD_STACKSAVE: {
+                auto r = *(unsigned char*)(bytecode + i++);
+#ifdef TEXT
+                printf("stacksave R%d\n", (int) r);
+#endif
+                REG[r] = (uintptr_t) guest_stack.sp;
+                break;
+            }
+            case CMD_STACKRESTORE: {
+                auto r = *(unsigned char*)(bytecode + i++);
+#ifdef TEXT
+                printf("stackrestore R%d\n", (int) r);
+#endif
+                guest_stack.sp = (char *) REG[r];
+                break;
+            }
+// spill slots: values that did not get a register
+            case CMD_FRAME: {
+                auto n = *(uint32_t*)(bytecode + i);
+                i += sizeof(uint32_t);
+#ifdef TEXT
+                printf("frame %u\n", n);
+#endif
+                call_stack.back().spill = (uint64_t *) guest_alloca(uint64_t(n) * 8);
+                break;
+            }
+            case CMD_SPILL: {
+                auto slot = *(uint32_t*)(bytecode + i);
+                i += sizeof(uint32_t);
+                auto r = *(unsigned char*)(bytecode + i++);
+#ifdef TEXT
+                printf("spill S%u, R%d\n", slot, (int) r);
+#endif
+                call_stack.back().spill[slot] = REG[r];
+                break;
+            }
+            case CMD_RELOAD: {
+                auto r = *(unsigned char*)(bytecode + i++);
+                auto slot = *(uint32_t*)(bytecode + i);
+                i += sizeof(uint32_t);
+#ifdef TEXT
+                printf("reload R%d, S%u\n", (int) r, slot);
+#endif
+                REG[r] = call_stack.back().spill[slot];
+                break;
+            }
+// bulk memory: libc's versions are vectorized for the host
+            case CMD_MEMCPY:
+            case CMD_MEMMOVE:
+            case CMD_MEMSET: {
+                auto r1 = *(unsigned char*)(bytecode + i++);
+                auto r2 = *(unsigned char*)(bytecode + i++);
+                auto r3 = *(unsigned char*)(bytecode + i++);
+#ifdef TEXT
+                printf("%s R%d, R%d, R%d\n", command == CMD_MEMCPY ? "memcpy" : command == CMD_MEMMOVE ? "memmove" : "memset",
+                       (int) r1, (int) r2, (int) r3);
+#endif
+                void *dst = (void *) REG[r1];
+                if (command == CMD_MEMCPY)
+                    memcpy(dst, (const void *) REG[r2], REG[r3]);
+                else if (command == CMD_MEMMOVE)
+                    memmove(dst, (const void *) REG[r2], REG[r3]);
+                else
+                    memset(dst, (unsigned char) REG[r2], REG[r3]);
+                break;
+            }
+// vectors
+            case CMD_VBIN:
+            case CMD_VCMP:
+            case CMD_VSEL:
+            case CMD_VSHUF:
+            case CMD_VLD:
+            case CMD_VST:
+            case CMD_VINS:
+            case CMD_VEXT:
+            case CMD_VCVT: {
+#ifdef TEXT
+                printf("vector instruction %d\n", (int) command);
+#endif
+                vector_exec(command, bytecode, i, REG);
                 break;
             }
             default:
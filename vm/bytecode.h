@@ -0,0 +1,336 @@
+#ifndef bytecode_h_
+#define bytecode_h_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "opcode.h"
+#include "opinfo.h"
+
+// Instruction decoder for tools that rewrite bytecode (rbvm-opt): the length
+// of each instruction, the registers it reads and writes and the position of
+// its jump offset.  The VM's interpreter loop decodes inline and does not use
+// it, but both follow the encoding in vm.txt.
+
+struct DecodedInstr
+{
+    unsigned char op;
+    unsigned size;              // bytes, including the opcode
+
+    // registers read; use_pos[k] is the byte of uses[k] in the instruction
+    unsigned nuses;
+    unsigned char uses[9];
+    unsigned char use_pos[9];
+
+    // at most one register written, at def_pos
+    unsigned ndefs;
+    unsigned char def;
+    unsigned char def_pos;
+
+    int jump_pos;               // byte of the int64 jump offset, or -1
+    int table_pos;              // jtab: byte of the first of table_count
+    unsigned table_count;       // offsets, or -1 and 0
+    bool falls_through;         // false after jmp, ret, leave and tail calls
+    bool pure;                  // no effect but writing def
+    bool opaque;                // vector instructions: reads and writes
+                                // register groups that are not listed
+};
+
+static inline void decoded_use(DecodedInstr &d, unsigned char reg, unsigned pos) {
+    d.uses[d.nuses] = reg;
+    d.use_pos[d.nuses++] = pos;
+}
+
+static inline void decoded_def(DecodedInstr &d, unsigned char reg, unsigned pos) {
+    d.ndefs = 1;
+    d.def = reg;
+    d.def_pos = pos;
+}
+
+// Decodes the instruction at offset `at` of a program of `size` bytes.
+// Returns false on an unknown opcode or an instruction running past the end.
+static inline bool decode_instr(const char *bytecode, size_t size, size_t at, DecodedInstr &d) {
+    const unsigned char *p = (const unsigned char *) bytecode + at;
+    const size_t avail = size - at;
+    auto u32 = [&](unsigned pos) { uint32_t v; memcpy(&v, p + pos, sizeof(v)); return v; };
+    auto u64 = [&](unsigned pos) { uint64_t v; memcpy(&v, p + pos, sizeof(v)); return v; };
+
+    memset(&d, 0, sizeof(d));
+    if (at >= size)
+        return false;
+    d.op = p[0];
+    d.jump_pos = -1;
+    d.table_pos = -1;
+    d.falls_through = true;
+
+    // the smallest size that lets the operands below be read
+    auto need = [&](size_t n) { return n <= avail; };
+    if (!need(2) && d.op != CMD_LEAVE)
+        return false;
+
+    switch (d.op) {
+    case CMD_FD:
+        if (!need(5) || !need(5 + u32(1) + 16))
+            return false;
+        d.size = 5 + u32(1) + 16;
+        return true;
+
+    case CMD_GG:
+    case CMD_SG:
+    case CMD_CSS: {
+        if (!need(5) || !need(6 + u32(1)))
+            return false;
+        const unsigned pos = 5 + u32(1);
+        d.size = pos + 1;
+        if (d.op == CMD_SG)
+            decoded_use(d, p[pos], pos);
+        else
+            decoded_def(d, p[pos], pos);
+        d.pure = d.op != CMD_SG;
+        return true;
+    }
+
+    case CMD_LD8: case CMD_LD16: case CMD_LD32: case CMD_LD64:
+        // ld <0> <R1> <R2> | ld <1> <R1> <ptr:u64>
+        d.size = p[1] ? 11 : 4;
+        if (!need(d.size))
+            return false;
+        decoded_def(d, p[2], 2);
+        if (!p[1])
+            decoded_use(d, p[3], 3);
+        d.pure = true;
+        return true;
+
+    case CMD_ST8: case CMD_ST16: case CMD_ST32: case CMD_ST64:
+        // st <0> <R1> <R2> | st <1> <ptr:u64> <R2>
+        d.size = p[1] ? 11 : 4;
+        if (!need(d.size))
+            return false;
+        if (p[1])
+            decoded_use(d, p[10], 10);
+        else {
+            decoded_use(d, p[2], 2);
+            decoded_use(d, p[3], 3);
+        }
+        return true;
+
+    case CMD_LDX8: case CMD_LDX16: case CMD_LDX32: case CMD_LDX64:
+        // ldx <R1> <Base> <Index> <Shift:u8> <Disp:u64>
+        d.size = 13;
+        if (!need(d.size))
+            return false;
+        decoded_def(d, p[1], 1);
+        if (!(p[4] & BASE_NONE))
+            decoded_use(d, p[2], 2);
+        if (!(p[4] & INDEX_NONE))
+            decoded_use(d, p[3], 3);
+        d.pure = true;
+        return true;
+
+    case CMD_STX8: case CMD_STX16: case CMD_STX32: case CMD_STX64:
+        // stx <Base> <Index> <Shift:u8> <Disp:u64> <R>
+        d.size = 13;
+        if (!need(d.size))
+            return false;
+        if (!(p[3] & BASE_NONE))
+            decoded_use(d, p[1], 1);
+        if (!(p[3] & INDEX_NONE))
+            decoded_use(d, p[2], 2);
+        decoded_use(d, p[12], 12);
+        return true;
+
+    case CMD_RET:
+        d.size = p[1] ? 10 : 3;
+        if (!need(d.size))
+            return false;
+        if (!p[1])
+            decoded_use(d, p[2], 2);
+        d.falls_through = false;
+        return true;
+
+    case CMD_LEAVE:
+        d.size = 1;
+        d.falls_through = false;
+        return true;
+
+    case CMD_LEA:
+    case CMD_CSS_DYN:
+    case CMD_ZEXT8: case CMD_ZEXT16: case CMD_ZEXT32:
+    case CMD_SEXT8: case CMD_SEXT16: case CMD_SEXT32:
+        d.size = 3;
+        if (!need(d.size))
+            return false;
+        decoded_def(d, p[1], 1);
+        decoded_use(d, p[2], 2);
+        d.pure = true;
+        return true;
+
+    case CMD_INEG:
+        d.size = 2;
+        decoded_def(d, p[1], 1);
+        decoded_use(d, p[1], 1);
+        d.pure = true;
+        return true;
+
+    case CMD_JMP:
+        d.size = 9;
+        d.jump_pos = 1;
+        d.falls_through = false;
+        return need(d.size);
+
+    case CMD_JZ:
+    case CMD_JNZ:
+        d.size = 10;
+        if (!need(d.size))
+            return false;
+        decoded_use(d, p[1], 1);
+        d.jump_pos = 2;
+        return true;
+
+    case CMD_DATA:
+        // data <Size:u64> <ReadOnly:u64> <Init:u64> <bytes>
+        if (!need(25) || u64(17) > UINT32_MAX - 25 || !need(25 + u64(17)))
+            return false;
+        d.size = 25 + u64(17);
+        return true;
+
+    case CMD_PROF: {
+        // prof <Func:string> <Origin:string> <Blocks:u32> <Count:u32> (<Off:u32> <Block:u32> <Succ:u8>)...
+        if (!need(5) || !need(9 + uint64_t(u32(1))))
+            return false;
+        const uint64_t origin = 5 + uint64_t(u32(1));
+        if (!need(origin + 12 + u32(origin)))
+            return false;
+        const uint64_t count = origin + 8 + u32(origin);
+        if (!need(count + 4 + uint64_t(u32(count)) * 9))
+            return false;
+        d.size = count + 4 + u32(count) * 9;
+        return true;
+    }
+
+    case CMD_JTAB:
+        // jtab <Reg> <Min:u64> <Count:u32> <Off>...; falls through when out of range
+        if (!need(14) || !need(14 + uint64_t(u32(10)) * 8))
+            return false;
+        d.table_pos = 14;
+        d.table_count = u32(10);
+        d.size = 14 + d.table_count * 8;
+        decoded_use(d, p[1], 1);
+        return true;
+
+    case CMD_CALL0: case CMD_CALL1: case CMD_CALL2: case CMD_CALL3: case CMD_CALL4:
+    case CMD_CALL5: case CMD_CALL6: case CMD_CALL7: case CMD_CALL8:
+    case CMD_TAILCALL0: case CMD_TAILCALL1: case CMD_TAILCALL2: case CMD_TAILCALL3: case CMD_TAILCALL4:
+    case CMD_TAILCALL5: case CMD_TAILCALL6: case CMD_TAILCALL7: case CMD_TAILCALL8: {
+        const bool tail = d.op >= CMD_TAILCALL0;
+        const unsigned n = d.op - (tail ? CMD_TAILCALL0 : CMD_CALL0);
+        d.size = 2 + n;
+        if (!need(d.size))
+            return false;
+        decoded_use(d, p[1], 1);
+        for (unsigned k = 0; k < n; ++k)
+            decoded_use(d, p[2 + k], 2 + k);
+        if (tail)
+            d.falls_through = false;
+        else
+            decoded_def(d, p[1], 1);
+        return true;
+    }
+
+    case CMD_STACKSAVE:
+        d.size = 2;
+        decoded_def(d, p[1], 1);
+        return true;
+
+    case CMD_STACKRESTORE:
+        d.size = 2;
+        decoded_use(d, p[1], 1);
+        return true;
+
+    case CMD_FRAME:
+        d.size = 5;
+        return need(d.size);
+
+    case CMD_SPILL:
+        d.size = 6;
+        if (!need(d.size))
+            return false;
+        decoded_use(d, p[5], 5);
+        return true;
+
+    case CMD_RELOAD:
+        d.size = 6;
+        if (!need(d.size))
+            return false;
+        decoded_def(d, p[1], 1);
+        d.pure = true;
+        return true;
+
+    case CMD_MEMCPY:
+    case CMD_MEMMOVE:
+    case CMD_MEMSET:
+        d.size = 4;
+        if (!need(d.size))
+            return false;
+        for (unsigned k = 1; k <= 3; ++k)
+            decoded_use(d, p[k], k);
+        return true;
+
+    case CMD_VBIN: case CMD_VCMP: case CMD_VSEL: case CMD_VCVT:
+        d.size = 7;
+        d.opaque = true;
+        return need(d.size);
+    case CMD_VSHUF:
+        d.size = need(3) ? 7 + p[2] : 0;
+        d.opaque = true;
+        return d.size && need(d.size);
+    case CMD_VLD: case CMD_VST:
+        d.size = 4;
+        d.opaque = true;
+        return need(d.size);
+    case CMD_VINS: case CMD_VEXT:
+        d.size = 6;
+        d.opaque = true;
+        return need(d.size);
+
+    default:
+        break;
+    }
+
+    if (d.op >= CMD_BEQ && d.op <= CMD_BSGE32) {
+        // b<cc> <0|1> <R1> <R2|u64> <Off>
+        d.size = p[1] ? 19 : 12;
+        if (!need(d.size))
+            return false;
+        decoded_use(d, p[2], 2);
+        if (!p[1])
+            decoded_use(d, p[3], 3);
+        d.jump_pos = d.size - 8;
+        return true;
+    }
+
+    if (!has_val_operand(d.op) || d.op >= __CMD_LAST__)
+        return false;
+
+    // <op> <mode> <R1> [<R2>] <Reg|u64>
+    const unsigned char mode = p[1];
+    const unsigned val_pos = (mode & MODE_REG3) ? 4 : 3;
+    d.size = val_pos + ((mode & MODE_CONST) ? 8 : 1);
+    if (mode > MODE_CONST3 || !need(d.size))
+        return false;
+    decoded_def(d, p[2], 2);
+    // mov and alloca ignore the first operand
+    if (d.op != CMD_MOV && d.op != CMD_ALLOCA) {
+        if (mode & MODE_REG3)
+            decoded_use(d, p[3], 3);
+        else
+            decoded_use(d, p[2], 2);
+    }
+    if (!(mode & MODE_CONST))
+        decoded_use(d, p[val_pos], val_pos);
+    d.pure = d.op != CMD_ALLOCA;
+    return true;
+}
+
+#endif
@@ -1,83 +1,14 @@
 #include <tuple>
 #include <array>
+#include <string>
+#include <stdint.h>
 #include <string.h>
 
 #include "opcode.h"
+#include "opinfo.h"
 #include "reader.h"
 
 
-static std::array<const char*, __CMD_LAST__> opcode_names = {};
-
-static void init_opcode_names() {
-// this is auto-generated
-    opcode_names[CMD_FD] = "fd";
-    opcode_names[CMD_MOV] = "mov";
-    opcode_names[CMD_GG] = "gg";
-    opcode_names[CMD_SG] = "sg";
-    opcode_names[CMD_CSS] = "css";
-    opcode_names[CMD_LD8] = "ld8";
-    opcode_names[CMD_LD16] = "ld16";
-    opcode_names[CMD_LD32] = "ld32";
-    opcode_names[CMD_LD64] = "ld64";
-    opcode_names[CMD_ST8] = "st8";
-    opcode_names[CMD_ST16] = "st16";
-    opcode_names[CMD_ST32] = "st32";
-    opcode_names[CMD_ST64] = "st64";
-    opcode_names[CMD_LEA] = "lea";
-    opcode_names[CMD_IADD] = "iadd";
-    opcode_names[CMD_ISUB] = "isub";
-    opcode_names[CMD_SMUL] = "smul";
-    opcode_names[CMD_UMUL] = "umul";
-    opcode_names[CMD_SREM] = "srem";
-    opcode_names[CMD_UREM] = "urem";
-    opcode_names[CMD_SDIV] = "sdiv";
-    opcode_names[CMD_UDIV] = "udiv";
-    opcode_names[CMD_AND] = "and";
-    opcode_names[CMD_OR] = "or";
-    opcode_names[CMD_XOR] = "xor";
-    opcode_names[CMD_SHL] = "shl";
-    opcode_names[CMD_LSHR] = "lshr";
-    opcode_names[CMD_ASHR] = "ashr";
-    opcode_names[CMD_INEG] = "ineg";
-    opcode_names[CMD_FADD] = "fadd";
-    opcode_names[CMD_FSUB] = "fsub";
-    opcode_names[CMD_FMUL] = "fmul";
-    opcode_names[CMD_FDIV] = "fdiv";
-    opcode_names[CMD_FREM] = "frem";
-    opcode_names[CMD_EQ] = "eq";
-    opcode_names[CMD_NE] = "ne";
-    opcode_names[CMD_SLT] = "slt";
-    opcode_names[CMD_SLE] = "sle";
-    opcode_names[CMD_SGT] = "sgt";
-    opcode_names[CMD_SGE] = "sge";
-    opcode_names[CMD_ULT] = "ult";
-    opcode_names[CMD_ULE] = "ule";
-    opcode_names[CMD_UGT] = "ugt";
-    opcode_names[CMD_UGE] = "uge";
-    opcode_names[CMD_FEQ] = "feq";
-    opcode_names[CMD_FNE] = "fne";
-    opcode_names[CMD_FLT] = "flt";
-    opcode_names[CMD_FLE] = "fle";
-    opcode_names[CMD_FGT] = "fgt";
-    opcode_names[CMD_FGE] = "fge";
-    opcode_names[CMD_JMP] = "jmp";
-    opcode_names[CMD_JNZ] = "jnz";
-    opcode_names[CMD_JZ] = "jz";
-    opcode_names[CMD_CALL0] = "call0";
-    opcode_names[CMD_CALL1] = "call1";
-    opcode_names[CMD_CALL2] = "call2";
-    opcode_names[CMD_CALL3] = "call3";
-    opcode_names[CMD_CALL4] = "call4";
-    opcode_names[CMD_CALL5] = "call5";
-    opcode_names[CMD_CALL6] = "call6";
-    opcode_names[CMD_CALL7] = "call7";
-    opcode_names[CMD_CALL8] = "call8";
-    opcode_names[CMD_RET] = "ret";
-    opcode_names[CMD_LEAVE] = "leave";
-    opcode_names[CMD_CSS_DYN] = "css_dyn";
-// 
-}
-
 template <typename T>
 void st(const char* bytecode, unsigned& i) {
     auto has_const = *(unsigned char*)(bytecode + i++);
@@ -117,6 +48,63 @@ void ld(const char* bytecode, unsigned& i) {
 }
 
 
+// <Base> <Index> <Shift:u8> <Disp:u64>
+static void indexed_address(const char* bytecode, unsigned& i) {
+    auto base = *(unsigned char*)(bytecode + i++);
+    auto index = *(unsigned char*)(bytecode + i++);
+    auto shift = *(unsigned char*)(bytecode + i++);
+    auto disp = *(int64_t*)(bytecode + i);
+    i += sizeof(int64_t);
+    printf("[");
+    if (!(shift & BASE_NONE))
+        printf("R%d + ", (int) base);
+    if (!(shift & INDEX_NONE))
+        printf("R%d << %d + ", (int) index, shift & 63);
+    printf("%lld]", (long long) disp);
+}
+
+template <typename T>
+void ldx(const char* bytecode, unsigned& i) {
+    auto r1 = *(unsigned char*)(bytecode + i++);
+    printf("ldx%d R%d, ", (int) sizeof(T) * 8, (int) r1);
+    indexed_address(bytecode, i);
+    printf("\n");
+}
+
+template <typename T>
+void stx(const char* bytecode, unsigned& i) {
+    printf("stx%d ", (int) sizeof(T) * 8);
+    indexed_address(bytecode, i);
+    auto r = *(unsigned char*)(bytecode + i++);
+    printf(", R%d\n", (int) r);
+}
+
+
+static void print_const(int64_t value) { printf("%d", (int) value); }
+static void print_const(uint64_t value) { printf("%d", (int) value); }
+static void print_const(double value) { printf("%f", value); }
+
+// <op> <Reg> <Val>, printed as "op R1, R2|const" or, in the three-address
+// modes, "op R1, R2, R3|const"
+template <typename T>
+void val_instruction(unsigned char command, const char* bytecode, unsigned& i) {
+    auto mode = *(unsigned char*)(bytecode + i++);
+    auto r1 = *(unsigned char*)(bytecode + i++);
+
+    printf("%s R%d, ", opcode_names[command], (int) r1);
+    if (mode & MODE_REG3)
+        printf("R%d, ", (int) *(unsigned char*)(bytecode + i++));
+
+    if (mode & MODE_CONST) {
+        print_const(*(T*)(bytecode + i));
+        i += sizeof(T);
+    }
+    else
+        printf("R%d", (int) *(unsigned char*)(bytecode + i++));
+    printf("\n");
+}
+
+
 int main(int argc, char** argv) {
     init_opcode_names();
     const char* bytecode = nullptr;
@@ -226,12 +214,31 @@ int main(int argc, char** argv) {
                 st<uint64_t>(bytecode, i);
                 break;
             }
+            case CMD_LDX8: ldx<uint8_t>(bytecode, i); break;
+            case CMD_LDX16: ldx<uint16_t>(bytecode, i); break;
+            case CMD_LDX32: ldx<uint32_t>(bytecode, i); break;
+            case CMD_LDX64: ldx<uint64_t>(bytecode, i); break;
+            case CMD_STX8: stx<uint8_t>(bytecode, i); break;
+            case CMD_STX16: stx<uint16_t>(bytecode, i); break;
+            case CMD_STX32: stx<uint32_t>(bytecode, i); break;
+            case CMD_STX64: stx<uint64_t>(bytecode, i); break;
             case CMD_LEA: {
                 auto r1 = *(unsigned char*)(bytecode + i++);
                 auto r2 = *(unsigned char*)(bytecode + i++);
                 printf("lea R%d, R%d\n", (int) r1, (int) r2);
                 break;
             }
+            case CMD_ZEXT8:
+            case CMD_ZEXT16:
+            case CMD_ZEXT32:
+            case CMD_SEXT8:
+            case CMD_SEXT16:
+            case CMD_SEXT32: {
+                auto r1 = *(unsigned char*)(bytecode + i++);
+                auto r2 = *(unsigned char*)(bytecode + i++);
+                printf("%s R%d, R%d\n", opcode_names[command], (int) r1, (int) r2);
+                break;
+            }
 // integer arithmetic
             case CMD_INEG: {
                 auto r = *(unsigned char*)(bytecode + i++);
@@ -246,19 +253,17 @@ int main(int argc, char** argv) {
             case CMD_SLT:
             case CMD_SLE:
             case CMD_SGT:
-            case CMD_SGE: {
-                auto has_const = *(unsigned char*)(bytecode + i++);
-                auto r1 = *(unsigned char*)(bytecode + i++);
-
-                if (has_const) {
-                    auto value = *(int64_t*)(bytecode + i);
-                    printf("%s R%d, %d\n", opcode_names[command], (int) r1, (int) value);
-                    i += sizeof(int64_t);
-                }
-                else {
-                    auto r2 = *(unsigned char*)(bytecode + i++);
-                    printf("%s R%d, R%d\n", opcode_names[command], (int) r1, (int) r2);
-                }
+            case CMD_SGE:
+            case CMD_IADD32:
+            case CMD_ISUB32:
+            case CMD_IMUL32:
+            case CMD_SREM32:
+            case CMD_SDIV32:
+            case CMD_SLT32:
+            case CMD_SLE32:
+            case CMD_SGT32:
+            case CMD_SGE32: {
+                val_instruction<int64_t>(command, bytecode, i);
                 break;
             }
             case CMD_MOV:
@@ -269,40 +274,17 @@ int main(int argc, char** argv) {
             case CMD_AND:
             case CMD_XOR:
             case CMD_SHL:
+            case CMD_LSHR:
             case CMD_ASHR:
+            case CMD_SHL32:
+            case CMD_ASHR32:
             case CMD_EQ:
             case CMD_NE:
             case CMD_ULT:
             case CMD_ULE:
             case CMD_UGT:
             case CMD_UGE: {
-                auto has_const = *(unsigned char*)(bytecode + i++);
-                auto r1 = *(unsigned char*)(bytecode + i++);
-
-                if (has_const) {
-                    auto value = *(uint64_t*)(bytecode + i);
-                    printf("%s R%d, %d\n", opcode_names[command], (int) r1, (int) value);
-                    i += sizeof(uint64_t); 
-                }
-                else {
-                    auto r2 = *(unsigned char*)(bytecode + i++);
-                    printf("%s R%d, R%d\n", opcode_names[command], (int) r1, (int) r2);
-                }
-                break;
-            }
-            case CMD_LSHR:  {
-                auto has_const = *(unsigned char*)(bytecode + i++);
-                auto r1 = *(unsigned char*)(bytecode + i++);
-
-                if (has_const) {
-                    auto value = *(int32_t*)(bytecode + i);
-                    printf("%s R%d, %d\n", opcode_names[command], (int) r1, (int) value);
-                    i += sizeof(int32_t);
-                }
-                else {
-                    auto r2 = *(unsigned char*)(bytecode + i++);
-                    printf("%s R%d, R%d\n", opcode_names[command], (int) r1, (int) r2);
-                }
+                val_instruction<uint64_t>(command, bytecode, i);
                 break;
             }
             case CMD_FADD:
@@ -316,18 +298,7 @@ int main(int argc, char** argv) {
             case CMD_FLE:
             case CMD_FGT:
             case CMD_FGE: {
-                auto has_const = *(unsigned char*)(bytecode + i++);
-                auto r1 = *(unsigned char*)(bytecode + i++);
-
-                if (has_const) {
-                    auto value = *(double*)(bytecode + i);
-                    printf("%s R%d, %f\n", opcode_names[command], (int) r1, (double) value);
-                    i += sizeof(double);
-                }
-                else {
-                    auto r2 = *(unsigned char*)(bytecode + i++);
-                    printf("%s R%d, R%d\n", opcode_names[command], (int) r1, (int) r2);
-                }
+                val_instruction<double>(command, bytecode, i);
                 break;
             }
 // jumps
@@ -351,6 +322,83 @@ int main(int argc, char** argv) {
                 i += sizeof(int64_t);
                 break;
             }
+            case CMD_BEQ:
+            case CMD_BNE:
+            case CMD_BSLT:
+            case CMD_BSLE:
+            case CMD_BSGT:
+            case CMD_BSGE:
+            case CMD_BULT:
+            case CMD_BULE:
+            case CMD_BUGT:
+            case CMD_BUGE:
+            case CMD_BSLT32:
+            case CMD_BSLE32:
+            case CMD_BSGT32:
+            case CMD_BSGE32: {
+                auto has_const = *(unsigned char*)(bytecode + i++);
+                auto r1 = *(unsigned char*)(bytecode + i++);
+
+                if (has_const) {
+                    auto value = *(int64_t*)(bytecode + i);
+                    i += sizeof(int64_t);
+                    printf("%s R%d, %lld", opcode_names[command], (int) r1, (long long) value);
+                }
+                else {
+                    auto r2 = *(unsigned char*)(bytecode + i++);
+                    printf("%s R%d, R%d", opcode_names[command], (int) r1, (int) r2);
+                }
+                auto offset = *(int64_t*)(bytecode + i);
+                printf(", %d\n", (int) offset);
+                i += sizeof(int64_t);
+                break;
+            }
+            case CMD_DATA: {
+                auto size = *(uint64_t*)(bytecode + i);
+                i += sizeof(uint64_t);
+                auto readonly = *(uint64_t*)(bytecode + i);
+                i += sizeof(uint64_t);
+                auto init = *(uint64_t*)(bytecode + i);
+                i += sizeof(uint64_t);
+                printf("data %llu, %llu, %llu\n", (unsigned long long) size, (unsigned long long) readonly,
+                       (unsigned long long) init);
+                i += init;
+                break;
+            }
+            case CMD_PROF: {
+                auto len = *(uint32_t*)(bytecode + i);
+                i += sizeof(uint32_t);
+                printf("prof \"%.*s\", ", (int) len, bytecode + i);
+                i += len;
+                len = *(uint32_t*)(bytecode + i);
+                i += sizeof(uint32_t);
+                printf("\"%.*s\", ", (int) len, bytecode + i);
+                i += len;
+                auto blocks = *(uint32_t*)(bytecode + i);
+                i += sizeof(uint32_t);
+                auto count = *(uint32_t*)(bytecode + i);
+                i += sizeof(uint32_t);
+                printf("%u:", blocks);
+                for (uint32_t k = 0; k < count; ++k, i += 9)
+                    printf(" %u->%u/%d", *(uint32_t*)(bytecode + i), *(uint32_t*)(bytecode + i + 4),
+                           (int) bytecode[i + 8]);
+                printf("\n");
+                break;
+            }
+            case CMD_JTAB: {
+                auto r = *(unsigned char*)(bytecode + i++);
+                auto min = *(uint64_t*)(bytecode + i);
+                i += sizeof(uint64_t);
+                auto count = *(uint32_t*)(bytecode + i);
+                i += sizeof(uint32_t);
+                printf("jtab R%d, %llu, %u:", (int) r, (unsigned long long) min, count);
+                for (uint32_t k = 0; k < count; ++k) {
+                    printf(" %d", (int) *(int64_t*)(bytecode + i));
+                    i += sizeof(int64_t);
+                }
+                printf("\n");
+                break;
+            }
 // call
             case CMD_CALL0:
             case CMD_CALL1:
@@ -360,10 +408,20 @@ int main(int argc, char** argv) {
             case CMD_CALL5:
             case CMD_CALL6:
             case CMD_CALL7:
-            case CMD_CALL8: {
+            case CMD_CALL8:
+            case CMD_TAILCALL0:
+            case CMD_TAILCALL1:
+            case CMD_TAILCALL2:
+            case CMD_TAILCALL3:
+            case CMD_TAILCALL4:
+            case CMD_TAILCALL5:
+            case CMD_TAILCALL6:
+            case CMD_TAILCALL7:
+            case CMD_TAILCALL8: {
                 auto r = *(unsigned char*)(bytecode + i++);
-                uint64_t n = command - CMD_CALL0;
-                printf("call%d R%d", (int) n, (int) r);
+                bool tail = command >= CMD_TAILCALL0;
+                uint64_t n = command - (tail ? CMD_TAILCALL0 : CMD_CALL0);
+                printf("%scall%d R%d", tail ? "tail" : "", (int) n, (int) r);
                 for (int j = 0; j < (int) n; ++j)
                     printf(", R%d", (int) bytecode[i + j]);
                 printf("\n");
@@ -389,6 +447,124 @@ int main(int argc, char** argv) {
                 printf("leave\n");
                 break;
             }
+// guest stack
+            case CMD_ALLOCA: {
+                auto has_const = *(unsigned char*)(bytecode + i++);
+                auto r1 = *(unsigned char*)(bytecode + i++);
+
+                if (has_const) {
+                    auto value = *(uint64_t*)(bytecode + i);
+                    printf("alloca R%d, %d\n", (int) r1, (int) value);
+                    i += sizeof(uint64_t);
+                }
+                else {
+                    auto r2 = *(unsigned char*)(bytecode + i++);
+                    printf("alloca R%d, R%d\n", (int) r1, (int) r2);
+                }
+                break;
+            }
+            case CMD_STACKSAVE:
+            case CMD_STACKRESTORE: {
+                auto r = *(unsigned char*)(bytecode + i++);
+                printf("%s R%d\n", opcode_names[command], (int) r);
+                break;
+            }
+            case CMD_FRAME: {
+                auto n = *(uint32_t*)(bytecode + i);
+                i += sizeof(uint32_t);
+                printf("frame %u\n", n);
+                break;
+            }
+            case CMD_SPILL: {
+                auto slot = *(uint32_t*)(bytecode + i);
+                i += sizeof(uint32_t);
+                auto r = *(unsigned char*)(bytecode + i++);
+                printf("spill S%u, R%d\n", slot, (int) r);
+                break;
+            }
+            case CMD_RELOAD: {
+                auto r = *(unsigned char*)(bytecode + i++);
+                auto slot = *(uint32_t*)(bytecode + i);
+                i += sizeof(uint32_t);
+                printf("reload R%d, S%u\n", (int) r, slot);
+                break;
+            }
+            case CMD_MEMCPY:
+            case CMD_MEMMOVE:
+            case CMD_MEMSET: {
+                auto r1 = *(unsigned char*)(bytecode + i++);
+                auto r2 = *(unsigned char*)(bytecode + i++);
+                auto r3 = *(unsigned char*)(bytecode + i++);
+                printf("%s R%d, R%d, R%d\n", opcode_names[command], (int) r1, (int) r2, (int) r3);
+                break;
+            }
+            case CMD_VBIN:
+            case CMD_VCMP: {
+                auto op = *(unsigned char*)(bytecode + i++);
+                auto type = *(unsigned char*)(bytecode + i++);
+                auto lanes = *(unsigned char*)(bytecode + i++);
+                auto rd = *(unsigned char*)(bytecode + i++);
+                auto ra = *(unsigned char*)(bytecode + i++);
+                auto rb = *(unsigned char*)(bytecode + i++);
+                printf("%s %s <%d x %s> R%d, R%d, R%d\n", opcode_names[command], vector_op_names[op],
+                       (int) lanes, vector_type_names[type], (int) rd, (int) ra, (int) rb);
+                break;
+            }
+            case CMD_VSEL: {
+                auto type = *(unsigned char*)(bytecode + i++);
+                auto lanes = *(unsigned char*)(bytecode + i++);
+                auto rd = *(unsigned char*)(bytecode + i++);
+                auto rm = *(unsigned char*)(bytecode + i++);
+                auto ra = *(unsigned char*)(bytecode + i++);
+                auto rb = *(unsigned char*)(bytecode + i++);
+                printf("vsel <%d x %s> R%d, R%d, R%d, R%d\n", (int) lanes, vector_type_names[type],
+                       (int) rd, (int) rm, (int) ra, (int) rb);
+                break;
+            }
+            case CMD_VSHUF: {
+                auto type = *(unsigned char*)(bytecode + i++);
+                auto lanes = *(unsigned char*)(bytecode + i++);
+                auto in_lanes = *(unsigned char*)(bytecode + i++);
+                auto rd = *(unsigned char*)(bytecode + i++);
+                auto ra = *(unsigned char*)(bytecode + i++);
+                auto rb = *(unsigned char*)(bytecode + i++);
+                printf("vshuf <%d x %s> R%d, <%d x %s> R%d, R%d, [", (int) lanes, vector_type_names[type], (int) rd,
+                       (int) in_lanes, vector_type_names[type], (int) ra, (int) rb);
+                for (int k = 0; k < lanes; ++k)
+                    printf(k ? " %d" : "%d", (int) *(unsigned char*)(bytecode + i++));
+                printf("]\n");
+                break;
+            }
+            case CMD_VLD:
+            case CMD_VST: {
+                auto bytes = *(unsigned char*)(bytecode + i++);
+                auto r1 = *(unsigned char*)(bytecode + i++);
+                auto r2 = *(unsigned char*)(bytecode + i++);
+                printf("%s %d R%d, R%d\n", opcode_names[command], (int) bytes, (int) r1, (int) r2);
+                break;
+            }
+            case CMD_VINS:
+            case CMD_VEXT: {
+                auto type = *(unsigned char*)(bytecode + i++);
+                auto lanes = *(unsigned char*)(bytecode + i++);
+                auto rd = *(unsigned char*)(bytecode + i++);
+                auto rs = *(unsigned char*)(bytecode + i++);
+                auto ridx = *(unsigned char*)(bytecode + i++);
+                printf("%s <%d x %s> R%d, R%d, R%d\n", opcode_names[command], (int) lanes, vector_type_names[type],
+                       (int) rd, (int) rs, (int) ridx);
+                break;
+            }
+            case CMD_VCVT: {
+                auto op = *(unsigned char*)(bytecode + i++);
+                auto from = *(unsigned char*)(bytecode + i++);
+                auto to = *(unsigned char*)(bytecode + i++);
+                auto lanes = *(unsigned char*)(bytecode + i++);
+                auto rd = *(unsigned char*)(bytecode + i++);
+                auto rs = *(unsigned char*)(bytecode + i++);
+                printf("vcvt %s <%d x %s> R%d, <%d x %s> R%d\n", vector_op_names[op], (int) lanes, vector_type_names[to],
+                       (int) rd, (int) lanes, vector_type_names[from], (int) rs);
+                break;
+            }
             default:
                  //printf("REG[0] = %d\n", (int32_t)REG[0]);
                 fprintf(stderr, "wrong command\n");
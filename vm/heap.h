@@ -0,0 +1,135 @@
+#ifndef heap_h_
+#define heap_h_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// Guest heap: backs the malloc/calloc/realloc/free natives.
+//
+// Every VM instance reserves one contiguous address range and carves blocks
+// out of it with a bump pointer.  Freed blocks are kept on per-size-class
+// free lists: multiples of 16 bytes up to 256, then powers of two.  Each block
+// is preceded by a 16-byte header holding its class, so that payloads stay
+// 16-byte aligned like the host malloc's.  Nothing is ever returned to the
+// host.
+
+struct GuestHeap
+{
+    enum {
+        HEADER = 16,
+        NSMALL = 16,            // 16, 32, ..., 256
+        NCLASSES = NSMALL + 40, // 512, 1024, ..., 2^48
+    };
+
+    char *base = nullptr;
+    char *top = nullptr;
+    char *limit = nullptr;
+    // memory at and above this address has never been handed out, so it is
+    // still zero-filled from mmap()
+    char *clean = nullptr;
+    void *free_lists[NCLASSES] = {};
+
+    size_t reserve = size_t(1) << 32;
+};
+
+static GuestHeap guest_heap;
+
+static inline void guest_heap_init() {
+    void *p = mmap(nullptr, guest_heap.reserve, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("cannot reserve the guest heap");
+        exit(1);
+    }
+    guest_heap.base = guest_heap.top = guest_heap.clean = static_cast<char *>(p);
+    guest_heap.limit = guest_heap.base + guest_heap.reserve;
+}
+
+static inline unsigned guest_heap_class(uint64_t n) {
+    if (n <= 16 * GuestHeap::NSMALL)
+        return n ? (n - 1) / 16 : 0;
+    // round up to the next power of two; 2^9 is the first large class
+    unsigned log2 = 64 - __builtin_clzll(n - 1);
+    return GuestHeap::NSMALL + log2 - 9;
+}
+
+static inline uint64_t guest_heap_class_size(unsigned c) {
+    if (c < GuestHeap::NSMALL)
+        return 16 * (c + 1);
+    return uint64_t(1) << (c - GuestHeap::NSMALL + 9);
+}
+
+static inline uint64_t *guest_heap_header(void *p) {
+    return reinterpret_cast<uint64_t *>(static_cast<char *>(p) - GuestHeap::HEADER);
+}
+
+static inline bool guest_heap_owns(void *p) {
+    return static_cast<char *>(p) > guest_heap.base && static_cast<char *>(p) < guest_heap.top;
+}
+
+static inline void *guest_malloc(uint64_t n, bool zero = false) {
+    if (n > guest_heap.reserve)
+        return nullptr;
+    const unsigned c = guest_heap_class(n);
+    const uint64_t size = guest_heap_class_size(c);
+
+    void *p = guest_heap.free_lists[c];
+    if (p) {
+        guest_heap.free_lists[c] = *static_cast<void **>(p);
+        if (zero)
+            memset(p, 0, size);
+        return p;
+    }
+
+    if (uint64_t(guest_heap.limit - guest_heap.top) < GuestHeap::HEADER + size)
+        return nullptr;
+    char *block = guest_heap.top;
+    guest_heap.top += GuestHeap::HEADER + size;
+    p = block + GuestHeap::HEADER;
+    if (zero && block < guest_heap.clean)
+        memset(p, 0, size);
+    if (guest_heap.top > guest_heap.clean)
+        guest_heap.clean = guest_heap.top;
+    *guest_heap_header(p) = c;
+    return p;
+}
+
+static inline void guest_free(void *p) {
+    if (!p || !guest_heap_owns(p))
+        return;
+    const uint64_t c = *guest_heap_header(p);
+    *static_cast<void **>(p) = guest_heap.free_lists[c];
+    guest_heap.free_lists[c] = p;
+}
+
+static inline void *guest_calloc(uint64_t n, uint64_t size) {
+    uint64_t total;
+    if (__builtin_mul_overflow(n, size, &total))
+        return nullptr;
+    return guest_malloc(total, true);
+}
+
+static inline void *guest_realloc(void *p, uint64_t n) {
+    if (!p)
+        return guest_malloc(n);
+    if (!guest_heap_owns(p))
+        return nullptr;
+    if (!n) {
+        guest_free(p);
+        return nullptr;
+    }
+    const uint64_t old_size = guest_heap_class_size(*guest_heap_header(p));
+    if (n <= old_size)
+        return p;
+    void *q = guest_malloc(n);
+    if (q) {
+        memcpy(q, p, old_size);
+        guest_free(p);
+    }
+    return q;
+}
+
+#endif
@@ -81,8 +81,177 @@ enum Commands : unsigned char {
 
     CMD_CSS_DYN,
 
+    CMD_ALLOCA,
+    CMD_STACKSAVE,
+    CMD_STACKRESTORE,
+
+    CMD_TAILCALL0,
+    CMD_TAILCALL1,
+    CMD_TAILCALL2,
+    CMD_TAILCALL3,
+    CMD_TAILCALL4,
+    CMD_TAILCALL5,
+    CMD_TAILCALL6,
+    CMD_TAILCALL7,
+    CMD_TAILCALL8,
+
+    CMD_MEMCPY,
+    CMD_MEMMOVE,
+    CMD_MEMSET,
+
+    CMD_VBIN,
+    CMD_VCMP,
+    CMD_VSEL,
+    CMD_VSHUF,
+    CMD_VLD,
+    CMD_VST,
+    CMD_VINS,
+    CMD_VEXT,
+    CMD_VCVT,
+
+    CMD_IADD32,
+    CMD_ISUB32,
+    CMD_IMUL32,
+    CMD_SHL32,
+    CMD_ASHR32,
+    CMD_SDIV32,
+    CMD_SREM32,
+    CMD_SLT32,
+    CMD_SLE32,
+    CMD_SGT32,
+    CMD_SGE32,
+    CMD_ZEXT8,
+    CMD_ZEXT16,
+    CMD_ZEXT32,
+    CMD_SEXT8,
+    CMD_SEXT16,
+    CMD_SEXT32,
+
+    CMD_BEQ,
+    CMD_BNE,
+    CMD_BSLT,
+    CMD_BSLE,
+    CMD_BSGT,
+    CMD_BSGE,
+    CMD_BULT,
+    CMD_BULE,
+    CMD_BUGT,
+    CMD_BUGE,
+    CMD_BSLT32,
+    CMD_BSLE32,
+    CMD_BSGT32,
+    CMD_BSGE32,
+
+    CMD_FRAME,
+    CMD_SPILL,
+    CMD_RELOAD,
+
+    CMD_JTAB,
+
+    CMD_DATA,
+
+    CMD_LDX8,
+    CMD_LDX16,
+    CMD_LDX32,
+    CMD_LDX64,
+    CMD_STX8,
+    CMD_STX16,
+    CMD_STX32,
+    CMD_STX64,
+
+    CMD_PROF,
 
     __CMD_LAST__
 };
 
+// Guest address the data segment (the module's globals) is mapped at, so
+// that the backend can address globals with constants.
+#define DATA_SEGMENT_BASE 0x10000000000ull
+
+// The <Shift> byte of an ldx/stx address: the shift count in the low six
+// bits, and flags for an address without an index or a base register.
+#define INDEX_NONE 0x40
+#define BASE_NONE 0x80
+
+// The mode byte that starts a <Val> operand.  The three-address modes exist
+// for the instructions that compute <Reg> = <Reg> op <Val>: arithmetic,
+// bitwise, shifts and comparisons.
+enum OperandModes : unsigned char {
+    MODE_REG,       // <Reg1> <Reg2>            Reg1 = Reg1 op Reg2
+    MODE_CONST,     // <Reg1> <Const:u64>       Reg1 = Reg1 op Const
+    MODE_REG3,      // <Reg1> <Reg2> <Reg3>     Reg1 = Reg2 op Reg3
+    MODE_CONST3,    // <Reg1> <Reg2> <Const:u64> Reg1 = Reg2 op Const
+};
+
+// Lane types of the vector instructions.  A vector occupies as many
+// consecutive registers as its bytes need (at most 4), lanes packed as in
+// memory; <N x i1> uses one byte per lane.
+enum VectorTypes : unsigned char {
+    VT_I8,
+    VT_I16,
+    VT_I32,
+    VT_I64,
+    VT_F32,
+    VT_F64,
+
+    __VT_LAST__
+};
+
+// Operations of vbin, vcmp and vcvt.
+enum VectorOps : unsigned char {
+    VOP_ADD,
+    VOP_SUB,
+    VOP_MUL,
+    VOP_UDIV,
+    VOP_SDIV,
+    VOP_UREM,
+    VOP_SREM,
+    VOP_AND,
+    VOP_OR,
+    VOP_XOR,
+    VOP_SHL,
+    VOP_LSHR,
+    VOP_ASHR,
+    VOP_FADD,
+    VOP_FSUB,
+    VOP_FMUL,
+    VOP_FDIV,
+
+    VOP_EQ,
+    VOP_NE,
+    VOP_ULT,
+    VOP_ULE,
+    VOP_UGT,
+    VOP_UGE,
+    VOP_SLT,
+    VOP_SLE,
+    VOP_SGT,
+    VOP_SGE,
+    VOP_FOEQ,
+    VOP_FONE,
+    VOP_FOLT,
+    VOP_FOLE,
+    VOP_FOGT,
+    VOP_FOGE,
+    VOP_FORD,
+    VOP_FUNO,
+    VOP_FUEQ,
+    VOP_FUNE,
+    VOP_FULT,
+    VOP_FULE,
+    VOP_FUGT,
+    VOP_FUGE,
+
+    VOP_TRUNC,
+    VOP_ZEXT,
+    VOP_SEXT,
+    VOP_SITOFP,
+    VOP_UITOFP,
+    VOP_FPTOSI,
+    VOP_FPTOUI,
+    VOP_FPCONV,
+
+    __VOP_LAST__
+};
+
 #endif
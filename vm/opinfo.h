@@ -0,0 +1,192 @@
+#ifndef opinfo_h_
+#define opinfo_h_
+
+#include <array>
+
+#include "opcode.h"
+
+static std::array<const char*, __CMD_LAST__> opcode_names = {};
+
+static inline void init_opcode_names() {
+// this is auto-generated
+    opcode_names[CMD_FD] = "fd";
+    opcode_names[CMD_MOV] = "mov";
+    opcode_names[CMD_GG] = "gg";
+    opcode_names[CMD_SG] = "sg";
+    opcode_names[CMD_CSS] = "css";
+    opcode_names[CMD_LD8] = "ld8";
+    opcode_names[CMD_LD16] = "ld16";
+    opcode_names[CMD_LD32] = "ld32";
+    opcode_names[CMD_LD64] = "ld64";
+    opcode_names[CMD_ST8] = "st8";
+    opcode_names[CMD_ST16] = "st16";
+    opcode_names[CMD_ST32] = "st32";
+    opcode_names[CMD_ST64] = "st64";
+    opcode_names[CMD_LEA] = "lea";
+    opcode_names[CMD_IADD] = "iadd";
+    opcode_names[CMD_ISUB] = "isub";
+    opcode_names[CMD_SMUL] = "smul";
+    opcode_names[CMD_UMUL] = "umul";
+    opcode_names[CMD_SREM] = "srem";
+    opcode_names[CMD_UREM] = "urem";
+    opcode_names[CMD_SDIV] = "sdiv";
+    opcode_names[CMD_UDIV] = "udiv";
+    opcode_names[CMD_AND] = "and";
+    opcode_names[CMD_OR] = "or";
+    opcode_names[CMD_XOR] = "xor";
+    opcode_names[CMD_SHL] = "shl";
+    opcode_names[CMD_LSHR] = "lshr";
+    opcode_names[CMD_ASHR] = "ashr";
+    opcode_names[CMD_INEG] = "ineg";
+    opcode_names[CMD_FADD] = "fadd";
+    opcode_names[CMD_FSUB] = "fsub";
+    opcode_names[CMD_FMUL] = "fmul";
+    opcode_names[CMD_FDIV] = "fdiv";
+    opcode_names[CMD_FREM] = "frem";
+    opcode_names[CMD_EQ] = "eq";
+    opcode_names[CMD_NE] = "ne";
+    opcode_names[CMD_SLT] = "slt";
+    opcode_names[CMD_SLE] = "sle";
+    opcode_names[CMD_SGT] = "sgt";
+    opcode_names[CMD_SGE] = "sge";
+    opcode_names[CMD_ULT] = "ult";
+    opcode_names[CMD_ULE] = "ule";
+    opcode_names[CMD_UGT] = "ugt";
+    opcode_names[CMD_UGE] = "uge";
+    opcode_names[CMD_FEQ] = "feq";
+    opcode_names[CMD_FNE] = "fne";
+    opcode_names[CMD_FLT] = "flt";
+    opcode_names[CMD_FLE] = "fle";
+    opcode_names[CMD_FGT] = "fgt";
+    opcode_names[CMD_FGE] = "fge";
+    opcode_names[CMD_JMP] = "jmp";
+    opcode_names[CMD_JNZ] = "jnz";
+    opcode_names[CMD_JZ] = "jz";
+    opcode_names[CMD_CALL0] = "call0";
+    opcode_names[CMD_CALL1] = "call1";
+    opcode_names[CMD_CALL2] = "call2";
+    opcode_names[CMD_CALL3] = "call3";
+    opcode_names[CMD_CALL4] = "call4";
+    opcode_names[CMD_CALL5] = "call5";
+    opcode_names[CMD_CALL6] = "call6";
+    opcode_names[CMD_CALL7] = "call7";
+    opcode_names[CMD_CALL8] = "call8";
+    opcode_names[CMD_RET] = "ret";
+    opcode_names[CMD_LEAVE] = "leave";
+    opcode_names[CMD_CSS_DYN] = "css_dyn";
+    opcode_names[CMD_ALLOCA] = "alloca";
+    opcode_names[CMD_STACKSAVE] = "stacksave";
+    opcode_names[CMD_STACKRESTORE] = "stackrestore";
+    opcode_names[CMD_TAILCALL0] = "tailcall0";
+    opcode_names[CMD_TAILCALL1] = "tailcall1";
+    opcode_names[CMD_TAILCALL2] = "tailcall2";
+    opcode_names[CMD_TAILCALL3] = "tailcall3";
+    opcode_names[CMD_TAILCALL4] = "tailcall4";
+    opcode_names[CMD_TAILCALL5] = "tailcall5";
+    opcode_names[CMD_TAILCALL6] = "tailcall6";
+    opcode_names[CMD_TAILCALL7] = "tailcall7";
+    opcode_names[CMD_TAILCALL8] = "tailcall8";
+    opcode_names[CMD_MEMCPY] = "memcpy";
+    opcode_names[CMD_MEMMOVE] = "memmove";
+    opcode_names[CMD_MEMSET] = "memset";
+    opcode_names[CMD_VBIN] = "vbin";
+    opcode_names[CMD_VCMP] = "vcmp";
+    opcode_names[CMD_VSEL] = "vsel";
+    opcode_names[CMD_VSHUF] = "vshuf";
+    opcode_names[CMD_VLD] = "vld";
+    opcode_names[CMD_VST] = "vst";
+    opcode_names[CMD_VINS] = "vins";
+    opcode_names[CMD_VEXT] = "vext";
+    opcode_names[CMD_VCVT] = "vcvt";
+    opcode_names[CMD_IADD32] = "iadd32";
+    opcode_names[CMD_ISUB32] = "isub32";
+    opcode_names[CMD_IMUL32] = "imul32";
+    opcode_names[CMD_SHL32] = "shl32";
+    opcode_names[CMD_ASHR32] = "ashr32";
+    opcode_names[CMD_SDIV32] = "sdiv32";
+    opcode_names[CMD_SREM32] = "srem32";
+    opcode_names[CMD_SLT32] = "slt32";
+    opcode_names[CMD_SLE32] = "sle32";
+    opcode_names[CMD_SGT32] = "sgt32";
+    opcode_names[CMD_SGE32] = "sge32";
+    opcode_names[CMD_ZEXT8] = "zext8";
+    opcode_names[CMD_ZEXT16] = "zext16";
+    opcode_names[CMD_ZEXT32] = "zext32";
+    opcode_names[CMD_SEXT8] = "sext8";
+    opcode_names[CMD_SEXT16] = "sext16";
+    opcode_names[CMD_SEXT32] = "sext32";
+    opcode_names[CMD_BEQ] = "beq";
+    opcode_names[CMD_BNE] = "bne";
+    opcode_names[CMD_BSLT] = "bslt";
+    opcode_names[CMD_BSLE] = "bsle";
+    opcode_names[CMD_BSGT] = "bsgt";
+    opcode_names[CMD_BSGE] = "bsge";
+    opcode_names[CMD_BULT] = "bult";
+    opcode_names[CMD_BULE] = "bule";
+    opcode_names[CMD_BUGT] = "bugt";
+    opcode_names[CMD_BUGE] = "buge";
+    opcode_names[CMD_BSLT32] = "bslt32";
+    opcode_names[CMD_BSLE32] = "bsle32";
+    opcode_names[CMD_BSGT32] = "bsgt32";
+    opcode_names[CMD_BSGE32] = "bsge32";
+    opcode_names[CMD_FRAME] = "frame";
+    opcode_names[CMD_SPILL] = "spill";
+    opcode_names[CMD_RELOAD] = "reload";
+    opcode_names[CMD_JTAB] = "jtab";
+    opcode_names[CMD_DATA] = "data";
+    opcode_names[CMD_LDX8] = "ldx8";
+    opcode_names[CMD_LDX16] = "ldx16";
+    opcode_names[CMD_LDX32] = "ldx32";
+    opcode_names[CMD_LDX64] = "ldx64";
+    opcode_names[CMD_STX8] = "stx8";
+    opcode_names[CMD_STX16] = "stx16";
+    opcode_names[CMD_STX32] = "stx32";
+    opcode_names[CMD_STX64] = "stx64";
+    opcode_names[CMD_PROF] = "prof";
+// 
+}
+
+static const char *const vector_type_names[__VT_LAST__] = {
+    "i8", "i16", "i32", "i64", "f32", "f64",
+};
+
+static const char *const vector_op_names[__VOP_LAST__] = {
+    "add", "sub", "mul", "udiv", "sdiv", "urem", "srem", "and", "or", "xor", "shl", "lshr", "ashr",
+    "fadd", "fsub", "fmul", "fdiv",
+    "eq", "ne", "ult", "ule", "ugt", "uge", "slt", "sle", "sgt", "sge",
+    "oeq", "one", "olt", "ole", "ogt", "oge", "ord", "uno", "ueq", "une", "ult", "ule", "ugt", "uge",
+    "trunc", "zext", "sext", "sitofp", "uitofp", "fptosi", "fptoui", "fpconv",
+};
+
+// Whether the instruction is followed by the register/constant mode byte,
+// i.e. takes a <Val> operand.
+static inline bool has_val_operand(unsigned char cmd) {
+    switch (cmd) {
+    case CMD_MOV:
+    case CMD_LD8: case CMD_LD16: case CMD_LD32: case CMD_LD64:
+    case CMD_ST8: case CMD_ST16: case CMD_ST32: case CMD_ST64:
+    case CMD_IADD: case CMD_ISUB: case CMD_SMUL: case CMD_UMUL:
+    case CMD_SREM: case CMD_UREM: case CMD_SDIV: case CMD_UDIV:
+    case CMD_AND: case CMD_OR: case CMD_XOR:
+    case CMD_SHL: case CMD_LSHR: case CMD_ASHR:
+    case CMD_FADD: case CMD_FSUB: case CMD_FMUL: case CMD_FDIV: case CMD_FREM:
+    case CMD_EQ: case CMD_NE:
+    case CMD_SLT: case CMD_SLE: case CMD_SGT: case CMD_SGE:
+    case CMD_ULT: case CMD_ULE: case CMD_UGT: case CMD_UGE:
+    case CMD_IADD32: case CMD_ISUB32: case CMD_IMUL32:
+    case CMD_SHL32: case CMD_ASHR32: case CMD_SDIV32: case CMD_SREM32:
+    case CMD_SLT32: case CMD_SLE32: case CMD_SGT32: case CMD_SGE32:
+    case CMD_BEQ: case CMD_BNE:
+    case CMD_BSLT: case CMD_BSLE: case CMD_BSGT: case CMD_BSGE:
+    case CMD_BULT: case CMD_BULE: case CMD_BUGT: case CMD_BUGE:
+    case CMD_BSLT32: case CMD_BSLE32: case CMD_BSGT32: case CMD_BSGE32:
+    case CMD_FEQ: case CMD_FNE: case CMD_FLT: case CMD_FLE: case CMD_FGT: case CMD_FGE:
+    case CMD_RET:
+    case CMD_ALLOCA:
+        return true;
+    default:
+        return false;
+    }
+}
+
+#endif
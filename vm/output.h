@@ -0,0 +1,397 @@
+#ifndef output_h_
+#define output_h_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+// Guest stdout: whatever printf and puts produce is collected in one buffer
+// and handed to write(2) when the buffer fills up, when the VM exits and,
+// if stdin is not a regular file, before the guest reads input so that
+// prompts show up in interactive sessions.
+
+struct GuestOutput
+{
+    enum { SIZE = 1 << 16 };
+
+    char buf[SIZE];
+    size_t len = 0;
+    bool flush_on_input = false;
+};
+
+static GuestOutput guest_out;
+
+static inline void write_all(const char *p, size_t n) {
+    while (n) {
+        ssize_t w = write(1, p, n);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            // stdout is gone; drop the output like stdio would
+            return;
+        }
+        p += w;
+        n -= w;
+    }
+}
+
+static inline void guest_out_flush() {
+    write_all(guest_out.buf, guest_out.len);
+    guest_out.len = 0;
+}
+
+static inline void guest_out_write(const char *p, size_t n) {
+    if (n > GuestOutput::SIZE - guest_out.len) {
+        guest_out_flush();
+        if (n >= GuestOutput::SIZE) {
+            write_all(p, n);
+            return;
+        }
+    }
+    memcpy(guest_out.buf + guest_out.len, p, n);
+    guest_out.len += n;
+}
+
+static inline void guest_out_fill(char c, size_t n) {
+    char chunk[64];
+    memset(chunk, c, sizeof(chunk));
+    for (; n > sizeof(chunk); n -= sizeof(chunk))
+        guest_out_write(chunk, sizeof(chunk));
+    guest_out_write(chunk, n);
+}
+
+
+// printf formats are split once into literal text and conversions.  The
+// common integer, character and string conversions are formatted here;
+// everything else is handed to snprintf one conversion at a time, with
+// floating-point conversions reading the register bits as a double.
+
+struct FormatPiece
+{
+    enum Kind : unsigned char {
+        LITERAL,    // literal text
+        SIGNED,     // %d, %i
+        UNSIGNED,   // %u
+        HEX,        // %x, %X
+        CHAR,       // %c
+        STRING,     // %s
+        INT_ARG,    // any other integer or pointer conversion, via snprintf
+        DOUBLE_ARG, // %f, %e, %g, %a, via snprintf
+        SKIP,       // %n: consumes its argument, prints nothing
+    };
+
+    Kind kind = LITERAL;
+    // argument width in bits for SIGNED, UNSIGNED and HEX
+    unsigned char bits = 32;
+    bool left = false, zero = false, upper = false;
+    bool star_width = false, star_prec = false;
+    unsigned width = 0;
+    // LITERAL: the text itself; INT_ARG, DOUBLE_ARG: the conversion for snprintf
+    std::string text;
+};
+
+struct FormatSpec
+{
+    std::vector<FormatPiece> pieces;
+};
+
+static FormatSpec parse_format(const char *fmt) {
+    FormatSpec spec;
+    std::string text;
+
+    for (const char *p = fmt; *p; ) {
+        if (*p != '%') {
+            text += *p++;
+            continue;
+        }
+        if (p[1] == '%') {
+            text += '%';
+            p += 2;
+            continue;
+        }
+
+        const char *start = p++;
+        FormatPiece c;
+        bool other_flags = false;
+        for (;; ++p) {
+            if (*p == '-')
+                c.left = true;
+            else if (*p == '0')
+                c.zero = true;
+            else if (*p == '+' || *p == ' ' || *p == '#' || *p == '\'')
+                other_flags = true;
+            else
+                break;
+        }
+        if (*p == '*') {
+            c.star_width = true;
+            ++p;
+        }
+        for (; *p >= '0' && *p <= '9'; ++p)
+            c.width = c.width * 10 + (*p - '0');
+        bool has_prec = false;
+        if (*p == '.') {
+            has_prec = true;
+            if (*++p == '*') {
+                c.star_prec = true;
+                ++p;
+            }
+            while (*p >= '0' && *p <= '9')
+                ++p;
+        }
+        const char *length = p;
+        if (p[0] == 'h' && p[1] == 'h') {
+            c.bits = 8;
+            p += 2;
+        } else if (p[0] == 'h') {
+            c.bits = 16;
+            ++p;
+        } else if (p[0] == 'l' && p[1] == 'l') {
+            c.bits = 64;
+            p += 2;
+        } else if (*p == 'l' || *p == 'j' || *p == 'z' || *p == 't') {
+            c.bits = 64;
+            ++p;
+        } else if (*p == 'L') {
+            ++p;
+        }
+
+        const char conv = *p;
+        if (!conv) {
+            text += start;
+            break;
+        }
+        ++p;
+
+        const bool simple = !other_flags && !has_prec && !c.star_width;
+        switch (conv) {
+        case 'd': case 'i':
+            c.kind = simple ? FormatPiece::SIGNED : FormatPiece::INT_ARG;
+            break;
+        case 'u':
+            c.kind = simple ? FormatPiece::UNSIGNED : FormatPiece::INT_ARG;
+            break;
+        case 'x': case 'X':
+            c.kind = simple ? FormatPiece::HEX : FormatPiece::INT_ARG;
+            c.upper = conv == 'X';
+            break;
+        case 'c':
+            c.kind = simple && !c.zero ? FormatPiece::CHAR : FormatPiece::INT_ARG;
+            break;
+        case 's':
+            c.kind = simple && !c.zero ? FormatPiece::STRING : FormatPiece::INT_ARG;
+            break;
+        case 'o': case 'p':
+            c.kind = FormatPiece::INT_ARG;
+            break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            c.kind = FormatPiece::DOUBLE_ARG;
+            break;
+        case 'n':
+            c.kind = FormatPiece::SKIP;
+            break;
+        default:
+            // not a conversion we know; print it as is
+            text.append(start, p);
+            continue;
+        }
+
+        if (!text.empty()) {
+            FormatPiece t;
+            t.text.swap(text);
+            spec.pieces.push_back(std::move(t));
+        }
+        if (c.kind == FormatPiece::INT_ARG)
+            c.text.assign(start, p);
+        else if (c.kind == FormatPiece::DOUBLE_ARG)
+            // the argument is always passed as a double
+            c.text.assign(start, length).append(1, conv);
+        spec.pieces.push_back(std::move(c));
+    }
+
+    if (!text.empty()) {
+        FormatPiece t;
+        t.text.swap(text);
+        spec.pieces.push_back(std::move(t));
+    }
+    return spec;
+}
+
+static inline char *format_decimal(char *end, uint64_t v) {
+    static const char digits[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    while (v >= 100) {
+        const unsigned d = (v % 100) * 2;
+        v /= 100;
+        *--end = digits[d + 1];
+        *--end = digits[d];
+    }
+    if (v >= 10) {
+        *--end = digits[v * 2 + 1];
+        *--end = digits[v * 2];
+    } else {
+        *--end = char('0' + v);
+    }
+    return end;
+}
+
+static inline char *format_hex(char *end, uint64_t v, bool upper) {
+    const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    do {
+        *--end = digits[v & 15];
+        v >>= 4;
+    } while (v);
+    return end;
+}
+
+// Writes sign + digits padded to c.width; returns the number of characters.
+static inline size_t put_padded(const FormatPiece &c, const char *sign, const char *s, size_t n) {
+    const size_t nsign = sign ? 1 : 0;
+    const size_t pad = c.width > n + nsign ? c.width - n - nsign : 0;
+    if (pad && !c.left && !c.zero)
+        guest_out_fill(' ', pad);
+    if (sign)
+        guest_out_write(sign, 1);
+    if (pad && !c.left && c.zero)
+        guest_out_fill('0', pad);
+    guest_out_write(s, n);
+    if (pad && c.left)
+        guest_out_fill(' ', pad);
+    return n + nsign + pad;
+}
+
+static inline uint64_t truncate_arg(uint64_t v, unsigned bits) {
+    return bits == 64 ? v : v & ((uint64_t(1) << bits) - 1);
+}
+
+static inline int64_t sign_extend_arg(uint64_t v, unsigned bits) {
+    return bits == 64 ? int64_t(v) : int64_t(v << (64 - bits)) >> (64 - bits);
+}
+
+template<typename T>
+static size_t put_snprintf(const char *conv, int width, int prec, bool star_width, bool star_prec, T value) {
+    char small[256];
+    int n;
+    if (star_width && star_prec)
+        n = snprintf(small, sizeof(small), conv, width, prec, value);
+    else if (star_width)
+        n = snprintf(small, sizeof(small), conv, width, value);
+    else if (star_prec)
+        n = snprintf(small, sizeof(small), conv, prec, value);
+    else
+        n = snprintf(small, sizeof(small), conv, value);
+    if (n < 0)
+        return 0;
+    if (size_t(n) < sizeof(small)) {
+        guest_out_write(small, n);
+        return n;
+    }
+
+    std::string big(n + 1, '\0');
+    if (star_width && star_prec)
+        snprintf(&big[0], big.size(), conv, width, prec, value);
+    else if (star_width)
+        snprintf(&big[0], big.size(), conv, width, value);
+    else if (star_prec)
+        snprintf(&big[0], big.size(), conv, prec, value);
+    else
+        snprintf(&big[0], big.size(), conv, value);
+    guest_out_write(big.data(), n);
+    return n;
+}
+
+// Formats args according to spec; returns the number of characters written.
+// Missing arguments read as zero.
+static uint64_t guest_printf(const FormatSpec &spec, const uint64_t *args, unsigned nargs) {
+    uint64_t total = 0;
+    unsigned a = 0;
+    auto next = [&]() -> uint64_t { return a < nargs ? args[a++] : 0; };
+
+    for (const FormatPiece &c : spec.pieces) {
+        char buf[24];
+        char *end = buf + sizeof(buf);
+        switch (c.kind) {
+        case FormatPiece::LITERAL:
+            guest_out_write(c.text.data(), c.text.size());
+            total += c.text.size();
+            break;
+        case FormatPiece::SIGNED: {
+            const int64_t v = sign_extend_arg(next(), c.bits);
+            const uint64_t mag = v < 0 ? 0 - uint64_t(v) : uint64_t(v);
+            char *s = format_decimal(end, mag);
+            total += put_padded(c, v < 0 ? "-" : nullptr, s, end - s);
+            break;
+        }
+        case FormatPiece::UNSIGNED: {
+            char *s = format_decimal(end, truncate_arg(next(), c.bits));
+            total += put_padded(c, nullptr, s, end - s);
+            break;
+        }
+        case FormatPiece::HEX: {
+            char *s = format_hex(end, truncate_arg(next(), c.bits), c.upper);
+            total += put_padded(c, nullptr, s, end - s);
+            break;
+        }
+        case FormatPiece::CHAR: {
+            const char ch = char(next());
+            total += put_padded(c, nullptr, &ch, 1);
+            break;
+        }
+        case FormatPiece::STRING: {
+            const char *s = (const char *) next();
+            if (!s)
+                s = "(null)";
+            total += put_padded(c, nullptr, s, strlen(s));
+            break;
+        }
+        case FormatPiece::INT_ARG:
+        case FormatPiece::DOUBLE_ARG: {
+            const int width = c.star_width ? int(next()) : 0;
+            const int prec = c.star_prec ? int(next()) : 0;
+            const uint64_t v = next();
+            const char last = c.text.back();
+            if (c.kind == FormatPiece::DOUBLE_ARG) {
+                double d;
+                memcpy(&d, &v, sizeof(d));
+                total += put_snprintf(c.text.c_str(), width, prec, c.star_width, c.star_prec, d);
+            } else if (last == 's' || last == 'p') {
+                const void *ptr = (const void *) v;
+                if (last == 's' && !ptr)
+                    ptr = "(null)";
+                total += put_snprintf(c.text.c_str(), width, prec, c.star_width, c.star_prec, ptr);
+            } else if (c.bits == 64) {
+                total += put_snprintf(c.text.c_str(), width, prec, c.star_width, c.star_prec, v);
+            } else {
+                // hh and h arguments are promoted to int as well
+                total += put_snprintf(c.text.c_str(), width, prec, c.star_width, c.star_prec, int(v));
+            }
+            break;
+        }
+        case FormatPiece::SKIP:
+            next();
+            break;
+        }
+    }
+    return total;
+}
+
+// Parsed formats keyed by the address of the format string.  Only string
+// literals and the read-only data segment are cached, and those never change,
+// so a format is parsed once.
+static std::unordered_map<const char *, FormatSpec> format_cache;
+
+static const FormatSpec &cached_format(const char *fmt) {
+    auto it = format_cache.find(fmt);
+    if (it == format_cache.end())
+        it = format_cache.emplace(fmt, parse_format(fmt)).first;
+    return it->second;
+}
+
+#endif
@@ -0,0 +1,801 @@
+/* compile with -std=c++17 */
+
+// rbvm-opt: bytecode optimizer for .rbvm files.
+//
+// Cleans up the patterns llvm-rbvm leaves behind: self moves, moves nobody
+// reads, jumps to jumps and to the next instruction, code after jumps that
+// nothing jumps to, and repeated gg of one name, and inlines calls to small
+// leaf functions.  Each function body is decoded into instructions,
+// transformed, and encoded again with its jump offsets and the nskip of its
+// fd recomputed.  Top-level code is copied as is; a function whose body
+// cannot be decoded is left alone.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <bitset>
+#include <map>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "bytecode.h"
+#include "reader.h"
+
+struct Instr
+{
+    std::string bytes;
+    DecodedInstr d;
+    int target = -1;     // index of the instruction jumped to
+    std::vector<int> table;     // jtab: index for each entry
+    bool dead = false;
+};
+
+struct OptStats
+{
+    unsigned functions = 0, skipped = 0;
+    size_t instrs_before = 0, instrs_after = 0;
+    size_t bytes_before = 0, bytes_after = 0;
+    unsigned self_moves = 0, copies = 0, dead = 0;
+    unsigned threaded = 0, jumps_to_next = 0, unreachable = 0, gg_reused = 0;
+    unsigned inlined = 0;
+};
+
+static OptStats stats;
+
+typedef std::bitset<256> RegSet;
+
+static void redecode(Instr &in) {
+    decode_instr(in.bytes.data(), in.bytes.size(), 0, in.d);
+}
+
+static bool is_jump(const Instr &in) {
+    return in.d.jump_pos >= 0;
+}
+
+static bool is_branch(const Instr &in) {
+    return is_jump(in) || in.d.table_pos >= 0;
+}
+
+// Calls f on the index of every instruction `in` may jump to.
+template <typename F>
+static void for_each_target(const Instr &in, F f) {
+    if (is_jump(in))
+        f(in.target);
+    for (int t : in.table)
+        f(t);
+}
+
+// Drops dead instructions; jumps to one of them go to the next live one,
+// which is where execution would have continued.
+static void compact(std::vector<Instr> &code) {
+    std::vector<int> remap(code.size() + 1);
+    int n = 0;
+    for (size_t k = 0; k < code.size(); ++k) {
+        remap[k] = n;
+        if (!code[k].dead)
+            ++n;
+    }
+    remap[code.size()] = n;
+
+    std::vector<Instr> live;
+    live.reserve(n);
+    for (auto &in : code)
+        if (!in.dead) {
+            if (is_jump(in))
+                in.target = remap[in.target];
+            for (int &t : in.table)
+                t = remap[t];
+            live.push_back(std::move(in));
+        }
+    code.swap(live);
+}
+
+static std::vector<bool> find_leaders(const std::vector<Instr> &code) {
+    std::vector<bool> leader(code.size() + 1);
+    leader[0] = true;
+    for (size_t k = 0; k < code.size(); ++k)
+        if (is_branch(code[k]) || !code[k].d.falls_through) {
+            leader[k + 1] = true;
+            for_each_target(code[k], [&](int t) { leader[t] = true; });
+        }
+    return leader;
+}
+
+// Registers whose address is taken with lea can change behind any store or
+// call; they are left as they are.
+static RegSet address_taken(const std::vector<Instr> &code) {
+    RegSet taken;
+    for (const auto &in : code)
+        if (in.d.op == CMD_LEA)
+            taken.set(in.d.uses[0]);
+    return taken;
+}
+
+static bool thread_jumps(std::vector<Instr> &code) {
+    bool changed = false;
+    auto thread = [&](int &target) {
+        int t = target;
+        for (int hops = 0; hops < 16 && t < (int) code.size() && code[t].d.op == CMD_JMP &&
+                           code[t].target != t; ++hops)
+            t = code[t].target;
+        if (t != target) {
+            target = t;
+            ++stats.threaded;
+            changed = true;
+        }
+    };
+    for (auto &in : code) {
+        if (is_jump(in))
+            thread(in.target);
+        for (int &t : in.table)
+            thread(t);
+    }
+    return changed;
+}
+
+static bool remove_unreachable(std::vector<Instr> &code) {
+    std::vector<bool> seen(code.size() + 1);
+    std::vector<int> work = {0};
+    while (!work.empty()) {
+        const int k = work.back();
+        work.pop_back();
+        if (k >= (int) code.size() || seen[k])
+            continue;
+        seen[k] = true;
+        if (code[k].d.falls_through)
+            work.push_back(k + 1);
+        for_each_target(code[k], [&](int t) { work.push_back(t); });
+    }
+    bool changed = false;
+    for (size_t k = 0; k < code.size(); ++k)
+        if (!seen[k]) {
+            code[k].dead = true;
+            ++stats.unreachable;
+            changed = true;
+        }
+    return changed;
+}
+
+// Conditions have no side effects, so a branch either way to the next
+// instruction goes nowhere.
+static bool remove_jumps_to_next(std::vector<Instr> &code) {
+    bool changed = false;
+    for (size_t k = 0; k < code.size(); ++k)
+        if (is_jump(code[k]) && code[k].target == (int) k + 1) {
+            code[k].dead = true;
+            ++stats.jumps_to_next;
+            changed = true;
+        }
+    return changed;
+}
+
+static Instr make_mov(unsigned char r1, unsigned char r2) {
+    Instr in;
+    in.bytes = {(char) CMD_MOV, (char) MODE_REG, (char) r1, (char) r2};
+    redecode(in);
+    return in;
+}
+
+// Within each block: drops `mov r, r`, reads the source of a copy instead of
+// its destination, and turns a gg of a name already in a register into a mov.
+static bool local_cleanup(std::vector<Instr> &code, const RegSet &taken) {
+    const std::vector<bool> leader = find_leaders(code);
+    bool changed = false;
+    int copy_of[256];
+    std::map<std::string, unsigned char> gg_reg;
+
+    for (size_t k = 0; k < code.size(); ++k) {
+        Instr &in = code[k];
+        if (leader[k]) {
+            std::fill(copy_of, copy_of + 256, -1);
+            gg_reg.clear();
+        }
+        if (in.d.opaque) {
+            std::fill(copy_of, copy_of + 256, -1);
+            gg_reg.clear();
+            continue;
+        }
+
+        for (unsigned u = 0; u < in.d.nuses; ++u) {
+            const unsigned char r = in.d.uses[u];
+            if (copy_of[r] < 0 || (in.d.ndefs && in.d.def_pos == in.d.use_pos[u]))
+                continue;
+            in.bytes[in.d.use_pos[u]] = (char) copy_of[r];
+            ++stats.copies;
+            changed = true;
+        }
+        redecode(in);
+
+        if (in.d.op == CMD_MOV && in.bytes[1] == MODE_REG && in.d.def == in.d.uses[0]) {
+            in.dead = true;
+            ++stats.self_moves;
+            changed = true;
+            continue;
+        }
+
+        if (in.d.op == CMD_GG) {
+            const std::string name = in.bytes.substr(5, in.bytes.size() - 6);
+            auto it = gg_reg.find(name);
+            if (it != gg_reg.end() && it->second != in.d.def) {
+                in = make_mov(in.d.def, it->second);
+                ++stats.gg_reused;
+                changed = true;
+            }
+        } else if (in.d.op == CMD_SG || (in.d.op >= CMD_CALL0 && in.d.op <= CMD_CALL8))
+            // the callee may change any global
+            gg_reg.clear();
+
+        if (in.d.ndefs) {
+            const unsigned char r = in.d.def;
+            copy_of[r] = -1;
+            for (int x = 0; x < 256; ++x)
+                if (copy_of[x] == r)
+                    copy_of[x] = -1;
+            for (auto it = gg_reg.begin(); it != gg_reg.end(); )
+                it = it->second == r ? gg_reg.erase(it) : std::next(it);
+        }
+
+        if (in.d.op == CMD_MOV && in.bytes[1] == MODE_REG && !taken[in.d.def] && !taken[in.d.uses[0]])
+            copy_of[in.d.def] = in.d.uses[0];
+        else if (in.d.op == CMD_GG && !taken[in.d.def] && !gg_reg.count(in.bytes.substr(5, in.bytes.size() - 6)))
+            gg_reg[in.bytes.substr(5, in.bytes.size() - 6)] = in.d.def;
+    }
+    return changed;
+}
+
+// Deletes side-effect-free instructions whose result is never read.
+static bool remove_dead(std::vector<Instr> &code, const RegSet &taken) {
+    const size_t n = code.size();
+    std::vector<RegSet> live_in(n + 1);
+    RegSet all;
+    all.set();
+
+    for (bool again = true; again; ) {
+        again = false;
+        for (size_t k = n; k-- > 0; ) {
+            const Instr &in = code[k];
+            RegSet out;
+            if (in.d.falls_through)
+                out |= live_in[k + 1];
+            for_each_target(in, [&](int t) { out |= live_in[t]; });
+
+            RegSet now;
+            if (in.d.opaque)
+                now = all;
+            else {
+                now = out;
+                if (in.d.ndefs)
+                    now.reset(in.d.def);
+                for (unsigned u = 0; u < in.d.nuses; ++u)
+                    now.set(in.d.uses[u]);
+            }
+            if (now != live_in[k]) {
+                live_in[k] = now;
+                again = true;
+            }
+        }
+    }
+
+    bool changed = false;
+    for (size_t k = 0; k < n; ++k) {
+        Instr &in = code[k];
+        if (!in.d.pure || in.d.opaque || !in.d.ndefs || taken[in.d.def])
+            continue;
+        RegSet out;
+        if (in.d.falls_through)
+            out |= live_in[k + 1];
+        if (!out[in.d.def]) {
+            in.dead = true;
+            ++stats.dead;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+// Decodes a function body into instructions with jump targets as indices;
+// fails if anything does not decode or a jump lands between instructions.
+static bool decode_body(const char *body, size_t size, std::vector<Instr> &code) {
+    std::map<size_t, int> index;
+    for (size_t at = 0; at < size; ) {
+        Instr in;
+        if (!decode_instr(body, size, at, in.d) || in.d.op == CMD_FD)
+            return false;
+        in.bytes.assign(body + at, in.d.size);
+        index[at] = code.size();
+        code.push_back(in);
+        at += in.d.size;
+    }
+    index[size] = code.size();
+
+    size_t at = 0;
+    auto resolve = [&](const Instr &in, unsigned pos, int &target) {
+        int64_t off;
+        memcpy(&off, in.bytes.data() + pos, sizeof(off));
+        auto it = index.find(at + off);
+        if (off < -(int64_t) at || it == index.end())
+            return false;
+        target = it->second;
+        return true;
+    };
+    for (auto &in : code) {
+        if (is_jump(in) && !resolve(in, in.d.jump_pos, in.target))
+            return false;
+        if (in.d.table_pos >= 0) {
+            in.table.resize(in.d.table_count);
+            for (unsigned e = 0; e < in.d.table_count; ++e)
+                if (!resolve(in, in.d.table_pos + e * 8, in.table[e]))
+                    return false;
+        }
+        at += in.d.size;
+    }
+    return true;
+}
+
+static std::string encode_body(const std::vector<Instr> &code) {
+    std::vector<size_t> offset(code.size() + 1);
+    for (size_t k = 0; k < code.size(); ++k)
+        offset[k + 1] = offset[k] + code[k].bytes.size();
+
+    std::string out;
+    for (size_t k = 0; k < code.size(); ++k) {
+        std::string bytes = code[k].bytes;
+        auto write = [&](unsigned pos, int target) {
+            const int64_t off = (int64_t) offset[target] - (int64_t) offset[k];
+            memcpy(&bytes[pos], &off, sizeof(off));
+        };
+        if (is_jump(code[k]))
+            write(code[k].d.jump_pos, code[k].target);
+        for (size_t e = 0; e < code[k].table.size(); ++e)
+            write(code[k].d.table_pos + e * 8, code[k].table[e]);
+        out += bytes;
+    }
+    return out;
+}
+
+// Inlining.  A function can be inlined when it is a leaf whose body only
+// touches the registers it names: no calls, no lea, nothing on the guest
+// stack or in a spill frame (those belong to the callee's own frame) and
+// no vector instructions.  It must be defined once and never set with sg,
+// so that a gg of its name always yields it.  A call whose register was
+// loaded by such a gg in the same block is replaced by
+//
+//     mov <m(1)> <Arg1> ... mov <m(N)> <ArgN>
+//     <the body, every register r renamed to m(r)>
+//
+// where the m(r) are registers the caller never names and each ret becomes
+// a mov of the result to the call's register and a jmp past the body.  The
+// cleanup afterwards drops the jumps to the next instruction and the copies.
+
+struct InlineCandidate
+{
+    unsigned nargs;
+    std::vector<Instr> code;
+};
+
+struct InlineOptions
+{
+    // largest body inlined, in instructions; 0 turns inlining off
+    unsigned threshold = 12;
+    // with a profile, functions never entered are not inlined and the hot
+    // ones (entered at least 1/hot_ratio as often as the most entered one)
+    // up to hot_factor times the threshold
+    std::map<std::string, uint64_t> entries;
+    uint64_t max_entries = 0;
+    unsigned hot_ratio = 100, hot_factor = 4;
+};
+
+static InlineOptions inline_options;
+static std::map<std::string, InlineCandidate> inline_candidates;
+
+static bool is_call(const Instr &in) {
+    return in.d.op >= CMD_CALL0 && in.d.op <= CMD_CALL8;
+}
+
+static bool can_inline(const std::vector<Instr> &code) {
+    for (const auto &in : code) {
+        switch (in.d.op) {
+        case CMD_LEA: case CMD_ALLOCA: case CMD_STACKSAVE: case CMD_STACKRESTORE:
+        case CMD_FRAME: case CMD_SPILL: case CMD_RELOAD:
+            return false;
+        default:
+            if (in.d.opaque || is_call(in) || (in.d.op >= CMD_TAILCALL0 && in.d.op <= CMD_TAILCALL8))
+                return false;
+        }
+    }
+    return true;
+}
+
+static unsigned inline_threshold(const std::string &name) {
+    const InlineOptions &o = inline_options;
+    if (o.entries.empty())
+        return o.threshold;
+    auto it = o.entries.find(name);
+    if (it == o.entries.end() || !it->second)
+        return 0;
+    return it->second * o.hot_ratio >= o.max_entries ? o.threshold * o.hot_factor : o.threshold;
+}
+
+static RegSet named_registers(const std::vector<Instr> &code) {
+    RegSet regs;
+    for (const auto &in : code) {
+        for (unsigned u = 0; u < in.d.nuses; ++u)
+            regs.set(in.d.uses[u]);
+        if (in.d.ndefs)
+            regs.set(in.d.def);
+    }
+    return regs;
+}
+
+static Instr make_jmp(int target) {
+    Instr in;
+    in.bytes = std::string(9, '\0');
+    in.bytes[0] = (char) CMD_JMP;
+    redecode(in);
+    in.target = target;
+    return in;
+}
+
+static Instr make_mov_const(unsigned char r, uint64_t value) {
+    Instr in;
+    in.bytes = {(char) CMD_MOV, (char) MODE_CONST, (char) r};
+    in.bytes.append((const char *) &value, sizeof(value));
+    redecode(in);
+    return in;
+}
+
+// Appends the body of `callee` for a call `call` to `out`, its registers
+// renamed by `reg`; the jumps in it get their final indices.
+static void expand_call(const Instr &call, const InlineCandidate &callee, const unsigned char *reg,
+                        std::vector<Instr> &out) {
+    const unsigned char result = call.d.uses[0];
+    for (unsigned a = 0; a < callee.nargs; ++a)
+        out.push_back(make_mov(reg[a + 1], call.d.uses[a + 1]));
+
+    const int base = out.size();
+    std::vector<int> index(callee.code.size() + 1);
+    int n = 0;
+    for (size_t k = 0; k < callee.code.size(); ++k) {
+        index[k] = base + n;
+        n += callee.code[k].d.op == CMD_RET ? 2 : 1;
+    }
+    const int end = base + n;
+    index[callee.code.size()] = end;
+
+    for (const auto &in : callee.code) {
+        if (in.d.op == CMD_RET) {
+            uint64_t value;
+            memcpy(&value, in.bytes.data() + 2, sizeof(value));
+            out.push_back(in.bytes[1] ? make_mov_const(result, value) : make_mov(result, reg[in.d.uses[0]]));
+            out.push_back(make_jmp(end));
+            continue;
+        }
+        if (in.d.op == CMD_LEAVE) {
+            out.push_back(make_jmp(end));
+            continue;
+        }
+        Instr copy = in;
+        for (unsigned u = 0; u < in.d.nuses; ++u)
+            copy.bytes[in.d.use_pos[u]] = (char) reg[in.d.uses[u]];
+        if (in.d.ndefs)
+            copy.bytes[in.d.def_pos] = (char) reg[in.d.def];
+        redecode(copy);
+        if (is_jump(copy))
+            copy.target = index[in.target];
+        for (int &t : copy.table)
+            t = index[t];
+        out.push_back(std::move(copy));
+    }
+}
+
+static bool inline_calls(std::vector<Instr> &code) {
+    if (inline_candidates.empty() || std::any_of(code.begin(), code.end(), [](const Instr &in) { return in.d.opaque; }))
+        return false;
+    const RegSet named = named_registers(code);
+    const std::vector<bool> leader = find_leaders(code);
+
+    std::vector<Instr> out;
+    std::vector<int> remap(code.size() + 1);
+    std::vector<size_t> own;     // instructions of `code` in `out`
+    std::map<unsigned char, std::string> gg_name;
+    bool changed = false;
+
+    for (size_t k = 0; k < code.size(); ++k) {
+        const Instr &in = code[k];
+        remap[k] = out.size();
+        if (leader[k])
+            gg_name.clear();
+
+        const InlineCandidate *callee = nullptr;
+        auto g = is_call(in) ? gg_name.find(in.d.uses[0]) : gg_name.end();
+        if (g != gg_name.end()) {
+            auto c = inline_candidates.find(g->second);
+            if (c != inline_candidates.end() && c->second.nargs == unsigned(in.d.op - CMD_CALL0))
+                callee = &c->second;
+        }
+
+        // the callee's registers, its arguments included, go to registers
+        // the caller does not name
+        unsigned char reg[256];
+        if (callee) {
+            RegSet used = named_registers(callee->code);
+            for (unsigned a = 1; a <= callee->nargs; ++a)
+                used.set(a);
+            unsigned next = 1;
+            for (unsigned r = 0; r < 256 && callee; ++r) {
+                if (!used[r])
+                    continue;
+                while (next < 256 && named[next])
+                    ++next;
+                if (next == 256)
+                    callee = nullptr;
+                else
+                    reg[r] = next++;
+            }
+        }
+
+        if (callee) {
+            expand_call(in, *callee, reg, out);
+            ++stats.inlined;
+            changed = true;
+        } else {
+            own.push_back(out.size());
+            out.push_back(in);
+        }
+
+        if (in.d.ndefs)
+            gg_name.erase(in.d.def);
+        if (in.d.op == CMD_GG)
+            gg_name[in.d.def] = in.bytes.substr(5, in.bytes.size() - 6);
+    }
+    remap[code.size()] = out.size();
+
+    for (size_t k : own) {
+        if (is_jump(out[k]))
+            out[k].target = remap[out[k].target];
+        for (int &t : out[k].table)
+            t = remap[t];
+    }
+    code.swap(out);
+    return changed;
+}
+
+// Finds the functions that can be inlined.
+static void find_inline_candidates(const char *bytecode, size_t size) {
+    if (!inline_options.threshold)
+        return;
+    std::map<std::string, unsigned> definitions;
+    std::vector<std::string> set_names;
+
+    auto scan = [&](const char *code, size_t n) {
+        for (size_t at = 0; at < n; ) {
+            DecodedInstr d;
+            if (!decode_instr(code, n, at, d))
+                return;
+            if (d.op == CMD_SG)
+                set_names.push_back(std::string(code + at + 5, d.size - 6));
+            at += d.size;
+        }
+    };
+
+    for (size_t at = 0; at < size; ) {
+        DecodedInstr d;
+        if (!decode_instr(bytecode, size, at, d))
+            break;
+        if (d.op != CMD_FD) {
+            if (d.op == CMD_SG)
+                set_names.push_back(std::string(bytecode + at + 5, d.size - 6));
+            at += d.size;
+            continue;
+        }
+
+        uint32_t len;
+        uint64_t nargs, nskip;
+        memcpy(&len, bytecode + at + 1, sizeof(len));
+        memcpy(&nargs, bytecode + at + d.size - 16, sizeof(nargs));
+        memcpy(&nskip, bytecode + at + d.size - 8, sizeof(nskip));
+        const char *body = bytecode + at + d.size;
+        if (nskip > size - (at + d.size))
+            break;
+        const std::string name(bytecode + at + 5, len);
+        ++definitions[name];
+        scan(body, nskip);
+
+        InlineCandidate c;
+        c.nargs = nargs;
+        if (nargs <= 8 && decode_body(body, nskip, c.code) && can_inline(c.code) &&
+            c.code.size() <= inline_threshold(name))
+            inline_candidates[name] = std::move(c);
+        at += d.size + nskip;
+    }
+
+    for (const auto &n : definitions)
+        if (n.second > 1)
+            inline_candidates.erase(n.first);
+    for (const auto &n : set_names)
+        inline_candidates.erase(n);
+}
+
+// Reads the function entry counts of a profile written by the VM's
+// --profile; other records are skipped.
+static bool read_profile(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return false;
+    char line[4096], name[4096];
+    unsigned long long count;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "entry %4095s %llu", name, &count) != 2)
+            continue;
+        inline_options.entries[name] = count;
+        inline_options.max_entries = std::max<uint64_t>(inline_options.max_entries, count);
+    }
+    fclose(f);
+    return true;
+}
+
+static bool optimize_body(const char *body, size_t size, std::string &out) {
+    std::vector<Instr> code;
+    if (!decode_body(body, size, code))
+        return false;
+    stats.instrs_before += code.size();
+    inline_calls(code);
+
+    const RegSet taken = address_taken(code);
+    for (int round = 0; round < 8; ++round) {
+        bool changed = thread_jumps(code);
+        changed |= remove_unreachable(code);
+        compact(code);
+        changed |= remove_jumps_to_next(code);
+        compact(code);
+        changed |= local_cleanup(code, taken);
+        compact(code);
+        changed |= remove_dead(code, taken);
+        compact(code);
+        if (!changed)
+            break;
+    }
+
+    stats.instrs_after += code.size();
+    out = encode_body(code);
+    return true;
+}
+
+// Whether top-level code jumps: its offsets could cross function bodies,
+// which change size.
+static bool top_level_jumps(const char *bytecode, size_t size) {
+    for (size_t at = 0; at < size; ) {
+        DecodedInstr d;
+        if (!decode_instr(bytecode, size, at, d))
+            return false;
+        if (d.jump_pos >= 0 || d.table_pos >= 0)
+            return true;
+        if (d.op == CMD_FD) {
+            uint64_t nskip;
+            memcpy(&nskip, bytecode + at + d.size - 8, sizeof(nskip));
+            at += nskip;
+        }
+        at += d.size;
+    }
+    return false;
+}
+
+static std::string optimize_program(const char *bytecode, size_t size) {
+    if (top_level_jumps(bytecode, size))
+        return std::string(bytecode, size);
+    find_inline_candidates(bytecode, size);
+
+    std::string out;
+    for (size_t at = 0; at < size; ) {
+        DecodedInstr d;
+        if (!decode_instr(bytecode, size, at, d)) {
+            // not ours to fix: keep the rest as it is
+            out.append(bytecode + at, size - at);
+            break;
+        }
+        // the offsets of prof records into the bodies do not survive
+        if (d.op == CMD_PROF) {
+            at += d.size;
+            continue;
+        }
+        if (d.op != CMD_FD) {
+            out.append(bytecode + at, d.size);
+            at += d.size;
+            continue;
+        }
+
+        uint64_t nskip;
+        memcpy(&nskip, bytecode + at + d.size - 8, sizeof(nskip));
+        const char *body = bytecode + at + d.size;
+        if (nskip > size - (at + d.size)) {
+            out.append(bytecode + at, size - at);
+            break;
+        }
+
+        std::string opt;
+        ++stats.functions;
+        if (!optimize_body(body, nskip, opt)) {
+            ++stats.skipped;
+            opt.assign(body, nskip);
+        }
+        stats.bytes_before += nskip;
+        stats.bytes_after += opt.size();
+
+        std::string header(bytecode + at, d.size);
+        const uint64_t new_nskip = opt.size();
+        memcpy(&header[d.size - 8], &new_nskip, sizeof(new_nskip));
+        out += header;
+        out += opt;
+        at += d.size + nskip;
+    }
+    return out;
+}
+
+static void print_report(FILE *f) {
+    fprintf(f, "functions:           %u (%u left unoptimized)\n", stats.functions, stats.skipped);
+    fprintf(f, "instructions:        %zu -> %zu\n", stats.instrs_before, stats.instrs_after);
+    fprintf(f, "function bytes:      %zu -> %zu\n", stats.bytes_before, stats.bytes_after);
+    fprintf(f, "self moves removed:  %u\n", stats.self_moves);
+    fprintf(f, "copies propagated:   %u\n", stats.copies);
+    fprintf(f, "dead code removed:   %u\n", stats.dead);
+    fprintf(f, "jumps threaded:      %u\n", stats.threaded);
+    fprintf(f, "jumps to next:       %u\n", stats.jumps_to_next);
+    fprintf(f, "unreachable removed: %u\n", stats.unreachable);
+    fprintf(f, "gg reused:           %u\n", stats.gg_reused);
+    fprintf(f, "calls inlined:       %u\n", stats.inlined);
+}
+
+static void usage() {
+    fprintf(stderr, "usage: rbvm-opt [--report] [--inline-threshold=N] [--profile=FILE] [input.rbvm] [-o output.rbvm]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    init_opcode_names();
+    const char *input = nullptr, *output = nullptr;
+    bool report = false;
+    for (int k = 1; k < argc; ++k) {
+        if (!strcmp(argv[k], "--report"))
+            report = true;
+        else if (!strncmp(argv[k], "--inline-threshold=", 19))
+            inline_options.threshold = strtoul(argv[k] + 19, nullptr, 10);
+        else if (!strncmp(argv[k], "--profile=", 10)) {
+            if (!read_profile(argv[k] + 10)) {
+                perror(argv[k] + 10);
+                exit(1);
+            }
+        }
+        else if (!strcmp(argv[k], "-o") && k + 1 < argc)
+            output = argv[++k];
+        else if (argv[k][0] == '-' || input)
+            usage();
+        else
+            input = argv[k];
+    }
+
+    const char *bytecode = nullptr;
+    size_t size = 0;
+    if (!input)
+        std::tie(bytecode, size) = read_text(stdin);
+    else {
+        FILE *file = fopen(input, "rb");
+        if (!file)
+            PANIC();
+        std::tie(bytecode, size) = read_text(file);
+        fclose(file);
+    }
+
+    const std::string out = optimize_program(bytecode, size);
+
+    FILE *file = output ? fopen(output, "wb") : stdout;
+    if (!file || fwrite(out.data(), 1, out.size(), file) != out.size())
+        PANIC();
+    if (output)
+        fclose(file);
+
+    if (report)
+        print_report(stderr);
+    return 0;
+}
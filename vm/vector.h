@@ -0,0 +1,511 @@
+#ifndef vector_h_
+#define vector_h_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <initializer_list>
+#include <type_traits>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "opcode.h"
+
+// Vector instructions: a vector lives in a group of up to 4 consecutive
+// registers (32 bytes) with its lanes packed as in memory.  Operations read
+// their sources into local buffers and write the whole destination group at
+// the end, so groups may overlap, and the bytes past the last lane are zero.
+//
+// vbin uses SSE2 (and AVX2 when the VM is built with -mavx2) for the common
+// 16- and 32-byte cases; everything else goes through the lane-wise scalar
+// code, which is also the fallback on hosts without those extensions.
+
+enum { VECTOR_BYTES = 32 };
+
+static const unsigned vector_lane_bytes[__VT_LAST__] = {1, 2, 4, 8, 4, 8};
+
+struct alignas(32) VectorBuf
+{
+    unsigned char b[VECTOR_BYTES];
+};
+
+[[noreturn]] static void vector_bad_instruction() {
+    fprintf(stderr, "malformed vector instruction\n");
+    exit(1);
+}
+
+// Lane bytes of a <lanes x type> vector; exits on anything that does not
+// fit a register group starting at the given registers.
+static inline unsigned vector_bytes(unsigned type, unsigned lanes, std::initializer_list<unsigned> regs) {
+    if (type >= __VT_LAST__ || !lanes || lanes * vector_lane_bytes[type] > VECTOR_BYTES)
+        vector_bad_instruction();
+    const unsigned bytes = lanes * vector_lane_bytes[type];
+    for (unsigned r : regs)
+        if (r + (bytes + 7) / 8 > 256)
+            vector_bad_instruction();
+    return bytes;
+}
+
+static inline void vector_read(VectorBuf &v, const uint64_t *regs, unsigned r, unsigned bytes) {
+    memcpy(v.b, regs + r, bytes);
+}
+
+static inline void vector_write(uint64_t *regs, unsigned r, const VectorBuf &v, unsigned bytes) {
+    const unsigned padded = (bytes + 7) & ~7u;
+    memcpy(regs + r, v.b, bytes);
+    memset(reinterpret_cast<unsigned char *>(regs + r) + bytes, 0, padded - bytes);
+}
+
+// lane accessors; floats are widened to double like scalar float registers
+
+static inline uint64_t lane_get_u(unsigned type, const unsigned char *p, unsigned k) {
+    switch (vector_lane_bytes[type]) {
+    case 1: return p[k];
+    case 2: { uint16_t v; memcpy(&v, p + 2 * k, 2); return v; }
+    case 4: { uint32_t v; memcpy(&v, p + 4 * k, 4); return v; }
+    default: { uint64_t v; memcpy(&v, p + 8 * k, 8); return v; }
+    }
+}
+
+static inline int64_t lane_get_s(unsigned type, const unsigned char *p, unsigned k) {
+    const unsigned bits = vector_lane_bytes[type] * 8;
+    const uint64_t v = lane_get_u(type, p, k);
+    return bits == 64 ? int64_t(v) : int64_t(v << (64 - bits)) >> (64 - bits);
+}
+
+static inline double lane_get_f(unsigned type, const unsigned char *p, unsigned k) {
+    if (type == VT_F32) {
+        float f;
+        memcpy(&f, p + 4 * k, 4);
+        return f;
+    }
+    double d;
+    memcpy(&d, p + 8 * k, 8);
+    return d;
+}
+
+static inline void lane_set_u(unsigned type, unsigned char *p, unsigned k, uint64_t v) {
+    const unsigned n = vector_lane_bytes[type];
+    // little-endian: the low bytes come first
+    memcpy(p + n * k, &v, n);
+}
+
+static inline void lane_set_f(unsigned type, unsigned char *p, unsigned k, double v) {
+    if (type == VT_F32) {
+        const float f = float(v);
+        memcpy(p + 4 * k, &f, 4);
+    } else {
+        memcpy(p + 8 * k, &v, 8);
+    }
+}
+
+// scalar register value of a lane and back; f32 scalars are held as double
+static inline uint64_t lane_to_scalar(unsigned type, const unsigned char *p, unsigned k) {
+    if (type == VT_F32) {
+        const double d = lane_get_f(type, p, k);
+        uint64_t bits;
+        memcpy(&bits, &d, 8);
+        return bits;
+    }
+    return lane_get_u(type, p, k);
+}
+
+static inline void scalar_to_lane(unsigned type, unsigned char *p, unsigned k, uint64_t v) {
+    if (type == VT_F32) {
+        double d;
+        memcpy(&d, &v, 8);
+        lane_set_f(type, p, k, d);
+    } else {
+        lane_set_u(type, p, k, v);
+    }
+}
+
+
+template<typename T, typename F>
+static inline void lanes_map2(unsigned lanes, unsigned char *d, const unsigned char *a, const unsigned char *b, F f) {
+    for (unsigned k = 0; k < lanes; ++k) {
+        T x, y;
+        memcpy(&x, a + k * sizeof(T), sizeof(T));
+        memcpy(&y, b + k * sizeof(T), sizeof(T));
+        const T r = f(x, y);
+        memcpy(d + k * sizeof(T), &r, sizeof(T));
+    }
+}
+
+template<typename U>
+static bool vbin_int(unsigned op, unsigned lanes, unsigned char *d, const unsigned char *a, const unsigned char *b) {
+    typedef typename std::make_signed<U>::type S;
+    const unsigned mask = sizeof(U) * 8 - 1;
+    const S smin = S(U(1) << mask);
+
+    switch (op) {
+    case VOP_ADD: lanes_map2<U>(lanes, d, a, b, [](U x, U y) { return U(x + y); }); break;
+    case VOP_SUB: lanes_map2<U>(lanes, d, a, b, [](U x, U y) { return U(x - y); }); break;
+    case VOP_MUL: lanes_map2<U>(lanes, d, a, b, [](U x, U y) { return U(uint64_t(x) * uint64_t(y)); }); break;
+    case VOP_AND: lanes_map2<U>(lanes, d, a, b, [](U x, U y) { return U(x & y); }); break;
+    case VOP_OR:  lanes_map2<U>(lanes, d, a, b, [](U x, U y) { return U(x | y); }); break;
+    case VOP_XOR: lanes_map2<U>(lanes, d, a, b, [](U x, U y) { return U(x ^ y); }); break;
+    // division by zero and shifting by the lane width or more are undefined
+    // in LLVM; they give 0 and a shift by the amount modulo the width here
+    case VOP_UDIV: lanes_map2<U>(lanes, d, a, b, [](U x, U y) { return U(y ? x / y : 0); }); break;
+    case VOP_UREM: lanes_map2<U>(lanes, d, a, b, [](U x, U y) { return U(y ? x % y : 0); }); break;
+    case VOP_SDIV:
+        lanes_map2<U>(lanes, d, a, b, [smin](U x, U y) {
+            return U(!y ? 0 : (S(x) == smin && S(y) == -1) ? x : U(S(x) / S(y)));
+        });
+        break;
+    case VOP_SREM:
+        lanes_map2<U>(lanes, d, a, b, [smin](U x, U y) {
+            return U(!y || (S(x) == smin && S(y) == -1) ? 0 : U(S(x) % S(y)));
+        });
+        break;
+    case VOP_SHL:  lanes_map2<U>(lanes, d, a, b, [mask](U x, U y) { return U(uint64_t(x) << (y & mask)); }); break;
+    case VOP_LSHR: lanes_map2<U>(lanes, d, a, b, [mask](U x, U y) { return U(x >> (y & mask)); }); break;
+    case VOP_ASHR: lanes_map2<U>(lanes, d, a, b, [mask](U x, U y) { return U(S(x) >> (y & mask)); }); break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+template<typename T>
+static bool vbin_float(unsigned op, unsigned lanes, unsigned char *d, const unsigned char *a, const unsigned char *b) {
+    switch (op) {
+    case VOP_FADD: lanes_map2<T>(lanes, d, a, b, [](T x, T y) { return x + y; }); break;
+    case VOP_FSUB: lanes_map2<T>(lanes, d, a, b, [](T x, T y) { return x - y; }); break;
+    case VOP_FMUL: lanes_map2<T>(lanes, d, a, b, [](T x, T y) { return x * y; }); break;
+    case VOP_FDIV: lanes_map2<T>(lanes, d, a, b, [](T x, T y) { return x / y; }); break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+#if defined(__SSE2__)
+static bool vbin_sse2(unsigned op, unsigned type, unsigned char *d, const unsigned char *a, const unsigned char *b) {
+    if (type == VT_F32 || type == VT_F64) {
+        if (type == VT_F32) {
+            const __m128 x = _mm_loadu_ps((const float *) a), y = _mm_loadu_ps((const float *) b);
+            __m128 r;
+            switch (op) {
+            case VOP_FADD: r = _mm_add_ps(x, y); break;
+            case VOP_FSUB: r = _mm_sub_ps(x, y); break;
+            case VOP_FMUL: r = _mm_mul_ps(x, y); break;
+            case VOP_FDIV: r = _mm_div_ps(x, y); break;
+            default: return false;
+            }
+            _mm_storeu_ps((float *) d, r);
+        } else {
+            const __m128d x = _mm_loadu_pd((const double *) a), y = _mm_loadu_pd((const double *) b);
+            __m128d r;
+            switch (op) {
+            case VOP_FADD: r = _mm_add_pd(x, y); break;
+            case VOP_FSUB: r = _mm_sub_pd(x, y); break;
+            case VOP_FMUL: r = _mm_mul_pd(x, y); break;
+            case VOP_FDIV: r = _mm_div_pd(x, y); break;
+            default: return false;
+            }
+            _mm_storeu_pd((double *) d, r);
+        }
+        return true;
+    }
+
+    const __m128i x = _mm_loadu_si128((const __m128i *) a), y = _mm_loadu_si128((const __m128i *) b);
+    __m128i r;
+    switch (op) {
+    case VOP_AND: r = _mm_and_si128(x, y); break;
+    case VOP_OR:  r = _mm_or_si128(x, y); break;
+    case VOP_XOR: r = _mm_xor_si128(x, y); break;
+    case VOP_ADD:
+        switch (type) {
+        case VT_I8:  r = _mm_add_epi8(x, y); break;
+        case VT_I16: r = _mm_add_epi16(x, y); break;
+        case VT_I32: r = _mm_add_epi32(x, y); break;
+        default:     r = _mm_add_epi64(x, y); break;
+        }
+        break;
+    case VOP_SUB:
+        switch (type) {
+        case VT_I8:  r = _mm_sub_epi8(x, y); break;
+        case VT_I16: r = _mm_sub_epi16(x, y); break;
+        case VT_I32: r = _mm_sub_epi32(x, y); break;
+        default:     r = _mm_sub_epi64(x, y); break;
+        }
+        break;
+    case VOP_MUL:
+        if (type != VT_I16)
+            return false;
+        r = _mm_mullo_epi16(x, y);
+        break;
+    default:
+        return false;
+    }
+    _mm_storeu_si128((__m128i *) d, r);
+    return true;
+}
+#endif
+
+#if defined(__AVX2__)
+static bool vbin_avx2(unsigned op, unsigned type, unsigned char *d, const unsigned char *a, const unsigned char *b) {
+    if (type == VT_F32 || type == VT_F64) {
+        if (type == VT_F32) {
+            const __m256 x = _mm256_loadu_ps((const float *) a), y = _mm256_loadu_ps((const float *) b);
+            __m256 r;
+            switch (op) {
+            case VOP_FADD: r = _mm256_add_ps(x, y); break;
+            case VOP_FSUB: r = _mm256_sub_ps(x, y); break;
+            case VOP_FMUL: r = _mm256_mul_ps(x, y); break;
+            case VOP_FDIV: r = _mm256_div_ps(x, y); break;
+            default: return false;
+            }
+            _mm256_storeu_ps((float *) d, r);
+        } else {
+            const __m256d x = _mm256_loadu_pd((const double *) a), y = _mm256_loadu_pd((const double *) b);
+            __m256d r;
+            switch (op) {
+            case VOP_FADD: r = _mm256_add_pd(x, y); break;
+            case VOP_FSUB: r = _mm256_sub_pd(x, y); break;
+            case VOP_FMUL: r = _mm256_mul_pd(x, y); break;
+            case VOP_FDIV: r = _mm256_div_pd(x, y); break;
+            default: return false;
+            }
+            _mm256_storeu_pd((double *) d, r);
+        }
+        return true;
+    }
+
+    const __m256i x = _mm256_loadu_si256((const __m256i *) a), y = _mm256_loadu_si256((const __m256i *) b);
+    __m256i r;
+    switch (op) {
+    case VOP_AND: r = _mm256_and_si256(x, y); break;
+    case VOP_OR:  r = _mm256_or_si256(x, y); break;
+    case VOP_XOR: r = _mm256_xor_si256(x, y); break;
+    case VOP_ADD:
+        switch (type) {
+        case VT_I8:  r = _mm256_add_epi8(x, y); break;
+        case VT_I16: r = _mm256_add_epi16(x, y); break;
+        case VT_I32: r = _mm256_add_epi32(x, y); break;
+        default:     r = _mm256_add_epi64(x, y); break;
+        }
+        break;
+    case VOP_SUB:
+        switch (type) {
+        case VT_I8:  r = _mm256_sub_epi8(x, y); break;
+        case VT_I16: r = _mm256_sub_epi16(x, y); break;
+        case VT_I32: r = _mm256_sub_epi32(x, y); break;
+        default:     r = _mm256_sub_epi64(x, y); break;
+        }
+        break;
+    case VOP_MUL:
+        if (type == VT_I16)
+            r = _mm256_mullo_epi16(x, y);
+        else if (type == VT_I32)
+            r = _mm256_mullo_epi32(x, y);
+        else
+            return false;
+        break;
+    default:
+        return false;
+    }
+    _mm256_storeu_si256((__m256i *) d, r);
+    return true;
+}
+#endif
+
+static bool vbin_simd(unsigned op, unsigned type, unsigned bytes, unsigned char *d, const unsigned char *a, const unsigned char *b) {
+#if defined(__AVX2__)
+    if (bytes == 32)
+        return vbin_avx2(op, type, d, a, b);
+#endif
+#if defined(__SSE2__)
+    if (bytes == 16 || bytes == 32) {
+        if (!vbin_sse2(op, type, d, a, b))
+            return false;
+        if (bytes == 32)
+            vbin_sse2(op, type, d + 16, a + 16, b + 16);
+        return true;
+    }
+#endif
+    (void) op; (void) type; (void) bytes; (void) d; (void) a; (void) b;
+    return false;
+}
+
+static bool vbin_lanes(unsigned op, unsigned type, unsigned lanes, unsigned char *d, const unsigned char *a, const unsigned char *b) {
+    switch (type) {
+    case VT_I8:  return vbin_int<uint8_t>(op, lanes, d, a, b);
+    case VT_I16: return vbin_int<uint16_t>(op, lanes, d, a, b);
+    case VT_I32: return vbin_int<uint32_t>(op, lanes, d, a, b);
+    case VT_I64: return vbin_int<uint64_t>(op, lanes, d, a, b);
+    case VT_F32: return vbin_float<float>(op, lanes, d, a, b);
+    default:     return vbin_float<double>(op, lanes, d, a, b);
+    }
+}
+
+static bool vcmp_lane(unsigned op, unsigned type, const unsigned char *a, const unsigned char *b, unsigned k) {
+    if (type == VT_F32 || type == VT_F64) {
+        const double x = lane_get_f(type, a, k), y = lane_get_f(type, b, k);
+        switch (op) {
+        case VOP_FOEQ: return x == y;
+        case VOP_FONE: return x < y || x > y;
+        case VOP_FOLT: return x < y;
+        case VOP_FOLE: return x <= y;
+        case VOP_FOGT: return x > y;
+        case VOP_FOGE: return x >= y;
+        case VOP_FORD: return x == x && y == y;
+        case VOP_FUNO: return x != x || y != y;
+        case VOP_FUEQ: return !(x < y || x > y);
+        case VOP_FUNE: return x != y;
+        case VOP_FULT: return !(x >= y);
+        case VOP_FULE: return !(x > y);
+        case VOP_FUGT: return !(x <= y);
+        case VOP_FUGE: return !(x < y);
+        default: vector_bad_instruction();
+        }
+    }
+
+    switch (op) {
+    case VOP_EQ:  return lane_get_u(type, a, k) == lane_get_u(type, b, k);
+    case VOP_NE:  return lane_get_u(type, a, k) != lane_get_u(type, b, k);
+    case VOP_ULT: return lane_get_u(type, a, k) < lane_get_u(type, b, k);
+    case VOP_ULE: return lane_get_u(type, a, k) <= lane_get_u(type, b, k);
+    case VOP_UGT: return lane_get_u(type, a, k) > lane_get_u(type, b, k);
+    case VOP_UGE: return lane_get_u(type, a, k) >= lane_get_u(type, b, k);
+    case VOP_SLT: return lane_get_s(type, a, k) < lane_get_s(type, b, k);
+    case VOP_SLE: return lane_get_s(type, a, k) <= lane_get_s(type, b, k);
+    case VOP_SGT: return lane_get_s(type, a, k) > lane_get_s(type, b, k);
+    case VOP_SGE: return lane_get_s(type, a, k) >= lane_get_s(type, b, k);
+    default: vector_bad_instruction();
+    }
+}
+
+static void vcvt_lane(unsigned op, unsigned from, unsigned to, const unsigned char *s, unsigned char *d, unsigned k) {
+    switch (op) {
+    case VOP_TRUNC:
+    case VOP_ZEXT:   lane_set_u(to, d, k, lane_get_u(from, s, k)); break;
+    case VOP_SEXT:   lane_set_u(to, d, k, lane_get_s(from, s, k)); break;
+    case VOP_SITOFP: lane_set_f(to, d, k, double(lane_get_s(from, s, k))); break;
+    case VOP_UITOFP: lane_set_f(to, d, k, double(lane_get_u(from, s, k))); break;
+    case VOP_FPTOSI: lane_set_u(to, d, k, uint64_t(int64_t(lane_get_f(from, s, k)))); break;
+    case VOP_FPTOUI: lane_set_u(to, d, k, uint64_t(lane_get_f(from, s, k))); break;
+    case VOP_FPCONV: lane_set_f(to, d, k, lane_get_f(from, s, k)); break;
+    default: vector_bad_instruction();
+    }
+}
+
+// Decodes and runs one vector instruction; i points past the opcode.
+static void vector_exec(unsigned char command, const char *bytecode, unsigned &i, uint64_t *regs) {
+    auto next = [&]() -> unsigned { return *(const unsigned char *)(bytecode + i++); };
+    VectorBuf a, b, m, d = {};
+
+    switch (command) {
+    case CMD_VBIN: {
+        const unsigned op = next(), type = next(), lanes = next();
+        const unsigned rd = next(), ra = next(), rb = next();
+        const unsigned bytes = vector_bytes(type, lanes, {rd, ra, rb});
+        vector_read(a, regs, ra, bytes);
+        vector_read(b, regs, rb, bytes);
+        if (!vbin_simd(op, type, bytes, d.b, a.b, b.b) && !vbin_lanes(op, type, lanes, d.b, a.b, b.b))
+            vector_bad_instruction();
+        vector_write(regs, rd, d, bytes);
+        break;
+    }
+    case CMD_VCMP: {
+        const unsigned op = next(), type = next(), lanes = next();
+        const unsigned rd = next(), ra = next(), rb = next();
+        const unsigned bytes = vector_bytes(type, lanes, {ra, rb});
+        vector_bytes(VT_I8, lanes, {rd});
+        vector_read(a, regs, ra, bytes);
+        vector_read(b, regs, rb, bytes);
+        for (unsigned k = 0; k < lanes; ++k)
+            d.b[k] = vcmp_lane(op, type, a.b, b.b, k);
+        vector_write(regs, rd, d, lanes);
+        break;
+    }
+    case CMD_VSEL: {
+        const unsigned type = next(), lanes = next();
+        const unsigned rd = next(), rm = next(), ra = next(), rb = next();
+        const unsigned bytes = vector_bytes(type, lanes, {rd, ra, rb});
+        vector_bytes(VT_I8, lanes, {rm});
+        vector_read(m, regs, rm, lanes);
+        vector_read(a, regs, ra, bytes);
+        vector_read(b, regs, rb, bytes);
+        const unsigned n = vector_lane_bytes[type];
+        for (unsigned k = 0; k < lanes; ++k)
+            memcpy(d.b + k * n, (m.b[k] & 1 ? a.b : b.b) + k * n, n);
+        vector_write(regs, rd, d, bytes);
+        break;
+    }
+    case CMD_VSHUF: {
+        const unsigned type = next(), lanes = next(), in_lanes = next();
+        const unsigned rd = next(), ra = next(), rb = next();
+        const unsigned bytes = vector_bytes(type, lanes, {rd});
+        const unsigned in_bytes = vector_bytes(type, in_lanes, {ra, rb});
+        vector_read(a, regs, ra, in_bytes);
+        vector_read(b, regs, rb, in_bytes);
+        const unsigned n = vector_lane_bytes[type];
+        for (unsigned k = 0; k < lanes; ++k) {
+            const unsigned idx = next();
+            // out-of-range indices stand for undef lanes
+            if (idx < in_lanes)
+                memcpy(d.b + k * n, a.b + idx * n, n);
+            else if (idx < 2 * in_lanes)
+                memcpy(d.b + k * n, b.b + (idx - in_lanes) * n, n);
+        }
+        vector_write(regs, rd, d, bytes);
+        break;
+    }
+    case CMD_VLD: {
+        const unsigned bytes = next(), rd = next(), rp = next();
+        vector_bytes(VT_I8, bytes, {rd});
+        memcpy(d.b, (const void *) regs[rp], bytes);
+        vector_write(regs, rd, d, bytes);
+        break;
+    }
+    case CMD_VST: {
+        const unsigned bytes = next(), rp = next(), rs = next();
+        vector_bytes(VT_I8, bytes, {rs});
+        memcpy((void *) regs[rp], regs + rs, bytes);
+        break;
+    }
+    case CMD_VINS: {
+        const unsigned type = next(), lanes = next();
+        const unsigned rd = next(), rs = next(), ridx = next();
+        const unsigned bytes = vector_bytes(type, lanes, {rd});
+        vector_read(d, regs, rd, bytes);
+        if (regs[ridx] < lanes)
+            scalar_to_lane(type, d.b, regs[ridx], regs[rs]);
+        vector_write(regs, rd, d, bytes);
+        break;
+    }
+    case CMD_VEXT: {
+        const unsigned type = next(), lanes = next();
+        const unsigned rd = next(), rs = next(), ridx = next();
+        const unsigned bytes = vector_bytes(type, lanes, {rs});
+        vector_read(a, regs, rs, bytes);
+        regs[rd] = regs[ridx] < lanes ? lane_to_scalar(type, a.b, regs[ridx]) : 0;
+        break;
+    }
+    case CMD_VCVT: {
+        const unsigned op = next(), from = next(), to = next(), lanes = next();
+        const unsigned rd = next(), rs = next();
+        const unsigned in_bytes = vector_bytes(from, lanes, {rs});
+        const unsigned bytes = vector_bytes(to, lanes, {rd});
+        vector_read(a, regs, rs, in_bytes);
+        for (unsigned k = 0; k < lanes; ++k)
+            vcvt_lane(op, from, to, a.b, d.b, k);
+        vector_write(regs, rd, d, bytes);
+        break;
+    }
+    default:
+        vector_bad_instruction();
+    }
+}
+
+#endif
@@ -69,7 +69,7 @@ public class CompilationAPI {
     try {
       return
           ExecutionController
-              .runAndJoin(compiler, "-S", "-emit-llvm", "-DJUDGE", fileId + "." + format, "-o", fileId + ".ll");
+              .runAndJoin(compiler, "-S", "-emit-llvm", "-O1", "-Xclang", "-disable-llvm-passes", "-DJUDGE", fileId + "." + format, "-o", fileId + ".ll");
     } catch (InterruptedException exc) {
       return null;
     }
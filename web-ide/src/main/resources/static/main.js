@@ -222,7 +222,7 @@ start_files_data = {
         "code": "/*\n    Bubble sort.\n\n    This example shows arrays, functions and templates work correctly.\n*/\n\n\n#include <stdio.h>\n#include <stdlib.h>\n#include <functional>\n#include <iterator>\n\n\ntemplate <class RandomAccessIterator,\n          class Comparator = std::less<typename std::iterator_traits<RandomAccessIterator>::value_type>>\nvoid bubble_sort(RandomAccessIterator first, \n                 RandomAccessIterator last, Comparator cmp = Comparator()) {\n    for (auto i = first; i != last; ++i)\n        for (auto j = i + 1; j != last; ++j) \n            if (cmp(*j, *i))\n                std::swap(*i, *j);\n}\n\n\nint main() {\n#ifdef JUDGE\n    size_t n = 7;\n    int *array = (int *) malloc(n * sizeof(int));\n    {\n        int *p = array;\n        *p++ = 1;\n        *p++ = 7;\n        *p++ = 2;\n        *p++ = 6;\n        *p++ = 4;\n        *p++ = 5;\n        *p++ = 3;\n    }\n#else\n    size_t n = 0;\n    scanf(\"%zu\", &n);\n    int* array = (int*)malloc(n * sizeof(int));\n    for (size_t i = 0; i < n; ++i)\n        scanf(\"%d\", &array[i]);\n#endif\n\n    bubble_sort(array, array + n);\n\n    for (size_t i = 0; i < n; ++i)\n        printf(\"%d \\n\", array[i]);\n\n    free(array);\n}\n"
     },
     "contract.cpp": {
-        "code": "//!SMART CONTRACT\n\n/*\n    This is an example of a smart contract.\n    We also provide a UI on our web site to deploy it.\n    Creator's address is 123.\n\n    Moreover it contains an implementation of a hash table.\n\n\n    This complex example embodies many features of programming languages.\n*/\n\n#include <stdio.h>\n#include <stdint.h>\n#include <stdlib.h>\n#include <new>\n#include <utility>\n\n#define smart_contract\n\ntemplate<class T> static\nT *\nalloc_for(size_t n)\n{\n    void *p = malloc(sizeof(T) * n);\n    if (n && !p) {\n        puts(\"Out of memory.\");\n        exit(1);\n    }\n    return static_cast<T *>(p);\n}\n\ntemplate<class T, class ...Args>\nT *\ncreate(Args&& ...args)\n{\n    T *ptr = alloc_for<T>(1);\n    new (ptr) T(std::forward<Args>(args)...);\n    return ptr;\n}\n\nclass Hashtable\n{\n    static uintptr_t zalloc8_(size_t n)\n    {\n        uint64_t *p = alloc_for<uint64_t>(n);\n        for (size_t i = 0; i < n; ++i) {\n            p[i] = 0;\n        }\n        return reinterpret_cast<uintptr_t>(p);\n    }\n\n    uint64_t ndata_;\n    uintptr_t keys_;\n    uintptr_t values_;\n\n    uint64_t *\n    get_keys_ptr_() const\n    {\n        return reinterpret_cast<uint64_t *>(keys_);\n    }\n\n    uint64_t *\n    get_values_ptr_() const\n    {\n        return reinterpret_cast<uint64_t *>(values_);\n    }\npublic:\n\n    Hashtable(size_t nreserve = 1024)\n        : ndata_(nreserve)\n        , keys_(zalloc8_(ndata_))\n        , values_(zalloc8_(ndata_))\n    {}\n\n    void\n    insert(uint64_t k, uint64_t v)\n    {\n        uint64_t *keys = get_keys_ptr_();\n        uint64_t *values = get_values_ptr_();\n        uint64_t i = k % ndata_;\n        while (keys[i] != k) {\n            if (!keys[i]) {\n                keys[i] = k;\n                break;\n            }\n            i = (i + 1) % ndata_;\n        }\n        values[i] = v;\n    }\n\n    uint64_t\n    get(uint64_t k) const\n    {\n        uint64_t *keys = get_keys_ptr_();\n        uint64_t *values = get_values_ptr_();\n        uint64_t i = k % ndata_;\n        while (keys[i]) {\n            if (keys[i] == k) {\n                return values[i];\n            }\n            i = (i + 1) % ndata_;\n        }\n        return 0;\n    }\n\n    ~Hashtable()\n    {\n        free(get_keys_ptr_());\n        free(get_values_ptr_());\n    }\n};\n\ntypedef uint64_t Address;\n\nclass ERC20\n{\n    uint64_t totalSupply() { return 0; }\n    uint64_t balanceOf(Address who) { return 0; }\n    bool transfer(Address from, Address to, uint64_t value) { return false; }\n};\n\nclass MyToken : public ERC20\n{\n    uintptr_t balances_;\n    uint64_t totalSupply_;\n\n    Hashtable *\n    get_balances_() const\n    {\n        return reinterpret_cast<Hashtable *>(balances_);\n    }\n\npublic:\n    MyToken(Address creator, uint64_t initial_balance)\n        : balances_(reinterpret_cast<uintptr_t>(create<Hashtable>()))\n        , totalSupply_(initial_balance)\n    {\n        get_balances_()->insert(creator, initial_balance);\n    }\n\n    uint64_t totalSupply() const\n    {\n        return totalSupply_;\n    }\n\n    uint64_t balanceOf(Address who) const\n    {\n        return get_balances_()->get(who);\n    }\n\n    bool transfer(Address from, Address to, uint64_t value)\n    {\n        Hashtable *b = get_balances_();\n        if (!to) {\n            return false;\n        }\n\n        const uint64_t prev_from_amount = b->get(from);\n        if (prev_from_amount < value) {\n            return false;\n        }\n\n        const uint64_t prev_to_amount = b->get(to);\n        if (UINT64_MAX - prev_to_amount < value) {\n            return false;\n        }\n\n        b->insert(from, prev_from_amount - value);\n        b->insert(to, prev_to_amount + value);\n        return true;\n    }\n\n    ~MyToken()\n    {\n        get_balances_()->~Hashtable();\n    }\n};\n"
+        "code": "//!SMART CONTRACT\n\n/*\n    This is an example of a smart contract.\n    We also provide a UI on our web site to deploy it.\n    Creator's address is 123.\n\n    Moreover it contains an implementation of a hash table.\n\n\n    This complex example embodies many features of programming languages.\n*/\n\n#include <stdio.h>\n#include <stdint.h>\n#include <stdlib.h>\n#include <new>\n#include <utility>\n\n#define smart_contract\n\ntemplate<class T> static\nT *\nalloc_for(size_t n)\n{\n    void *p = malloc(sizeof(T) * n);\n    if (n && !p) {\n        puts(\"Out of memory.\");\n        exit(1);\n    }\n    return static_cast<T *>(p);\n}\n\ntemplate<class T> static\nT *\nzalloc_for(size_t n)\n{\n    void *p = calloc(n, sizeof(T));\n    if (n && !p) {\n        puts(\"Out of memory.\");\n        exit(1);\n    }\n    return static_cast<T *>(p);\n}\n\ntemplate<class T, class ...Args>\nT *\ncreate(Args&& ...args)\n{\n    T *ptr = alloc_for<T>(1);\n    new (ptr) T(std::forward<Args>(args)...);\n    return ptr;\n}\n\nclass Hashtable\n{\n    uint64_t ndata_;\n    uintptr_t keys_;\n    uintptr_t values_;\n\n    uint64_t *\n    get_keys_ptr_() const\n    {\n        return reinterpret_cast<uint64_t *>(keys_);\n    }\n\n    uint64_t *\n    get_values_ptr_() const\n    {\n        return reinterpret_cast<uint64_t *>(values_);\n    }\npublic:\n\n    Hashtable(size_t nreserve = 1024)\n        : ndata_(nreserve)\n        , keys_(reinterpret_cast<uintptr_t>(zalloc_for<uint64_t>(ndata_)))\n        , values_(reinterpret_cast<uintptr_t>(zalloc_for<uint64_t>(ndata_)))\n    {}\n\n    void\n    insert(uint64_t k, uint64_t v)\n    {\n        uint64_t *keys = get_keys_ptr_();\n        uint64_t *values = get_values_ptr_();\n        uint64_t i = k % ndata_;\n        while (keys[i] != k) {\n            if (!keys[i]) {\n                keys[i] = k;\n                break;\n            }\n            i = (i + 1) % ndata_;\n        }\n        values[i] = v;\n    }\n\n    uint64_t\n    get(uint64_t k) const\n    {\n        uint64_t *keys = get_keys_ptr_();\n        uint64_t *values = get_values_ptr_();\n        uint64_t i = k % ndata_;\n        while (keys[i]) {\n            if (keys[i] == k) {\n                return values[i];\n            }\n            i = (i + 1) % ndata_;\n        }\n        return 0;\n    }\n\n    ~Hashtable()\n    {\n        free(get_keys_ptr_());\n        free(get_values_ptr_());\n    }\n};\n\ntypedef uint64_t Address;\n\nclass ERC20\n{\n    uint64_t totalSupply() { return 0; }\n    uint64_t balanceOf(Address who) { return 0; }\n    bool transfer(Address from, Address to, uint64_t value) { return false; }\n};\n\nclass MyToken : public ERC20\n{\n    uintptr_t balances_;\n    uint64_t totalSupply_;\n\n    Hashtable *\n    get_balances_() const\n    {\n        return reinterpret_cast<Hashtable *>(balances_);\n    }\n\npublic:\n    MyToken(Address creator, uint64_t initial_balance)\n        : balances_(reinterpret_cast<uintptr_t>(create<Hashtable>()))\n        , totalSupply_(initial_balance)\n    {\n        get_balances_()->insert(creator, initial_balance);\n    }\n\n    uint64_t totalSupply() const\n    {\n        return totalSupply_;\n    }\n\n    uint64_t balanceOf(Address who) const\n    {\n        return get_balances_()->get(who);\n    }\n\n    bool transfer(Address from, Address to, uint64_t value)\n    {\n        Hashtable *b = get_balances_();\n        if (!to) {\n            return false;\n        }\n\n        const uint64_t prev_from_amount = b->get(from);\n        if (prev_from_amount < value) {\n            return false;\n        }\n\n        const uint64_t prev_to_amount = b->get(to);\n        if (UINT64_MAX - prev_to_amount < value) {\n            return false;\n        }\n\n        b->insert(from, prev_from_amount - value);\n        b->insert(to, prev_to_amount + value);\n        return true;\n    }\n\n    ~MyToken()\n    {\n        get_balances_()->~Hashtable();\n    }\n};\n"
     }
 };
 